@@ -0,0 +1,635 @@
+/* Load generator. N simulated clients open one document over the text
+   protocol and edit it with a configurable mix of INS/DEL/UPD/UNDO/GET,
+   either closed-loop (each client waits for its last edit before sending
+   the next) or at a fixed total rate. Latencies go into log-linear
+   (HDR-style) histograms:
+
+   - INS/UPD: edit-to-broadcast, from sending the edit until the client
+     receives its own APPLY broadcast (the line text carries a tag naming
+     the client and sequence number);
+   - GET: from sending the request until the last line of the document.
+
+   DEL and UNDO broadcasts cannot be told apart from other clients', so
+   they count towards throughput but have no latency. At a fixed rate,
+   latency is measured from when each op was due to be sent, not from when
+   it was sent, so a stalled server shows up in the tail instead of
+   silently lowering the offered load. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#include "network.h"
+
+/* ---- log-linear histogram ---- */
+
+/* Values below 2 * HIST_SUB are exact; above, every power of two is split
+   into HIST_SUB buckets, so a value is known to within 1/HIST_SUB (~1.6%). */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_RANGES 40 /* up to 2^46 us */
+#define HIST_BUCKETS (2 * HIST_SUB + HIST_RANGES * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Hist;
+
+static int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v) - HIST_SUB_BITS; /* v >> e is in [HIST_SUB, 2 * HIST_SUB) */
+    if (e > HIST_RANGES) return HIST_BUCKETS - 1;
+    return 2 * HIST_SUB + (e - 1) * HIST_SUB + (int)((v >> e) - HIST_SUB);
+}
+
+/* largest value that falls into bucket i */
+static uint64_t hist_value(int i) {
+    if (i < 2 * HIST_SUB) return (uint64_t)i;
+    int e = (i - 2 * HIST_SUB) / HIST_SUB + 1;
+    uint64_t sub = (uint64_t)((i - 2 * HIST_SUB) % HIST_SUB + HIST_SUB);
+    return ((sub + 1) << e) - 1;
+}
+
+static void hist_record(Hist *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_add(Hist *to, const Hist *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) to->counts[i] += from->counts[i];
+    to->total += from->total;
+    if (from->max > to->max) to->max = from->max;
+}
+
+static uint64_t hist_percentile(const Hist *h, double p) {
+    if (!h->total) return 0;
+    uint64_t want = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/* the percentile distribution in HdrHistogram's text format, for plotting */
+static void hist_print_distribution(FILE *f, const Hist *h) {
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value(us)", "Percentile", "TotalCount", "1/(1-Percentile)");
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (!h->counts[i]) continue;
+        seen += h->counts[i];
+        double q = (double)seen / (double)h->total;
+        if (q < 1.0) fprintf(f, "%12llu %14.12f %10llu %14.2f\n", (unsigned long long)hist_value(i),
+                             q, (unsigned long long)seen, 1.0 / (1.0 - q));
+        else fprintf(f, "%12llu %14.12f %10llu\n", (unsigned long long)h->max, q, (unsigned long long)seen);
+    }
+    fprintf(f, "#[Max = %llu, Total count = %llu]\n", (unsigned long long)h->max,
+            (unsigned long long)h->total);
+}
+
+/* ---- configuration ---- */
+
+#define MIX_INS 0
+#define MIX_DEL 1
+#define MIX_UPD 2
+#define MIX_UNDO 3
+#define MIX_GET 4
+#define MIX_KINDS 5
+
+static const char *mix_names[MIX_KINDS] = { "ins", "del", "upd", "undo", "get" };
+static int mix[MIX_KINDS] = { 30, 20, 43, 2, 5 };
+static int mix_total;
+
+static const char *host = "127.0.0.1";
+static int n_clients = 16;
+static int n_threads = 4;
+static double duration = 10.0;     /* seconds */
+static double rate = 0;            /* total ops/s; 0 = closed loop */
+static int window = 1;             /* closed loop: measured ops in flight per client */
+static int doc_lines = 1000;
+static int line_len = 40;
+static char doc_name[DOC_NAME_MAX + 1];
+static int json = 0;
+static int distribution = 0;
+
+#define MAX_INFLIGHT 1024              /* per client; beyond this, ops are dropped */
+#define OP_TIMEOUT_US 5000000          /* an op without an answer by then is lost */
+#define DRAIN_US 2000000               /* wait this long for answers after the run */
+#define IN_BUF (BUFSIZE * 8)
+
+/* ---- clients ---- */
+
+typedef struct {
+    int fd;
+    int id;
+    int lines;                 /* document length as last seen */
+    int skip;                  /* document lines still to arrive */
+    int skip_is_get;           /* ...for one of our GETs, not a RESYNC */
+    int in_batch;              /* inside an APPLY BATCH ... END */
+    int resync;                /* the next DOC is a RESYNC */
+    uint64_t seq;
+    uint64_t oldest;           /* no measured edit before this seq is in flight */
+    uint64_t sent_at[MAX_INFLIGHT];    /* by seq % MAX_INFLIGHT; 0 = free */
+    uint64_t sent_seq[MAX_INFLIGHT];
+    int inflight;              /* measured edits awaiting their broadcast */
+    uint64_t get_at[MAX_INFLIGHT];     /* GETs are answered in order */
+    int get_head, get_len;
+    uint64_t next_send;        /* fixed rate: when the next op is due */
+    char in[IN_BUF];
+    size_t in_len;
+} BenchClient;
+
+typedef struct {
+    pthread_t tid;
+    int epfd;
+    BenchClient *clients;
+    int count;
+    uint64_t seed;
+    Hist ins, upd, get;
+    uint64_t sent, errors, lost, dropped, broadcasts, resyncs;
+} Worker;
+
+static uint64_t start_us, end_us;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t next_random(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    struct sockaddr_in serv = {0};
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons(PORT);
+    if (inet_pton(AF_INET, host, &serv.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("connect"); exit(1); }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("send");
+            exit(1);
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* blocking read of one line during setup */
+static void read_line(int fd, char *out, size_t cap) {
+    size_t len = 0;
+    for (;;) {
+        char ch;
+        ssize_t n = recv(fd, &ch, 1, 0);
+        if (n <= 0) {
+            fprintf(stderr, "server closed the connection during setup\n");
+            exit(1);
+        }
+        if (ch == '\n') break;
+        if (len + 1 < cap) out[len++] = ch;
+    }
+    out[len] = '\0';
+}
+
+static void wait_for(int fd, const char *prefix, char *line, size_t cap) {
+    do {
+        read_line(fd, line, cap);
+        if (strncmp(line, "ERR", 3) == 0) {
+            fprintf(stderr, "server: %s\n", line);
+            exit(1);
+        }
+    } while (strncmp(line, prefix, strlen(prefix)) != 0);
+}
+
+/* fill the document with doc_lines lines, in batches */
+static void preload(void) {
+    char line[BUFSIZE];
+    int fd = connect_server();
+    snprintf(line, sizeof(line), "OPEN %s\n", doc_name);
+    send_all(fd, line, strlen(line));
+    wait_for(fd, "OPENED", line, sizeof(line));
+    size_t bufcap = (size_t)10000 * (line_len + 64) + 64;
+    char *buf = (char*)malloc(bufcap);
+    if (!buf) { fprintf(stderr, "Memory allocation failed for preload\n"); exit(1); }
+    for (int done = 0; done < doc_lines; ) {
+        int n = doc_lines - done < 10000 ? doc_lines - done : 10000;
+        size_t len = snprintf(buf, bufcap, "BATCH %d\n", n);
+        for (int i = 0; i < n; i++) {
+            size_t start = len + snprintf(buf + len, bufcap - len, "INS %d ", done + i);
+            len = start + snprintf(buf + start, bufcap - start, "preload %d ", done + i);
+            while (len - start < (size_t)line_len) buf[len++] = 'x';
+            buf[len++] = '\n';
+        }
+        len += snprintf(buf + len, bufcap - len, "END\n");
+        send_all(fd, buf, len);
+        wait_for(fd, "APPLY@", line, sizeof(line));
+        done += n;
+    }
+    free(buf);
+    close(fd);
+}
+
+static void client_open(BenchClient *c, int id) {
+    char line[BUFSIZE];
+    memset(c, 0, sizeof(*c));
+    c->id = id;
+    c->fd = connect_server();
+    snprintf(line, sizeof(line), "OPEN %s\n", doc_name);
+    send_all(c->fd, line, strlen(line));
+    wait_for(c->fd, "OPENED", line, sizeof(line));
+    const char *p = strrchr(line, ' ');
+    c->lines = p ? atoi(p + 1) : 0;
+}
+
+static void send_op(Worker *w, BenchClient *c, uint64_t due) {
+    char buf[BUFSIZE];
+    size_t len;
+    int pick = (int)(next_random(&w->seed) % (uint64_t)mix_total), kind = 0;
+    while (pick >= mix[kind]) pick -= mix[kind++];
+    if ((kind == MIX_DEL || kind == MIX_UPD) && c->lines <= 0) kind = MIX_INS;
+    int pos = c->lines > 0 ? (int)(next_random(&w->seed) % (uint64_t)c->lines) : 0;
+
+    if (kind == MIX_INS || kind == MIX_UPD) {
+        uint64_t seq = ++c->seq;
+        int slot = (int)(seq % MAX_INFLIGHT);
+        if (c->sent_at[slot]) {
+            w->dropped++; /* too far behind: the slot is still waiting */
+            return;
+        }
+        len = snprintf(buf, sizeof(buf), "%s %d ", kind == MIX_INS ? "INS" : "UPD", pos);
+        size_t start = len;
+        len += snprintf(buf + len, sizeof(buf) - len, "c%d.%llu ", c->id, (unsigned long long)seq);
+        while (len - start < (size_t)line_len) buf[len++] = 'x';
+        buf[len++] = '\n';
+        c->sent_at[slot] = due;
+        c->sent_seq[slot] = seq;
+        c->inflight++;
+    } else if (kind == MIX_GET) {
+        if (c->get_len == MAX_INFLIGHT) {
+            w->dropped++;
+            return;
+        }
+        c->get_at[(c->get_head + c->get_len++) % MAX_INFLIGHT] = due;
+        len = snprintf(buf, sizeof(buf), "GET\n");
+    } else if (kind == MIX_DEL) {
+        len = snprintf(buf, sizeof(buf), "DEL %d\n", pos);
+    } else {
+        len = snprintf(buf, sizeof(buf), "UNDO\n");
+    }
+    send_all(c->fd, buf, len);
+    w->sent++;
+}
+
+static void complete_get(Worker *w, BenchClient *c) {
+    if (!c->get_len) return;
+    hist_record(&w->get, now_us() - c->get_at[c->get_head]);
+    c->get_head = (c->get_head + 1) % MAX_INFLIGHT;
+    c->get_len--;
+}
+
+/* an INS/UPD broadcast: if it carries our tag, the edit has been seen */
+static void check_tag(Worker *w, BenchClient *c, const char *text, int is_ins) {
+    char *end;
+    if (text[0] != 'c' || (int)strtol(text + 1, &end, 10) != c->id || *end != '.') return;
+    uint64_t seq = strtoull(end + 1, NULL, 10);
+    int slot = (int)(seq % MAX_INFLIGHT);
+    if (!c->sent_at[slot] || c->sent_seq[slot] != seq) return;
+    hist_record(is_ins ? &w->ins : &w->upd, now_us() - c->sent_at[slot]);
+    c->sent_at[slot] = 0;
+    c->inflight--;
+}
+
+static void handle_line(Worker *w, BenchClient *c, char *line) {
+    if (c->skip > 0) {
+        if (--c->skip == 0 && c->skip_is_get) complete_get(w, c);
+        return;
+    }
+    if (c->in_batch) {
+        if (strcmp(line, "END") == 0) c->in_batch = 0;
+        return;
+    }
+    if (strncmp(line, "APPLY@", 6) == 0) {
+        char *p = strchr(line, ' ');
+        if (!p) return;
+        p++;
+        w->broadcasts++;
+        if (strncmp(p, "INS ", 4) == 0 || strncmp(p, "UPD ", 4) == 0) {
+            int is_ins = p[0] == 'I';
+            char *text;
+            strtol(p + 4, &text, 10);
+            if (is_ins) c->lines++;
+            check_tag(w, c, text + (*text == ' '), is_ins);
+        } else if (strncmp(p, "DEL ", 4) == 0) {
+            c->lines--;
+        } else if (strncmp(p, "BATCH ", 6) == 0) {
+            c->in_batch = 1;
+        }
+    } else if (strncmp(line, "DOC@", 4) == 0) {
+        char *p = strchr(line, ' ');
+        c->lines = p ? atoi(p + 1) : 0;
+        c->skip = c->lines;
+        c->skip_is_get = !c->resync;
+        c->resync = 0;
+        if (c->skip == 0 && c->skip_is_get) complete_get(w, c);
+    } else if (strcmp(line, "RESYNC") == 0) {
+        /* the server dropped our queued broadcasts (we read too slowly) and
+           resends the document instead: edits in flight will not be seen */
+        c->resync = 1;
+        w->resyncs++;
+        for (int i = 0; i < MAX_INFLIGHT; i++) c->sent_at[i] = 0;
+        c->inflight = 0;
+    } else if (strncmp(line, "ERR", 3) == 0) {
+        /* e.g. a position made stale by another client. Answers come in
+           the order the ops were sent, so give up on the oldest edit in
+           flight rather than waiting for it to time out; if the ERR was
+           for a DEL, that edit's broadcast is simply not counted. */
+        w->errors++;
+        for (; c->oldest <= c->seq; c->oldest++) {
+            int slot = (int)(c->oldest % MAX_INFLIGHT);
+            if (c->sent_at[slot] && c->sent_seq[slot] == c->oldest) {
+                c->sent_at[slot] = 0;
+                c->inflight--;
+                break;
+            }
+        }
+    }
+}
+
+/* returns -1 once the server has closed the connection */
+static int client_read(Worker *w, BenchClient *c) {
+    for (;;) {
+        if (c->in_len == sizeof(c->in)) c->in_len = 0; /* a line longer than the buffer: drop it */
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) return -1;
+        c->in_len += (size_t)n;
+        char *start = c->in, *nl;
+        while ((nl = memchr(start, '\n', c->in_len - (size_t)(start - c->in)))) {
+            *nl = '\0';
+            handle_line(w, c, start);
+            start = nl + 1;
+        }
+        c->in_len -= (size_t)(start - c->in);
+        memmove(c->in, start, c->in_len);
+    }
+}
+
+/* ops that never got an answer (e.g. an UPD refused with ERR) */
+static void expire(Worker *w, BenchClient *c, uint64_t now) {
+    for (int i = 0; i < MAX_INFLIGHT && c->inflight; i++) {
+        if (c->sent_at[i] && c->sent_at[i] + OP_TIMEOUT_US < now) {
+            c->sent_at[i] = 0;
+            c->inflight--;
+            w->lost++;
+        }
+    }
+    while (c->get_len && c->get_at[c->get_head] + OP_TIMEOUT_US < now) {
+        c->get_head = (c->get_head + 1) % MAX_INFLIGHT;
+        c->get_len--;
+        w->lost++;
+    }
+}
+
+static void* worker_loop(void *arg) {
+    Worker *w = (Worker*)arg;
+    double interval = rate > 0 ? 1e6 * n_clients / rate : 0; /* us between a client's ops */
+    uint64_t last_expire = now_us();
+    struct epoll_event events[64];
+    for (;;) {
+        uint64_t now = now_us();
+        int sending = now < end_us, waiting = 0;
+        uint64_t wake = now + 10000;
+        for (int i = 0; i < w->count; i++) {
+            BenchClient *c = &w->clients[i];
+            if (sending && interval > 0) {
+                while (c->next_send <= now && now < end_us) {
+                    send_op(w, c, c->next_send);
+                    c->next_send += (uint64_t)interval;
+                }
+                if (c->next_send < wake) wake = c->next_send;
+            } else if (sending) {
+                /* closed loop: unmeasured ops (DEL, UNDO) go straight through */
+                int guard = 0;
+                while (c->inflight + c->get_len < window && guard++ < 64)
+                    send_op(w, c, now_us());
+            }
+            if (c->inflight || c->get_len) waiting = 1;
+        }
+        if (!sending && (!waiting || now > end_us + DRAIN_US)) break;
+        if (now - last_expire > 100000) {
+            for (int i = 0; i < w->count; i++) expire(w, &w->clients[i], now);
+            last_expire = now;
+        }
+        int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        int n = epoll_wait(w->epfd, events, 64, timeout);
+        for (int i = 0; i < n; i++) {
+            BenchClient *c = (BenchClient*)events[i].data.ptr;
+            if (client_read(w, c) < 0) {
+                fprintf(stderr, "client %d: connection closed by server\n", c->id);
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* ---- report ---- */
+
+static void print_json_hist(const char *name, const Hist *h, int last) {
+    printf("\"%s\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}%s",
+           name, (unsigned long long)h->total,
+           (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+           (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max, last ? "" : ",");
+}
+
+static void print_text_hist(const char *name, const Hist *h) {
+    printf("%-6s %10llu %10llu %10llu %10llu %10llu %10llu\n", name, (unsigned long long)h->total,
+           (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+           (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c clients] [-t threads] [-d seconds] [-r ops_per_s] [-w window]\n"
+                    "          [-n lines] [-l line_len] [-m ins=N,del=N,upd=N,undo=N,get=N]\n"
+                    "          [-D doc] [-h host] [-j] [-H]\n", prog);
+    fprintf(stderr, "  -c N  simulated clients (default %d)\n", n_clients);
+    fprintf(stderr, "  -t N  threads driving them (default %d)\n", n_threads);
+    fprintf(stderr, "  -d S  run for S seconds (default %.0f)\n", duration);
+    fprintf(stderr, "  -r R  send R ops/s in total (default: closed loop)\n");
+    fprintf(stderr, "  -w N  closed loop: measured ops in flight per client (default %d)\n", window);
+    fprintf(stderr, "  -n N  lines to preload into the document (default %d)\n", doc_lines);
+    fprintf(stderr, "  -l N  bytes per inserted or updated line (default %d)\n", line_len);
+    fprintf(stderr, "  -m M  op mix weights (default ins=%d,del=%d,upd=%d,undo=%d,get=%d)\n",
+            mix[MIX_INS], mix[MIX_DEL], mix[MIX_UPD], mix[MIX_UNDO], mix[MIX_GET]);
+    fprintf(stderr, "  -D D  document to open (default: a new one per run)\n");
+    fprintf(stderr, "  -h H  server address (default %s)\n", host);
+    fprintf(stderr, "  -j    print one JSON object instead of a table\n");
+    fprintf(stderr, "  -H    also print the INS+UPD latency distribution in HdrHistogram format\n");
+}
+
+static int parse_mix(char *spec) {
+    for (int k = 0; k < MIX_KINDS; k++) mix[k] = 0;
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        int k = 0;
+        if (!eq) return -1;
+        *eq = '\0';
+        while (k < MIX_KINDS && strcmp(tok, mix_names[k]) != 0) k++;
+        if (k == MIX_KINDS || atoi(eq + 1) < 0) return -1;
+        mix[k] = atoi(eq + 1);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    snprintf(doc_name, sizeof(doc_name), "bench-%d", (int)getpid());
+    while ((opt = getopt(argc, argv, "c:t:d:r:w:n:l:m:D:h:jH")) != -1) {
+        if (opt == 'c') n_clients = atoi(optarg);
+        else if (opt == 't') n_threads = atoi(optarg);
+        else if (opt == 'd') duration = atof(optarg);
+        else if (opt == 'r') rate = atof(optarg);
+        else if (opt == 'w') window = atoi(optarg);
+        else if (opt == 'n') doc_lines = atoi(optarg);
+        else if (opt == 'l') line_len = atoi(optarg);
+        else if (opt == 'm' && parse_mix(optarg) == 0) ;
+        else if (opt == 'D') snprintf(doc_name, sizeof(doc_name), "%s", optarg);
+        else if (opt == 'h') host = optarg;
+        else if (opt == 'j') json = 1;
+        else if (opt == 'H') distribution = 1;
+        else { usage(argv[0]); return 1; }
+    }
+    for (int k = 0; k < MIX_KINDS; k++) mix_total += mix[k];
+    if (n_clients < 1 || n_threads < 1 || duration <= 0 || window < 1 || doc_lines < 0 ||
+        line_len < 1 || line_len > BUFSIZE / 2 || mix[MIX_INS] + mix[MIX_UPD] + mix[MIX_GET] == 0) {
+        /* closed loop needs some op it can wait for */
+        usage(argv[0]);
+        return 1;
+    }
+    if (window > MAX_INFLIGHT) window = MAX_INFLIGHT;
+    if (n_threads > n_clients) n_threads = n_clients;
+    signal(SIGPIPE, SIG_IGN);
+
+    preload();
+    BenchClient *clients = (BenchClient*)malloc(sizeof(BenchClient) * n_clients);
+    Worker *workers = (Worker*)calloc(n_threads, sizeof(Worker));
+    if (!clients || !workers) { fprintf(stderr, "Memory allocation failed for clients\n"); exit(1); }
+    for (int i = 0; i < n_clients; i++) client_open(&clients[i], i);
+
+    start_us = now_us();
+    end_us = start_us + (uint64_t)(duration * 1e6);
+    for (int t = 0, first = 0; t < n_threads; t++) {
+        Worker *w = &workers[t];
+        int count = n_clients / n_threads + (t < n_clients % n_threads);
+        w->clients = clients + first;
+        w->count = count;
+        w->seed = 0x9E3779B97F4A7C15ull * (uint64_t)(t + 1);
+        w->epfd = epoll_create1(0);
+        if (w->epfd < 0) { perror("epoll_create1"); exit(1); }
+        for (int i = 0; i < count; i++) {
+            BenchClient *c = &w->clients[i];
+            /* spread the first ops of a fixed-rate run over one interval */
+            c->next_send = start_us + (rate > 0 ? (uint64_t)(1e6 * (first + i) / rate) : 0);
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) { perror("epoll_ctl"); exit(1); }
+        }
+        first += count;
+        pthread_create(&w->tid, NULL, worker_loop, w);
+    }
+
+    Hist *ins = (Hist*)calloc(1, sizeof(Hist)), *upd = (Hist*)calloc(1, sizeof(Hist));
+    Hist *get = (Hist*)calloc(1, sizeof(Hist)), *edits = (Hist*)calloc(1, sizeof(Hist));
+    if (!ins || !upd || !get || !edits) { fprintf(stderr, "Memory allocation failed for histograms\n"); exit(1); }
+    uint64_t sent = 0, errors = 0, lost = 0, dropped = 0, broadcasts = 0, resyncs = 0;
+    for (int t = 0; t < n_threads; t++) {
+        Worker *w = &workers[t];
+        pthread_join(w->tid, NULL);
+        close(w->epfd);
+        hist_add(ins, &w->ins);
+        hist_add(upd, &w->upd);
+        hist_add(get, &w->get);
+        sent += w->sent;
+        errors += w->errors;
+        lost += w->lost;
+        dropped += w->dropped;
+        broadcasts += w->broadcasts;
+        resyncs += w->resyncs;
+    }
+    hist_add(edits, ins);
+    hist_add(edits, upd);
+    for (int i = 0; i < n_clients; i++) close(clients[i].fd);
+
+    if (json) {
+        printf("{\"clients\":%d,\"threads\":%d,\"duration_s\":%.3f,\"rate\":%.1f,\"window\":%d,"
+               "\"doc_lines\":%d,\"line_len\":%d,\"mix\":{", n_clients, n_threads, duration, rate,
+               window, doc_lines, line_len);
+        for (int k = 0; k < MIX_KINDS; k++) printf("\"%s\":%d%s", mix_names[k], mix[k], k + 1 < MIX_KINDS ? "," : "");
+        printf("},\"sent\":%llu,\"ops_per_s\":%.1f,\"broadcasts\":%llu,\"errors\":%llu,\"lost\":%llu,"
+               "\"dropped\":%llu,\"resyncs\":%llu,\"latency_us\":{", (unsigned long long)sent, sent / duration,
+               (unsigned long long)broadcasts, (unsigned long long)errors, (unsigned long long)lost,
+               (unsigned long long)dropped, (unsigned long long)resyncs);
+        print_json_hist("ins", ins, 0);
+        print_json_hist("upd", upd, 0);
+        print_json_hist("edit", edits, 0);
+        print_json_hist("get", get, 1);
+        printf("}}\n");
+    } else {
+        printf("%d clients on %d threads, %.1f s, %s, document %s (%d lines preloaded)\n",
+               n_clients, n_threads, duration, rate > 0 ? "fixed rate" : "closed loop", doc_name, doc_lines);
+        printf("sent %llu ops (%.1f/s), %llu broadcasts received, %llu errors, %llu lost, %llu dropped, "
+               "%llu resyncs\n", (unsigned long long)sent, sent / duration, (unsigned long long)broadcasts,
+               (unsigned long long)errors, (unsigned long long)lost, (unsigned long long)dropped,
+               (unsigned long long)resyncs);
+        printf("%-6s %10s %10s %10s %10s %10s %10s\n", "us", "count", "p50", "p90", "p99", "p99.9", "max");
+        print_text_hist("INS", ins);
+        print_text_hist("UPD", upd);
+        print_text_hist("edit", edits);
+        print_text_hist("GET", get);
+    }
+    if (distribution) hist_print_distribution(json ? stderr : stdout, edits);
+    free(ins);
+    free(upd);
+    free(get);
+    free(edits);
+    free(workers);
+    free(clients);
+    return 0;
+}
\ No newline at end of file
@@ -1,20 +1,336 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "network.h"
+#include "text_buffer.h"
 
 int sockfd;
 
+/* The client keeps a replica of the open document in a TextBuffer. It is
+   filled by one GET when the client connects and then follows the
+   server's broadcasts: APPLY@<rev> INS/DEL/UPD/INSC/DELC and BATCH are
+   applied in place. Whatever cannot be replayed locally (UNDO, REDO,
+   RESTORE, LOAD, a large REPLACE, or a gap in the revisions) makes it ask
+   for "SYNC <rev>", and broadcasts are dropped until the answer arrives.
+   GET and PRINT are answered from the replica without asking the server.
+
+   The replica always shows the document as of `revision`. Broadcasts at or
+   below it are already included, and the next one must be revision + 1. */
+typedef struct {
+    TextBuffer *buffer;
+    uint64_t revision;
+    int synced;             /* following broadcasts; 0 while waiting for a SYNC or GET answer */
+    int want_sync;          /* ask for SYNC once the lock is released */
+    uint64_t replies;       /* SYNC/GET answers received, see barrier */
+    int resync;             /* the next DOC was pushed by the server ("RESYNC"), not asked for */
+
+    /* a header's lines still to come */
+    int block;              /* BLOCK_* */
+    int block_left;
+    uint64_t block_rev;     /* revision the block leaves the document at */
+    uint64_t block_next;    /* SYNC: revision of the next change */
+    int block_ok;           /* apply it (a BATCH or SYNC); DOC: is an answer */
+    char **doc;             /* DOC lines collected so far */
+    int doc_len;
+} Replica;
+
+#define BLOCK_NONE 0
+#define BLOCK_DOC 1         /* DOC@<rev> <n>: the document */
+#define BLOCK_SYNC 2        /* SYNC@<rev> <n>: the changes since the revision asked for */
+#define BLOCK_BATCH 3       /* APPLY@<rev> BATCH <n>: edits, printed as they come */
+#define BLOCK_PASS 4        /* FOUND/STATS: printed only */
+
+static Replica replica;
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_answered = PTHREAD_COND_INITIALIZER;
+
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t requests;   /* SYNC/GET sent; under send_lock, read atomically */
+
+/* Commands are collected here and sent in large writes. A SYNC asked for
+   between "BATCH" and its "END" would be taken as one of the batch's
+   lines, so it waits for the END. */
+static char out_buf[1 << 16];
+static size_t out_len;
+static int in_batch;
+static int syncs_deferred;
+static uint64_t deferred_rev;
+
+static void send_all(const char *data, size_t len) {
+    while (len) {
+        ssize_t n = send(sockfd, data, len, 0);
+        if (n <= 0) {
+            printf("Disconnected from server.\n");
+            exit(0);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/* send_lock held */
+static void flush_commands(void) {
+    send_all(out_buf, out_len);
+    out_len = 0;
+}
+
+/* send_lock held */
+static void append_command(const char *line, size_t len) {
+    if (out_len + len > sizeof(out_buf)) flush_commands();
+    if (len > sizeof(out_buf)) send_all(line, len);
+    else {
+        memcpy(out_buf + out_len, line, len);
+        out_len += len;
+    }
+}
+
+/* send_lock held */
+static void append_sync(uint64_t rev) {
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), "SYNC %llu\n", (unsigned long long)rev);
+    append_command(msg, len);
+}
+
+static void queue_command(const char *line, size_t len, int flush) {
+    pthread_mutex_lock(&send_lock);
+    append_command(line, len);
+    if (strncmp(line, "SYNC", 4) == 0 && !in_batch) {
+        __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED); /* answered like ours */
+    } else if (strncmp(line, "BATCH", 5) == 0) {
+        in_batch = 1;
+    } else if (in_batch && strncmp(line, "END", 3) == 0) {
+        in_batch = 0;
+        if (syncs_deferred) flush = 1;
+        for (; syncs_deferred; syncs_deferred--) append_sync(deferred_rev);
+    }
+    if (flush) flush_commands();
+    pthread_mutex_unlock(&send_lock);
+}
+
+/* Ask for the changes since the replica's revision (or the whole
+   document). Answers come back in order, so the answer to this request is
+   the one that brings replica.replies up to the returned number. */
+static uint64_t request_sync(void) {
+    pthread_mutex_lock(&replica_lock);
+    uint64_t rev = replica.revision;
+    pthread_mutex_unlock(&replica_lock);
+    pthread_mutex_lock(&send_lock);
+    uint64_t n = __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+    if (in_batch) {
+        if (syncs_deferred++ == 0) deferred_rev = rev;
+    } else {
+        append_sync(rev);
+        flush_commands();
+    }
+    pthread_mutex_unlock(&send_lock);
+    return n;
+}
+
+static void wait_answer(uint64_t n) {
+    pthread_mutex_lock(&replica_lock);
+    while (replica.replies < n) pthread_cond_wait(&replica_answered, &replica_lock);
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/* wait until the server has answered everything sent so far */
+static void barrier(void) {
+    wait_answer(request_sync());
+}
+
+/* ---- replica ---- */
+
+/* One INS/DEL/UPD/INSC/DELC as broadcast or replayed by SYNC (text after
+   exactly one space). Returns -1 if it does not fit the replica. */
+static int apply_change(TextBuffer *b, char *s) {
+    char *p;
+    if (strncmp(s, "INSC ", 5) == 0 || strncmp(s, "DELC ", 5) == 0) {
+        int pos = (int)strtol(s + 5, &p, 10);
+        int col = (int)strtol(p, &p, 10);
+        if (s[0] == 'D') return deleteChars_no_record(b, pos, col, (int)strtol(p, NULL, 10));
+        if (*p == ' ') p++;
+        return insertChars_no_record(b, pos, col, p, strlen(p));
+    }
+    if (strncmp(s, "INS ", 4) != 0 && strncmp(s, "DEL ", 4) != 0 && strncmp(s, "UPD ", 4) != 0) return -1;
+    int pos = (int)strtol(s + 4, &p, 10);
+    if (*p == ' ') p++;
+    if (pos < 0 || pos > b->line_count || (s[0] != 'I' && pos == b->line_count)) return -1;
+    if (s[0] == 'I') insertLine_no_record(b, pos, p);
+    else if (s[0] == 'D') deleteLine_no_record(b, pos);
+    else updateLine_no_record(b, pos, p);
+    return 0;
+}
+
+/* lock held: stop following broadcasts until a SYNC answer, asking for
+   one unless an answer is on its way already */
+static void replica_lost(void) {
+    replica.synced = 0;
+    if (__atomic_load_n(&requests, __ATOMIC_RELAXED) == replica.replies) replica.want_sync = 1;
+}
+
+static void replica_answer(void) {
+    if (replica.replies < __atomic_load_n(&requests, __ATOMIC_RELAXED)) replica.replies++;
+    pthread_cond_broadcast(&replica_answered);
+}
+
+static void block_end(void) {
+    if (replica.block == BLOCK_DOC) {
+        /* a document older than the replica would lose the broadcasts since */
+        if (!replica.synced || replica.block_rev >= replica.revision) {
+            buffer_replace_lines(replica.buffer, replica.doc, replica.doc_len);
+            replica.revision = replica.block_rev;
+            replica.synced = 1;
+        }
+        for (int i = 0; i < replica.doc_len; i++) line_release(replica.doc[i]);
+        free(replica.doc);
+        replica.doc = NULL;
+        replica.doc_len = 0;
+        if (replica.block_ok) replica_answer();
+    } else if (replica.block == BLOCK_SYNC) {
+        if (replica.block_ok) {
+            replica.synced = 1;
+        } else {
+            replica.synced = 0;
+            replica.want_sync = 1;
+        }
+        replica_answer();
+    } else if (replica.block == BLOCK_BATCH && replica.block_ok) {
+        replica.revision = replica.block_rev;
+    }
+    replica.block = BLOCK_NONE;
+}
+
+static void block_start(int kind, int n, uint64_t rev, int ok) {
+    replica.block = kind;
+    replica.block_left = n;
+    replica.block_rev = rev;
+    replica.block_ok = ok;
+    if (kind == BLOCK_DOC) {
+        replica.doc = (char**)malloc(sizeof(char*) * (n > 0 ? n : 1));
+        if (!replica.doc) {
+            fprintf(stderr, "Memory allocation failed for document lines\n");
+            exit(1);
+        }
+    }
+    if (n <= 0) block_end();
+}
+
+/* One line from the server; returns 1 if it is document content that is
+   not to be printed. Lock held. */
+static int replica_line(char *line) {
+    unsigned long long rev;
+    int n;
+    if (replica.block != BLOCK_NONE) {
+        if (replica.block == BLOCK_DOC) {
+            replica.doc[replica.doc_len++] = line_new(line);
+        } else if (replica.block == BLOCK_SYNC) {
+            /* changes the replica already has are skipped */
+            if (replica.block_ok && replica.block_next > replica.revision) {
+                if (apply_change(replica.buffer, line) == 0) replica.revision = replica.block_next;
+                else replica.block_ok = 0;
+            }
+            replica.block_next++;
+        } else if (replica.block == BLOCK_BATCH && replica.block_ok) {
+            if (apply_change(replica.buffer, line) < 0) {
+                replica.block_ok = 0;
+                replica_lost();
+            }
+        }
+        int kind = replica.block;
+        if (--replica.block_left == 0) block_end();
+        return kind == BLOCK_DOC || kind == BLOCK_SYNC;
+    }
+
+    if (strcmp(line, "RESYNC") == 0) {
+        /* the server dropped everything queued for us, answers included:
+           count what is outstanding as answered */
+        replica.resync = 1;
+        replica.replies = __atomic_load_n(&requests, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&replica_answered);
+    } else if (sscanf(line, "DOC@%llu %d", &rev, &n) == 2) {
+        int answer = !replica.resync;
+        replica.resync = 0;
+        block_start(BLOCK_DOC, n, rev, answer);
+    } else if (sscanf(line, "SYNC@%llu %d", &rev, &n) == 2) {
+        /* the n changes end at rev, one revision each */
+        replica.block_next = rev - n + 1;
+        block_start(BLOCK_SYNC, n, rev, replica.block_next <= replica.revision + 1);
+    } else if (sscanf(line, "APPLY@%llu BATCH %d", &rev, &n) == 2) {
+        int ok = replica.synced && rev == replica.revision + n;
+        if (replica.synced && rev > replica.revision && !ok) replica_lost();
+        block_start(BLOCK_BATCH, n, rev, ok);
+    } else if (sscanf(line, "APPLY@%llu ", &rev) == 1 && strchr(line, ' ')) {
+        if (!replica.synced || rev <= replica.revision) return 0;
+        if (rev == replica.revision + 1 && apply_change(replica.buffer, strchr(line, ' ') + 1) == 0)
+            replica.revision = rev;
+        else
+            replica_lost(); /* UNDO/REDO, or a gap */
+    } else if (sscanf(line, "RESTORED@%llu", &rev) == 1 || sscanf(line, "LOADED@%llu", &rev) == 1 ||
+               sscanf(line, "REPLACED@%llu", &rev) == 1) {
+        if (replica.synced && rev > replica.revision) replica_lost();
+    } else if (strncmp(line, "OPENED ", 7) == 0) {
+        /* another document: start over from revision 0 */
+        buffer_replace_lines(replica.buffer, NULL, 0);
+        replica.revision = 0;
+        replica_lost();
+    } else if (sscanf(line, "FOUND@%llu %*d %d", &rev, &n) == 2 || sscanf(line, "STATS %d", &n) == 1) {
+        block_start(BLOCK_PASS, n, 0, 0);
+    }
+    return 0;
+}
+
+static void handle_line(char *line) {
+    pthread_mutex_lock(&replica_lock);
+    int quiet = replica_line(line);
+    int want = replica.want_sync;
+    replica.want_sync = 0;
+    pthread_mutex_unlock(&replica_lock);
+    if (!quiet) printf("[SERVER] %s\n", line);
+    if (want) request_sync();
+}
+
 void *recv_thread(void *arg) {
+    (void)arg;
     char buf[BUFSIZE*2];
+    char *partial = NULL;
+    size_t partial_len = 0, partial_cap = 0;
     ssize_t n;
-    while ((n = recv(sockfd, buf, sizeof(buf)-1, 0)) > 0) {
-        buf[n] = '\0';
-        printf("[SERVER] %s", buf);
+    while ((n = recv(sockfd, buf, sizeof(buf), 0)) > 0) {
+        /* lines may span reads; the tail waits for the rest */
+        char *p = buf, *end = buf + n;
+        char *nl;
+        while ((nl = (char*)memchr(p, '\n', end - p))) {
+            *nl = '\0';
+            if (partial_len) {
+                size_t len = nl - p;
+                if (partial_len + len + 1 > partial_cap) {
+                    partial_cap = partial_len + len + 1;
+                    partial = (char*)realloc(partial, partial_cap);
+                    if (!partial) { fprintf(stderr, "Memory allocation failed for partial line\n"); exit(1); }
+                }
+                memcpy(partial + partial_len, p, len + 1);
+                handle_line(partial);
+                partial_len = 0;
+            } else {
+                handle_line(p);
+            }
+            p = nl + 1;
+        }
+        if (p < end) {
+            size_t len = end - p;
+            if (partial_len + len + 1 > partial_cap) {
+                partial_cap = (partial_len + len + 1) * 2;
+                partial = (char*)realloc(partial, partial_cap);
+                if (!partial) { fprintf(stderr, "Memory allocation failed for partial line\n"); exit(1); }
+            }
+            memcpy(partial + partial_len, p, len);
+            partial_len += len;
+        }
         fflush(stdout);
     }
     printf("Disconnected from server.\n");
@@ -22,9 +338,115 @@ void *recv_thread(void *arg) {
     return NULL;
 }
 
+/* GET and PRINT, from the replica */
+static void print_replica(int numbered) {
+    pthread_mutex_lock(&replica_lock);
+    if (numbered) {
+        printBuffer(replica.buffer);
+    } else {
+        printf("DOC@%llu %d%s\n", (unsigned long long)replica.revision, replica.buffer->line_count,
+               replica.synced ? "" : " (catching up)");
+        LineIter it;
+        line_iter_init(&it, replica.buffer->root);
+        for (LineNode *n = line_iter_next(&it); n; n = line_iter_next(&it)) printf("%s\n", n->line);
+    }
+    pthread_mutex_unlock(&replica_lock);
+    fflush(stdout);
+}
+
+static int is_read(const char *line) {
+    return strcmp(line, "GET\n") == 0 || strcmp(line, "PRINT\n") == 0 ||
+           strcmp(line, "GET") == 0 || strcmp(line, "PRINT") == 0;
+}
+
+/* Commands the script mode keeps in flight. The server queues at most 1024
+   messages for a client before it resyncs it, and every command is
+   answered or broadcast back, so after each PIPELINE_DEPTH commands the
+   script waits for the answer to the SYNC sent PIPELINE_DEPTH commands
+   earlier. */
+#define PIPELINE_DEPTH 256
+
+/* Non-interactive: send every command of the script without waiting for
+   answers. A GET or PRINT in the script first waits for everything before
+   it to be answered, then reads the replica. */
+static int run_script(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t got;
+    long sent = 0, window = 0, lineno = 0;
+    uint64_t marker = 0;
+    struct timespec t0, t1;
+    wait_answer(1); /* the GET the replica starts from */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ((got = getline(&line, &cap, f)) > 0) {
+        size_t len = (size_t)got;
+        lineno++;
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (len >= BUFSIZE) {
+            /* the server would refuse it; sending it would also skew the answer count */
+            fprintf(stderr, "%s:%ld: line longer than %d bytes skipped\n", path, lineno, BUFSIZE - 1);
+            continue;
+        }
+        if (len + 2 > cap) {
+            /* last line without a newline, in a buffer it fills exactly */
+            char *p = (char*)realloc(line, len + 2);
+            if (!p) {
+                fprintf(stderr, "Memory allocation failed for script line\n");
+                exit(1);
+            }
+            line = p;
+            cap = len + 2;
+        }
+        line[len++] = '\n';
+        line[len] = '\0';
+        if (strncmp(line, "QUIT", 4) == 0) break;
+        if (line[0] == '\n') continue;
+        if (is_read(line)) {
+            barrier();
+            print_replica(line[0] == 'P');
+            window = 0;
+            continue;
+        }
+        queue_command(line, len, 0);
+        sent++;
+        if (++window == PIPELINE_DEPTH) {
+            uint64_t next = request_sync();
+            wait_answer(marker);
+            marker = next;
+            window = 0;
+        }
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    barrier();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_mutex_lock(&replica_lock);
+    fprintf(stderr, "%ld commands in %.1f ms; document at revision %llu, %d lines\n", sent,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+            (unsigned long long)replica.revision, replica.buffer->line_count);
+    pthread_mutex_unlock(&replica_lock);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s script] [server_ip]\n", prog);
+    fprintf(stderr, "  -s F  send the commands in file F (- for stdin) without waiting for each answer, then exit\n");
+}
+
 int main(int argc, char **argv) {
     const char *server_ip = "127.0.0.1";
-    if (argc >= 2) server_ip = argv[1];
+    const char *script = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') script = optarg;
+        else { usage(argv[0]); return 1; }
+    }
+    if (optind < argc) server_ip = argv[optind];
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) { perror("socket"); return 1; }
@@ -37,26 +459,49 @@ int main(int argc, char **argv) {
     if (connect(sockfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
         perror("connect"); return 1;
     }
-    printf("Connected to server %s:%d\n", server_ip, PORT);
+    if (!script) printf("Connected to server %s:%d\n", server_ip, PORT);
+
+    replica.buffer = createBuffer();
+    /* the replica starts from one GET */
+    __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+    send_all("GET\n", 4);
 
     pthread_t tid;
     pthread_create(&tid, NULL, recv_thread, NULL);
+    if (script) return run_script(script);
 
     char line[BUFSIZE];
     printf("Commands:\n");
     printf("INS <pos> <text>      - insert line at pos (0-based)\n");
     printf("DEL <pos>             - delete line at pos\n");
     printf("UPD <pos> <text>      - update line at pos\n");
-    printf("UNDO / REDO / SNAP / GET / PRINT / QUIT\n");
+    printf("INSC <pos> <col> <text> - insert characters at column col of line pos\n");
+    printf("DELC <pos> <col> <len>  - delete len characters at column col of line pos\n");
+    printf("INS@<rev> ... / DEL@<rev> ... / UPD@<rev> ... - edit against revision rev\n");
+    printf("BATCH <n> ... END     - apply the next n INS/DEL/UPD lines as one edit\n");
+    printf("RESTORE <id>          - restore snapshot version id\n");
+    printf("DIFF <a> <b>          - changed lines between versions a and b\n");
+    printf("OPEN <name>           - switch to another document (created on first use)\n");
+    printf("SYNC <rev>            - changes made since revision rev\n");
+    printf("STATS                 - server metrics (Prometheus text format)\n");
+    printf("LOAD <path> / SAVE <path> - replace the document with a file / write it to one\n");
+    printf("FIND <pattern>        - list matches as line and column; FIND[a:b] searches lines a to b-1\n");
+    printf("REPLACE <word> <text> - replace every match as one undo step; also REPLACE[a:b]\n");
+    printf("GET / PRINT           - the document, from the local replica\n");
+    printf("UNDO / REDO / SNAP / LIST_VERSIONS / QUIT\n");
 
     while (1) {
         printf(">> ");
         if (!fgets(line, sizeof(line), stdin)) break;
         if (strncmp(line, "QUIT", 4) == 0) {
-            close(sockfd);
+            shutdown(sockfd, SHUT_RDWR);
             break;
         }
-        send(sockfd, line, strlen(line), 0);
+        if (is_read(line)) {
+            print_replica(line[0] == 'P');
+            continue;
+        }
+        queue_command(line, strlen(line), 1);
     }
     return 0;
 }
\ No newline at end of file
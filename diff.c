@@ -0,0 +1,97 @@
+#include "diff.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int ins;    /* 1 = insert b[y], 0 = delete a[x] */
+    int x, y;   /* edit graph point the edit starts from */
+} DiffEdit;
+
+int diff_keys(const uint64_t *a, int n, const uint64_t *b, int m, int max_edits, DiffHunk **out) {
+    *out = NULL;
+    int pre = 0;
+    while (pre < n && pre < m && a[pre] == b[pre]) pre++;
+    int suf = 0;
+    while (suf < n - pre && suf < m - pre && a[n - 1 - suf] == b[m - 1 - suf]) suf++;
+    a += pre; b += pre;
+    n -= pre + suf; m -= pre + suf;
+
+    if (n == 0 && m == 0) return 0;
+    if (n + m <= max_edits && (n == 0 || m == 0)) {
+        DiffHunk *h = (DiffHunk*)malloc(sizeof(DiffHunk));
+        if (!h) return -1;
+        h->a_pos = pre; h->a_len = n; h->b_pos = pre; h->b_len = m;
+        *out = h;
+        return 1;
+    }
+
+    int max_d = n + m < max_edits ? n + m : max_edits;
+    /* trace[d] holds V[-d..d] after step d, so memory is O(D^2) */
+    int **trace = (int**)calloc(max_d + 1, sizeof(int*));
+    int *v = (int*)malloc(sizeof(int) * (2 * max_d + 3));
+    if (!trace || !v) { free(trace); free(v); return -1; }
+    int *V = v + max_d + 1;
+    V[1] = 0;
+    int found = -1;
+    for (int d = 0; d <= max_d && found < 0; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x;
+            if (k == -d || (k != d && V[k - 1] < V[k + 1])) x = V[k + 1];
+            else x = V[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) { x++; y++; }
+            V[k] = x;
+            if (x >= n && y >= m) { found = d; break; }
+        }
+        trace[d] = (int*)malloc(sizeof(int) * (2 * d + 1));
+        if (!trace[d]) break;
+        memcpy(trace[d], V - d, sizeof(int) * (2 * d + 1));
+    }
+    free(v);
+    if (found < 0 || !trace[found]) {
+        for (int d = 0; d <= max_d; d++) free(trace[d]);
+        free(trace);
+        return -1;
+    }
+
+    /* walk back from (n, m), one edit per d */
+    DiffEdit *edits = (DiffEdit*)malloc(sizeof(DiffEdit) * (found + 1));
+    int x = n, y = m;
+    for (int d = found; d > 0 && edits; d--) {
+        int *Vp = trace[d - 1] + (d - 1); /* Vp[k] for k in [-(d-1), d-1] */
+        int k = x - y;
+        int pk;
+        if (k == -d || (k != d && Vp[k - 1] < Vp[k + 1])) pk = k + 1;
+        else pk = k - 1;
+        int px = Vp[pk], py = px - pk;
+        DiffEdit *e = &edits[d - 1];
+        e->ins = (pk == k + 1);
+        e->x = px;
+        e->y = py;
+        x = px;
+        y = py;
+    }
+    for (int d = 0; d <= found; d++) free(trace[d]);
+    free(trace);
+    if (!edits) return -1;
+
+    /* coalesce edits that touch each other into hunks */
+    DiffHunk *hunks = (DiffHunk*)malloc(sizeof(DiffHunk) * (found ? found : 1));
+    if (!hunks) { free(edits); return -1; }
+    int nh = 0;
+    for (int i = 0; i < found; i++) {
+        DiffEdit *e = &edits[i];
+        DiffHunk *h = nh ? &hunks[nh - 1] : NULL;
+        if (!h || h->a_pos + h->a_len != e->x + pre || h->b_pos + h->b_len != e->y + pre) {
+            h = &hunks[nh++];
+            h->a_pos = e->x + pre;
+            h->b_pos = e->y + pre;
+            h->a_len = h->b_len = 0;
+        }
+        if (e->ins) h->b_len++;
+        else h->a_len++;
+    }
+    free(edits);
+    *out = hunks;
+    return nh;
+}
\ No newline at end of file
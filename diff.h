@@ -0,0 +1,20 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stdint.h>
+
+/* One change region: a[a_pos, a_pos+a_len) is replaced by b[b_pos, b_pos+b_len) */
+typedef struct {
+    int a_pos;
+    int a_len;
+    int b_pos;
+    int b_len;
+} DiffHunk;
+
+/* Myers' O((N+M)D) diff of two key sequences (a line is equal when its key
+   is). Common prefix/suffix are skipped first. Writes a malloc'd hunk array
+   to *out (caller frees) and returns the hunk count, or -1 if more than
+   max_edits inserted+deleted lines would be needed. */
+int diff_keys(const uint64_t *a, int n, const uint64_t *b, int m, int max_edits, DiffHunk **out);
+
+#endif
\ No newline at end of file
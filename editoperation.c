@@ -1,4 +1,5 @@
 #include "editoperation.h"
+#include "text_buffer.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,20 +11,46 @@ OperationStack* createStack() {
         exit(1);
     }
     stack->top = NULL;
+    stack->bottom = NULL;
+    stack->count = 0;
+    stack->bytes = 0;
+    stack->opPool = NULL;
+    stack->owner = NULL;
     return stack;
 }
 
 void pushOperation(OperationStack *stack, EditOperation *op) {
     if (!stack || !op) return;
     op->next = stack->top;
+    op->prev = NULL;
+    if (stack->top) stack->top->prev = op;
+    else stack->bottom = op;
     stack->top = op;
+    stack->count++;
+    stack->bytes += op->bytes;
 }
 
 EditOperation* popOperation(OperationStack *stack) {
     if (!stack || !stack->top) return NULL;
     EditOperation *op = stack->top;
     stack->top = op->next;
+    if (stack->top) stack->top->prev = NULL;
+    else stack->bottom = NULL;
     op->next = NULL;
+    stack->count--;
+    stack->bytes -= op->bytes;
+    return op;
+}
+
+EditOperation* removeOldest(OperationStack *stack) {
+    if (!stack || !stack->bottom) return NULL;
+    EditOperation *op = stack->bottom;
+    stack->bottom = op->prev;
+    if (stack->bottom) stack->bottom->next = NULL;
+    else stack->top = NULL;
+    op->prev = NULL;
+    stack->count--;
+    stack->bytes -= op->bytes;
     return op;
 }
 
@@ -31,13 +58,34 @@ int isStackEmpty(OperationStack *stack) {
     return (!stack || stack->top == NULL);
 }
 
-void freeStack(OperationStack *stack) {
+void freeOperation(OperationStack *stack, EditOperation *op) {
+    if (!op) return;
+    EditOperation *child = op->children;
+    while (child) {
+        EditOperation *next = child->next;
+        freeOperation(stack, child);
+        child = next;
+    }
+    if (op->type == REPLACE_OP) {
+        buffer_release_snapshot(stack->owner, op->oldRoot);
+        buffer_release_snapshot(stack->owner, op->newRoot);
+    } else {
+        line_release(op->oldText);
+        line_release(op->newText);
+    }
+    if (stack->opPool) pool_free(stack->opPool, op);
+    else free(op);
+}
+
+void clearStack(OperationStack *stack) {
     if (!stack) return;
     while (!isStackEmpty(stack)) {
-        EditOperation *op = popOperation(stack);
-        if (op->oldText) free(op->oldText);
-        if (op->newText) free(op->newText);
-        free(op);
+        freeOperation(stack, popOperation(stack));
     }
+}
+
+void freeStack(OperationStack *stack) {
+    if (!stack) return;
+    clearStack(stack);
     free(stack);
 }
\ No newline at end of file
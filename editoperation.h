@@ -2,29 +2,49 @@
 #define EDITOPERATION_H
 
 #include <stdlib.h>
+#include "pool.h"
 
 
 #define INSERT_OP 0
 #define DELETE_OP 1
 #define UPDATE_OP 2
+#define BATCH_OP 3   /* group of ops undone/redone as one unit */
+#define INSERT_CHARS_OP 4   /* characters inserted into a line; newText holds only them */
+#define DELETE_CHARS_OP 5   /* characters deleted from a line; oldText holds only them */
+#define REPLACE_OP 6        /* the whole document replaced (LOAD): oldRoot or newRoot */
 
 typedef struct EditOperation {
     int type;               
     int position;           
+    int column;             /* INSERT_CHARS_OP / DELETE_CHARS_OP: first character */
     char *oldText;          
     char *newText;          
-    struct EditOperation *next;
+    size_t bytes;           /* memory held by the op and its children, for history budgets */
+    long long stamp;        /* monotonic ms when last recorded/merged */
+    struct LineNode *oldRoot;       /* REPLACE_OP: the document undo brings back... */
+    struct LineNode *newRoot;       /* ...and redo; only the one not current is held, the other is NULL */
+    struct EditOperation *children; /* BATCH_OP: grouped ops, in the order the next undo/redo walks them */
+    struct EditOperation *next;     /* towards older ops */
+    struct EditOperation *prev;     /* towards newer ops */
 } EditOperation;
 
-typedef struct {
+typedef struct OperationStack {
     EditOperation *top;
+    EditOperation *bottom;  /* oldest op, first to be evicted */
+    int count;
+    size_t bytes;           /* sum of op->bytes */
+    ObjPool *opPool;        /* where popped-and-freed ops go; NULL = malloc'd */
+    struct TextBuffer *owner; /* releases REPLACE_OP documents */
 } OperationStack;
 
 
 OperationStack* createStack();
 void pushOperation(OperationStack *stack, EditOperation *op);
 EditOperation* popOperation(OperationStack *stack);
+EditOperation* removeOldest(OperationStack *stack); /* O(1) */
 int isStackEmpty(OperationStack *stack);
+void clearStack(OperationStack *stack); /* frees the ops, keeps the stack */
 void freeStack(OperationStack *stack);
+void freeOperation(OperationStack *stack, EditOperation *op); /* op belongs to stack's owner */
 
 #endif
\ No newline at end of file
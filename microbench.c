@@ -0,0 +1,392 @@
+/* Microbenchmarks for the core data structures, without the network:
+   random-position edits at 1k to 1M lines, typing within a line,
+   undo/redo chains, whole document serialization and bulk import,
+   FIND/REPLACE searches, and snapshot/restore with many versions.
+
+   Every benchmark reports nanoseconds per op (best of -r runs) and, when
+   built with COUNT_ALLOCS and the malloc wrappers (see the Makefile's
+   microbench target), bytes and calls of malloc/calloc/realloc per op.
+   Output is one line per benchmark; save a run and pass it back with -b
+   to print the change against it, and with -t to fail on regressions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "text_buffer.h"
+#include "version.h"
+#include "search.h"
+
+/* ---- allocation counting ---- */
+
+static uint64_t alloc_bytes, alloc_calls;
+
+#ifdef COUNT_ALLOCS
+/* linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void *p, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    alloc_bytes += size;
+    alloc_calls++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    alloc_bytes += n * size;
+    alloc_calls++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void *p, size_t size) {
+    alloc_bytes += size;
+    alloc_calls++;
+    return __real_realloc(p, size);
+}
+#endif
+
+/* ---- harness ---- */
+
+#define MAX_RESULTS 64
+#define MAX_NAME 48
+
+typedef struct {
+    char name[MAX_NAME];
+    double ns;          /* per op */
+    double bytes;       /* allocated per op */
+    double allocs;      /* allocator calls per op */
+} Result;
+
+static Result results[MAX_RESULTS];
+static int n_results;
+static int repeats = 3;
+static int max_lines = 1000000;
+static const char *filter;
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* One benchmark: setup builds fresh state, run does `ops` operations on
+   it (the timed part), teardown frees it. Repeated, keeping the fastest
+   run; allocations are taken from the same run. */
+typedef struct {
+    void *(*setup)(int n);
+    void (*run)(void *state, int n, int ops);
+    void (*teardown)(void *state);
+} Bench;
+
+static void bench(const char *name, const Bench *b, int n, int ops) {
+    char full[MAX_NAME];
+    snprintf(full, sizeof(full), "%s/%d", name, n);
+    if ((filter && !strstr(full, filter)) || n > max_lines || n_results == MAX_RESULTS) return;
+    Result *r = &results[n_results++];
+    snprintf(r->name, sizeof(r->name), "%s", full);
+    r->ns = -1;
+    for (int i = 0; i < repeats; i++) {
+        rng = 88172645463325252ull; /* same positions every run */
+        void *state = b->setup(n);
+        uint64_t bytes0 = alloc_bytes, calls0 = alloc_calls;
+        uint64_t t0 = now_ns();
+        b->run(state, n, ops);
+        uint64_t t1 = now_ns();
+        double ns = (double)(t1 - t0) / ops;
+        if (r->ns < 0 || ns < r->ns) {
+            r->ns = ns;
+            r->bytes = (double)(alloc_bytes - bytes0) / ops;
+            r->allocs = (double)(alloc_calls - calls0) / ops;
+        }
+        b->teardown(state);
+    }
+    printf("%-28s %12.1f %10.1f %10.2f\n", r->name, r->ns, r->bytes, r->allocs);
+    fflush(stdout);
+}
+
+/* ---- text buffer ---- */
+
+#define LINE_TEXT "the quick brown fox jumps over the lazy dog"
+
+static void* buffer_setup(int n) {
+    TextBuffer *tb = createBuffer();
+    char **lines = (char**)malloc(sizeof(char*) * (n ? n : 1));
+    if (!lines) { fprintf(stderr, "Memory allocation failed for lines\n"); exit(1); }
+    for (int i = 0; i < n; i++) lines[i] = line_new(LINE_TEXT);
+    buffer_replace_lines(tb, lines, n);
+    for (int i = 0; i < n; i++) line_release(lines[i]);
+    free(lines);
+    return tb;
+}
+
+static void buffer_teardown(void *state) {
+    freeBuffer((TextBuffer*)state);
+}
+
+static void run_insert(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++)
+        insertLine(tb, (int)(next_random() % (uint64_t)(tb->line_count + 1)), LINE_TEXT);
+}
+
+static void run_delete(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    (void)n;
+    for (int i = 0; i < ops && tb->line_count; i++)
+        deleteLine(tb, (int)(next_random() % (uint64_t)tb->line_count));
+}
+
+static void run_update(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++)
+        updateLine(tb, (int)(next_random() % (uint64_t)tb->line_count), LINE_TEXT " (edited)");
+}
+
+/* typing into the middle of one line of n characters: the cursor moves
+   on a column per keystroke, and keystrokes coalesce into undo runs */
+static void* line_setup(int n) {
+    TextBuffer *tb = createBuffer();
+    char *text = (char*)malloc(n + 1);
+    if (!text) { fprintf(stderr, "Memory allocation failed for text\n"); exit(1); }
+    memset(text, 'x', n);
+    text[n] = '\0';
+    insertLine_no_record(tb, 0, text);
+    free(text);
+    return tb;
+}
+
+static void run_insert_chars(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    for (int i = 0; i < ops; i++) insertChars(tb, 0, n / 2 + i, "k", 1);
+}
+
+/* an undo chain: CHAIN_OPS recorded inserts, then every one undone and
+   redone; reported per undo+redo pair */
+static void* chain_setup(int n) {
+    TextBuffer *tb = (TextBuffer*)buffer_setup(n);
+    setUndoLimits(tb, 0, 0);
+    setUndoCoalesce(tb, 0);
+    return tb;
+}
+
+#define CHAIN_OPS 100000
+
+static void* chain_setup_filled(int n) {
+    TextBuffer *tb = (TextBuffer*)chain_setup(n);
+    for (int i = 0; i < CHAIN_OPS; i++)
+        insertLine(tb, (int)(next_random() % (uint64_t)(tb->line_count + 1)), LINE_TEXT);
+    return tb;
+}
+
+static void run_undo_redo(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++) undo(tb);
+    for (int i = 0; i < ops; i++) redo(tb);
+}
+
+static void run_to_string(void *state, int n, int ops) {
+    (void)n;
+    for (int i = 0; i < ops; i++) free(buffer_to_string((TextBuffer*)state));
+}
+
+/* bulk import of the text of n lines, a whole document per op */
+typedef struct {
+    TextBuffer *tb;
+    char *text;
+} Load;
+
+static void* load_setup(int n) {
+    Load *l = (Load*)malloc(sizeof(Load));
+    if (!l) { fprintf(stderr, "Memory allocation failed for load\n"); exit(1); }
+    TextBuffer *src = (TextBuffer*)buffer_setup(n);
+    l->text = buffer_to_string(src);
+    freeBuffer(src);
+    l->tb = createBuffer();
+    return l;
+}
+
+static void load_teardown(void *state) {
+    Load *l = (Load*)state;
+    freeBuffer(l->tb);
+    free(l->text);
+    free(l);
+}
+
+static void run_load(void *state, int n, int ops) {
+    Load *l = (Load*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++) buffer_load(l->tb, l->text, strlen(l->text));
+}
+
+/* FIND over the whole document, and REPLACE of a word every line holds
+   (and back again), applied as the server does; on the calling thread only */
+static void run_find(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    SearchQuery q = { "lazy", 4, NULL, 0, 0, -1, 10000, 0 };
+    (void)n;
+    for (int i = 0; i < ops; i++) {
+        SearchResult r;
+        search_lines(tb->root, &q, &r);
+        search_result_free(&r);
+    }
+}
+
+static void run_replace(void *state, int n, int ops) {
+    TextBuffer *tb = (TextBuffer*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++) {
+        SearchQuery q = { i % 2 ? "cat" : "fox", 3, i % 2 ? "fox" : "cat", 3, 0, -1, 0, 1 << 20 };
+        SearchResult r;
+        search_lines(tb->root, &q, &r);
+        beginGroup(tb);
+        updateLines(tb, r.lines, r.texts, r.line_count);
+        endGroup(tb);
+        search_result_free(&r);
+    }
+}
+
+/* ---- version tree ---- */
+
+typedef struct {
+    TextBuffer *tb;
+    VersionTree vt;
+} Versions;
+
+#define SNAP_VERSIONS 10000 /* versions made before restores are timed */
+
+static void* versions_setup(int n) {
+    Versions *v = (Versions*)malloc(sizeof(Versions));
+    if (!v) { fprintf(stderr, "Memory allocation failed for Versions\n"); exit(1); }
+    v->tb = (TextBuffer*)buffer_setup(n);
+    vtree_init(&v->vt);
+    return v;
+}
+
+static void versions_teardown(void *state) {
+    Versions *v = (Versions*)state;
+    vtree_destroy(&v->vt, v->tb);
+    freeBuffer(v->tb);
+    free(v);
+}
+
+/* edit one line, then snapshot: each version differs from its parent */
+static void run_snapshot(void *state, int n, int ops) {
+    Versions *v = (Versions*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++) {
+        updateLine(v->tb, (int)(next_random() % (uint64_t)v->tb->line_count), LINE_TEXT " (v)");
+        vtree_snapshot(&v->vt, v->tb, v->vt.current);
+    }
+}
+
+static void* restore_setup(int n) {
+    Versions *v = (Versions*)versions_setup(n);
+    run_snapshot(v, n, SNAP_VERSIONS);
+    return v;
+}
+
+static void run_restore(void *state, int n, int ops) {
+    Versions *v = (Versions*)state;
+    (void)n;
+    for (int i = 0; i < ops; i++) vtree_restore(&v->vt, v->tb, 1 + (int)(next_random() % SNAP_VERSIONS));
+}
+
+/* ---- baseline comparison ---- */
+
+/* a previous run's output: "name ns bytes allocs" per line */
+static int compare(const char *path, double threshold) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return 1; }
+    char line[256], name[MAX_NAME];
+    double ns, bytes, allocs;
+    int regressions = 0;
+    printf("\n%-28s %12s %12s %8s %12s\n", "vs baseline", "ns/op", "base ns/op", "change", "B/op change");
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%47s %lf %lf %lf", name, &ns, &bytes, &allocs) != 4) continue;
+        for (int i = 0; i < n_results; i++) {
+            if (strcmp(results[i].name, name) != 0) continue;
+            double change = ns > 0 ? 100.0 * (results[i].ns - ns) / ns : 0;
+            int slow = threshold > 0 && change > threshold;
+            printf("%-28s %12.1f %12.1f %+7.1f%% %+12.1f%s\n", name, results[i].ns, ns, change,
+                   results[i].bytes - bytes, slow ? "  REGRESSION" : "");
+            regressions += slow;
+        }
+    }
+    fclose(f);
+    return regressions ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-r repeats] [-n max_lines] [-f filter] [-b baseline] [-t percent]\n", prog);
+    fprintf(stderr, "  -r N  run each benchmark N times and keep the fastest (default %d)\n", repeats);
+    fprintf(stderr, "  -n N  skip sizes above N lines (default %d)\n", max_lines);
+    fprintf(stderr, "  -f S  only benchmarks whose name contains S\n");
+    fprintf(stderr, "  -b F  compare with F, the saved output of an earlier run\n");
+    fprintf(stderr, "  -t P  with -b: exit 1 if any benchmark got more than P%% slower\n");
+}
+
+int main(int argc, char **argv) {
+    const char *baseline = NULL;
+    double threshold = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:f:b:t:")) != -1) {
+        if (opt == 'r') repeats = atoi(optarg);
+        else if (opt == 'n') max_lines = atoi(optarg);
+        else if (opt == 'f') filter = optarg;
+        else if (opt == 'b') baseline = optarg;
+        else if (opt == 't') threshold = atof(optarg);
+        else { usage(argv[0]); return 1; }
+    }
+    if (repeats < 1) repeats = 1;
+
+    static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+    const Bench insert = { buffer_setup, run_insert, buffer_teardown };
+    const Bench delete = { buffer_setup, run_delete, buffer_teardown };
+    const Bench update = { buffer_setup, run_update, buffer_teardown };
+    const Bench insert_chars = { line_setup, run_insert_chars, buffer_teardown };
+    const Bench undo_redo = { chain_setup_filled, run_undo_redo, buffer_teardown };
+    const Bench to_string = { buffer_setup, run_to_string, buffer_teardown };
+    const Bench load = { load_setup, run_load, load_teardown };
+    const Bench find = { buffer_setup, run_find, buffer_teardown };
+    const Bench replace = { chain_setup, run_replace, buffer_teardown };
+    const Bench snapshot = { versions_setup, run_snapshot, versions_teardown };
+    const Bench restore = { restore_setup, run_restore, versions_teardown };
+
+    printf("%-28s %12s %10s %10s\n", "# benchmark", "ns/op", "B/op", "allocs/op");
+#ifndef COUNT_ALLOCS
+    printf("# built without COUNT_ALLOCS: allocations are not counted\n");
+#endif
+    for (int i = 0; i < 4; i++) {
+        /* inserts and deletes change the size by at most the size itself */
+        int ops = sizes[i] < 100000 ? sizes[i] : 100000;
+        bench("insert", &insert, sizes[i], ops);
+        bench("delete", &delete, sizes[i], ops / 2);
+        bench("update", &update, sizes[i], 100000);
+    }
+    bench("insert_chars", &insert_chars, 100, 100000);
+    bench("insert_chars", &insert_chars, 10000, 100000);
+    for (int i = 0; i < 4; i++) bench("undo_redo", &undo_redo, sizes[i], CHAIN_OPS);
+    for (int i = 0; i < 4; i++) bench("to_string", &to_string, sizes[i], sizes[i] >= 100000 ? 10 : 1000);
+    for (int i = 0; i < 4; i++) bench("load", &load, sizes[i], sizes[i] >= 100000 ? 10 : 1000);
+    for (int i = 0; i < 4; i++) bench("find", &find, sizes[i], sizes[i] >= 100000 ? 10 : 1000);
+    for (int i = 0; i < 4; i++) bench("replace", &replace, sizes[i], sizes[i] >= 100000 ? 2 : 100);
+    bench("vtree_snapshot", &snapshot, 100000, SNAP_VERSIONS);
+    bench("vtree_restore", &restore, 100000, 100000);
+
+    return baseline ? compare(baseline, threshold) : 0;
+}
\ No newline at end of file
@@ -1,8 +1,49 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
-#define MAX_CLIENTS 32
+#define MAX_CLIENTS 16384 /* enforced by the server on accept */
 #define BUFSIZE 8192
 #define PORT 12345
+#define MAX_BATCH_OPS 65536 /* ops per BATCH <n> ... END */
+#define FIND_MAX_HITS 10000 /* matches listed by one FIND; narrow the range for more */
+#define DOC_NAME_MAX 64     /* OPEN <name>: letters, digits, '_', '-' and '.' */
+#define DEFAULT_DOC "default" /* the document a new connection starts in */
+
+/* Binary protocol. A client whose first frame is OP_HELLO (so its first
+   byte is 0, which no text command starts with) speaks frames for the rest
+   of the connection: a 12-byte header of u8 opcode, u8 flags, two zero
+   bytes, i32 position and u32 payload length, big-endian, followed by the
+   payload. */
+#define PROTO_VERSION 1
+#define FRAME_HEADER 12
+#define FRAME_MAX_PAYLOAD (16 << 20)
+
+#define FRAME_F_REVISION 0x01 /* INS/DEL/UPD/INSC/DELC/SYNC: payload starts with a u64 revision (INS@<rev>, SYNC <rev>) */
+
+#define OP_HELLO 0          /* position = PROTO_VERSION; answered with the same frame */
+#define OP_INS 1            /* position, payload = line text */
+#define OP_DEL 2
+#define OP_UPD 3
+#define OP_UNDO 4
+#define OP_REDO 5
+#define OP_SNAP 6
+#define OP_RESTORE 7        /* position = version id */
+#define OP_LIST_VERSIONS 8
+#define OP_DIFF 9           /* position = a, payload = b as a big-endian u32 */
+#define OP_GET 10
+#define OP_PRINT 11
+#define OP_BATCH 12         /* position = n; n INS/DEL/UPD frames follow, then OP_END */
+#define OP_END 13
+#define OP_OPEN 14          /* payload = document name */
+#define OP_SYNC 15          /* flag FRAME_F_REVISION, payload = the revision the client has */
+#define OP_STATS 16         /* server metrics, answered with an EVENT "STATS <n>" and n lines */
+#define OP_INSC 17          /* position = line, payload = u32 column, then the characters */
+#define OP_DELC 18          /* position = line, payload = u32 column, u32 length */
+#define OP_LOAD 19          /* payload = path of a file to replace the document with */
+#define OP_SAVE 20          /* payload = path to write the document to */
+#define OP_FIND 21          /* position = first line, payload = u32 end line (0xffffffff: the last), then the pattern */
+#define OP_REPLACE 22       /* as OP_FIND, but the pattern is preceded by its u32 length and followed by the new text */
+#define OP_EVENT 64         /* server: payload = what a text client is sent; precedes OP_DOC with its header */
+#define OP_DOC 65           /* server: position = line count, payload = the lines, '\n'-terminated */
 
 #endif
\ No newline at end of file
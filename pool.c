@@ -0,0 +1,63 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POOL_SLAB_BYTES (64 * 1024)
+#define POOL_ALIGN 16
+
+void pool_init(ObjPool *pool, size_t obj_size) {
+    if (obj_size < sizeof(void*)) obj_size = sizeof(void*);
+    obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->obj_size = obj_size;
+    pool->per_slab = (POOL_SLAB_BYTES - POOL_ALIGN) / obj_size;
+    if (pool->per_slab == 0) pool->per_slab = 1;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->live = 0;
+    pool->capacity = 0;
+}
+
+static void pool_grow(ObjPool *pool) {
+    /* the slab header is padded to POOL_ALIGN so objects stay aligned */
+    PoolSlab *slab = (PoolSlab*)malloc(POOL_ALIGN + pool->per_slab * pool->obj_size);
+    if (!slab) {
+        fprintf(stderr, "Memory allocation failed for pool slab\n");
+        exit(1);
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    char *obj = (char*)slab + POOL_ALIGN;
+    for (size_t i = 0; i < pool->per_slab; i++, obj += pool->obj_size) {
+        *(void**)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    pool->capacity += pool->per_slab;
+}
+
+void* pool_alloc(ObjPool *pool) {
+    if (!pool->free_list) pool_grow(pool);
+    void *obj = pool->free_list;
+    pool->free_list = *(void**)obj;
+    pool->live++;
+    return obj;
+}
+
+void pool_free(ObjPool *pool, void *obj) {
+    if (!obj) return;
+    *(void**)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->live--;
+}
+
+void pool_destroy(ObjPool *pool) {
+    PoolSlab *slab = pool->slabs;
+    while (slab) {
+        PoolSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->live = 0;
+    pool->capacity = 0;
+}
\ No newline at end of file
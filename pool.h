@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Fixed-size object pool. Objects are carved out of large slabs and
+   recycled through a free list, so steady-state editing does no malloc/free
+   and the objects of one buffer stay packed together. Not thread safe: a
+   pool is owned by one TextBuffer and used under its lock. */
+
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+} PoolSlab;
+
+typedef struct ObjPool {
+    size_t obj_size;
+    size_t per_slab;
+    void *free_list;
+    PoolSlab *slabs;
+    size_t live;        /* objects currently handed out */
+    size_t capacity;    /* objects in all slabs */
+} ObjPool;
+
+void pool_init(ObjPool *pool, size_t obj_size);
+void* pool_alloc(ObjPool *pool);
+void pool_free(ObjPool *pool, void *obj);
+void pool_destroy(ObjPool *pool); /* releases every slab, live objects included */
+
+#endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+void ring_init(Ring *r, int capacity) {
+    uint64_t cap = 2;
+    while (cap < (uint64_t)capacity) cap <<= 1;
+    r->slots = (RingSlot*)calloc(cap, sizeof(RingSlot));
+    if (!r->slots) {
+        fprintf(stderr, "Memory allocation failed for Ring\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < cap; i++) r->slots[i].seq = i;
+    r->mask = cap - 1;
+    r->head = 0;
+    r->tail = 0;
+    r->sleeping = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+}
+
+void ring_destroy(Ring *r) {
+    free(r->slots);
+    r->slots = NULL;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+}
+
+void ring_push(Ring *r, void *item) {
+    uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    RingSlot *s;
+    for (;;) {
+        s = &r->slots[pos & r->mask];
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            /* free: claim it (on failure pos is reloaded) */
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* full: the consumer has not taken this slot's last item yet */
+            sched_yield();
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+    s->item = item;
+    /* publish, then look for a sleeping consumer; ring_pop does the
+       opposite, so one of the two sees the other */
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+int ring_pop(Ring *r, void **out, int max) {
+    int n = 0;
+    while (n < max) {
+        RingSlot *s = &r->slots[r->tail & r->mask];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != r->tail + 1) {
+            if (n) break;
+            pthread_mutex_lock(&r->lock);
+            __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) != r->tail + 1)
+                pthread_cond_wait(&r->wake, &r->lock);
+            __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+        out[n++] = s->item;
+        /* free for the producer one lap later */
+        __atomic_store_n(&s->seq, r->tail + r->mask + 1, __ATOMIC_RELEASE);
+        r->tail++;
+    }
+    return n;
+}
\ No newline at end of file
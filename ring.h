@@ -0,0 +1,41 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Bounded multi-producer single-consumer queue of pointers. Producers
+   claim a slot with one compare-and-swap on the head and publish it
+   through the slot's sequence number (Vyukov's bounded queue), so pushes
+   from different threads never take a lock. The consumer reads slots in
+   order without atomics on the head; it only sleeps, on a condition
+   variable, when the queue is empty, and a producer signals it only when
+   it is asleep. */
+
+typedef struct {
+    uint64_t seq;       /* index + 1 once published; index + capacity once consumed */
+    void *item;
+} RingSlot;
+
+typedef struct {
+    RingSlot *slots;
+    uint64_t mask;      /* capacity - 1 */
+    uint64_t head;      /* next slot for producers; atomic */
+    uint64_t tail;      /* next slot for the consumer; consumer only */
+    int sleeping;       /* consumer is waiting for a push; atomic */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} Ring;
+
+/* capacity is rounded up to a power of two */
+void ring_init(Ring *r, int capacity);
+void ring_destroy(Ring *r);
+
+/* Append item, yielding while the ring is full */
+void ring_push(Ring *r, void *item);
+
+/* Consumer: move up to max items, in push order, into out; blocks until
+   there is at least one. Returns how many were taken. */
+int ring_pop(Ring *r, void **out, int max);
+
+#endif
\ No newline at end of file
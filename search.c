@@ -0,0 +1,288 @@
+#include "search.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* ---- matching ---- */
+
+const char* text_find(const char *s, size_t len, const char *pat, size_t plen) {
+    if (plen == 0 || plen > len) return NULL;
+    size_t i = 0;
+#ifdef __SSE2__
+    /* a 16-byte block at i and one at i + plen - 1: a bit set in both
+       comparisons marks a position whose first and last bytes match */
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[plen - 1]);
+    for (; i + plen + 15 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + plen - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                                  _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(s + at, pat, plen) == 0) return s + at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    /* the tail, or the whole line without SSE2 */
+    while (i + plen <= len) {
+        const char *p = (const char*)memchr(s + i, pat[0], len - plen + 1 - i);
+        if (!p) return NULL;
+        if (memcmp(p, pat, plen) == 0) return p;
+        i = (size_t)(p - s) + 1;
+    }
+    return NULL;
+}
+
+/* ---- chunks ---- */
+
+/* The matches and new lines of lines [first, last). New lines are stored
+   one after another, NUL-terminated, in text. */
+struct SearchChunk {
+    int first;
+    int last;
+    long total;
+    int failed;             /* a new line would exceed max_line */
+    SearchHit *hits;
+    int hit_len;
+    int hit_cap;
+    int *lines;
+    size_t *offsets;        /* of each new line in text */
+    int line_len;
+    int line_cap;
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+};
+
+static void* grow(void *p, size_t size, const char *what) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed for %s\n", what);
+        exit(1);
+    }
+    return p;
+}
+
+static void add_hit(SearchChunk *c, int line, int column) {
+    if (c->hit_len == c->hit_cap) {
+        c->hit_cap = c->hit_cap ? c->hit_cap * 2 : 64;
+        c->hits = (SearchHit*)grow(c->hits, sizeof(SearchHit) * c->hit_cap, "search hits");
+    }
+    c->hits[c->hit_len].line = line;
+    c->hits[c->hit_len].column = column;
+    c->hit_len++;
+}
+
+static void add_text(SearchChunk *c, const char *s, size_t n) {
+    if (c->text_len + n > c->text_cap) {
+        size_t cap = c->text_cap * 2 > c->text_len + n ? c->text_cap * 2 : c->text_len + n + 4096;
+        c->text = (char*)grow(c->text, cap, "replaced lines");
+        c->text_cap = cap;
+    }
+    if (n) memcpy(c->text + c->text_len, s, n);
+    c->text_len += n;
+}
+
+static void add_line(SearchChunk *c, int line, size_t offset) {
+    if (c->line_len == c->line_cap) {
+        c->line_cap = c->line_cap ? c->line_cap * 2 : 64;
+        c->lines = (int*)grow(c->lines, sizeof(int) * c->line_cap, "replaced lines");
+        c->offsets = (size_t*)grow(c->offsets, sizeof(size_t) * c->line_cap, "replaced lines");
+    }
+    c->lines[c->line_len] = line;
+    c->offsets[c->line_len] = offset;
+    c->line_len++;
+}
+
+static void search_chunk(LineNode *root, const SearchQuery *q, SearchChunk *c) {
+    LineIter it;
+    line_iter_init_at(&it, root, c->first);
+    for (int i = c->first; i < c->last && !c->failed; i++) {
+        const char *s = line_iter_next(&it)->line;
+        size_t len = line_length(s);
+        const char *p = text_find(s, len, q->pattern, q->pattern_len);
+        if (!p) continue;
+        size_t start = c->text_len, done = 0;
+        do {
+            size_t col = (size_t)(p - s);
+            c->total++;
+            if (c->hit_len < q->max_hits) add_hit(c, i, (int)col);
+            if (q->replacement) {
+                if (c->text_len - start + (col - done) + q->replacement_len > q->max_line) {
+                    c->failed = 1;
+                    break;
+                }
+                add_text(c, s + done, col - done);
+                add_text(c, q->replacement, q->replacement_len);
+            }
+            done = col + q->pattern_len;
+            p = text_find(s + done, len - done, q->pattern, q->pattern_len);
+        } while (p);
+        if (q->replacement && !c->failed) {
+            if (c->text_len - start + (len - done) > q->max_line) {
+                c->failed = 1;
+                break;
+            }
+            add_text(c, s + done, len - done);
+            add_text(c, "", 1);
+            add_line(c, i, start);
+        }
+    }
+}
+
+/* ---- worker pool ---- */
+
+/* One search in progress. Chunks are claimed with an atomic counter by the
+   caller and by any workers that join; the caller waits until every worker
+   that joined has left before the job (on its stack) goes away. */
+typedef struct SearchJob {
+    LineNode *root;
+    const SearchQuery *query;
+    SearchChunk *chunks;
+    int chunk_count;
+    int next;               /* next chunk to claim; atomic */
+    int active;             /* workers inside the job; under pool_lock */
+    struct SearchJob *next_job;
+} SearchJob;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static SearchJob *jobs;     /* jobs with chunks left to claim */
+static int workers;
+
+static void run_chunks(SearchJob *job) {
+    for (;;) {
+        int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->chunk_count) return;
+        search_chunk(job->root, job->query, &job->chunks[i]);
+    }
+}
+
+/* lock held */
+static void unlink_job(SearchJob *job) {
+    for (SearchJob **p = &jobs; *p; p = &(*p)->next_job) {
+        if (*p == job) {
+            *p = job->next_job;
+            return;
+        }
+    }
+}
+
+static void *worker_loop(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!jobs) pthread_cond_wait(&pool_work, &pool_lock);
+        SearchJob *job = jobs;
+        job->active++;
+        pthread_mutex_unlock(&pool_lock);
+        run_chunks(job);
+        pthread_mutex_lock(&pool_lock);
+        unlink_job(job); /* every chunk is claimed */
+        if (--job->active == 0) pthread_cond_broadcast(&pool_idle);
+    }
+    return NULL;
+}
+
+void search_start(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_loop, NULL) != 0) break;
+        pthread_detach(tid);
+        workers++;
+    }
+}
+
+/* ---- searching ---- */
+
+int search_lines(LineNode *root, const SearchQuery *q, SearchResult *out) {
+    memset(out, 0, sizeof(SearchResult));
+    int count = snapshot_line_count(root);
+    int first = q->first < 0 ? 0 : q->first;
+    int last = q->last < 0 || q->last > count ? count : q->last;
+    if (first >= last) return 0;
+
+    SearchJob job;
+    memset(&job, 0, sizeof(job));
+    job.root = root;
+    job.query = q;
+    job.chunk_count = (last - first + SEARCH_CHUNK_LINES - 1) / SEARCH_CHUNK_LINES;
+    job.chunks = (SearchChunk*)calloc(job.chunk_count, sizeof(SearchChunk));
+    if (!job.chunks) {
+        fprintf(stderr, "Memory allocation failed for search chunks\n");
+        exit(1);
+    }
+    for (int i = 0; i < job.chunk_count; i++) {
+        job.chunks[i].first = first + i * SEARCH_CHUNK_LINES;
+        job.chunks[i].last = i + 1 < job.chunk_count ? job.chunks[i].first + SEARCH_CHUNK_LINES : last;
+    }
+    if (job.chunk_count > 1 && workers) {
+        pthread_mutex_lock(&pool_lock);
+        job.next_job = jobs;
+        jobs = &job;
+        pthread_cond_broadcast(&pool_work);
+        pthread_mutex_unlock(&pool_lock);
+        run_chunks(&job);
+        pthread_mutex_lock(&pool_lock);
+        unlink_job(&job);
+        while (job.active) pthread_cond_wait(&pool_idle, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+    } else {
+        run_chunks(&job);
+    }
+
+    out->chunks = job.chunks;
+    out->chunk_count = job.chunk_count;
+    size_t hits = 0, lines = 0;
+    for (int i = 0; i < job.chunk_count; i++) {
+        SearchChunk *c = &job.chunks[i];
+        if (c->failed) {
+            search_result_free(out);
+            return -1;
+        }
+        out->total += c->total;
+        hits += c->hit_len;
+        lines += c->line_len;
+    }
+    if (hits > (size_t)(q->max_hits > 0 ? q->max_hits : 0)) hits = q->max_hits > 0 ? q->max_hits : 0;
+    out->hits = (SearchHit*)malloc(sizeof(SearchHit) * (hits ? hits : 1));
+    out->lines = (int*)malloc(sizeof(int) * (lines ? lines : 1));
+    out->texts = (const char**)malloc(sizeof(char*) * (lines ? lines : 1));
+    if (!out->hits || !out->lines || !out->texts) {
+        fprintf(stderr, "Memory allocation failed for search results\n");
+        exit(1);
+    }
+    for (int i = 0; i < job.chunk_count; i++) {
+        SearchChunk *c = &job.chunks[i];
+        int n = (size_t)c->hit_len < hits - out->hit_count ? c->hit_len : (int)(hits - out->hit_count);
+        if (n > 0) memcpy(out->hits + out->hit_count, c->hits, sizeof(SearchHit) * n);
+        out->hit_count += n;
+        for (int j = 0; j < c->line_len; j++) {
+            out->lines[out->line_count] = c->lines[j];
+            out->texts[out->line_count++] = c->text + c->offsets[j];
+        }
+    }
+    return 0;
+}
+
+void search_result_free(SearchResult *r) {
+    for (int i = 0; i < r->chunk_count; i++) {
+        free(r->chunks[i].hits);
+        free(r->chunks[i].lines);
+        free(r->chunks[i].offsets);
+        free(r->chunks[i].text);
+    }
+    free(r->chunks);
+    free(r->hits);
+    free(r->lines);
+    free(r->texts);
+    memset(r, 0, sizeof(SearchResult));
+}
\ No newline at end of file
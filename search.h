@@ -0,0 +1,61 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include "text_buffer.h"
+
+/* Substring search over a document, for FIND and REPLACE. Each line is
+   scanned 16 bytes at a time with SSE2: the first and the last byte of the
+   pattern are compared at 16 positions at once, and only positions where
+   both match are compared in full. Documents longer than
+   SEARCH_CHUNK_LINES lines are cut into chunks of that many lines, which
+   the worker pool (see search_start) and the calling thread search in
+   parallel; the results are merged back into document order. Matches do
+   not overlap: the scan resumes after each one. */
+
+#define SEARCH_CHUNK_LINES 16384
+
+/* first occurrence of pat[0, plen) in s[0, len), or NULL; plen > 0 */
+const char* text_find(const char *s, size_t len, const char *pat, size_t plen);
+
+typedef struct {
+    const char *pattern;
+    size_t pattern_len;         /* > 0 */
+    const char *replacement;    /* NULL to only find */
+    size_t replacement_len;
+    int first;                  /* lines [first, last) are searched */
+    int last;
+    int max_hits;               /* matches listed; all of them are counted */
+    size_t max_line;            /* longest line a replacement may produce */
+} SearchQuery;
+
+typedef struct {
+    int line;
+    int column;
+} SearchHit;
+
+typedef struct SearchChunk SearchChunk;
+
+typedef struct {
+    long total;                 /* matches in the range */
+    SearchHit *hits;            /* the first max_hits of them, in document order */
+    int hit_count;
+    int *lines;                 /* replacing: every line that changes, ascending... */
+    const char **texts;         /* ...and its new text, stored in the chunks */
+    int line_count;
+    SearchChunk *chunks;
+    int chunk_count;
+} SearchResult;
+
+/* Start the worker pool with n threads, once, before any search; without
+   it every search runs on its caller alone. */
+void search_start(int threads);
+
+/* Search the lines of a snapshot (or of a buffer's root, with its lock
+   held), filling *out, which search_result_free releases. Returns 0, or -1
+   (with nothing in *out) if a replaced line would exceed max_line. Any
+   thread may search; searches from several threads share the pool. */
+int search_lines(LineNode *root, const SearchQuery *q, SearchResult *out);
+void search_result_free(SearchResult *r);
+
+#endif
\ No newline at end of file
@@ -1,183 +1,2518 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "text_buffer.h"
 #include "version.h"
+#include "wal.h"
 #include "network.h"
 #include "editoperation.h"
+#include "stats.h"
+#include "search.h"
+#include "ring.h"
 
-TextBuffer *g_buffer;
-VersionTree g_vtree;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct Client;
+struct Sequencer;
+
+/* A document owns everything an edit touches, so edits to different
+   documents never contend. Documents are created by the first OPEN of their
+   name and live until shutdown. Every edit of a document is applied by its
+   sequencer thread (see "sequencers" below), so the lock never has two
+   writers queueing for it; it still keeps readers that need the live
+   buffer (SYNC, OPEN, checkpoints) out while an edit is half done. */
+typedef struct Document {
+    char name[DOC_NAME_MAX + 1];
+    TextBuffer *buffer;
+    VersionTree vtree;
+    Wal *wal;                   /* NULL unless -d: then every edit is durable before it is broadcast */
+    pthread_mutex_t lock;       /* buffer and version tree; see doc_lock */
+    uint64_t locked_at;         /* when the holder of lock took it, for the hold-time histogram */
+    /* broadcasts only read the subscriber list, so they share the lock;
+       joins and leaves take it exclusively, and never wait behind socket I/O */
+    pthread_rwlock_t subs_lock;
+    struct Client *subs;
+    struct Sequencer *seq;      /* applies every edit of this document */
+    struct Document *next;      /* hash chain */
+} Document;
+
+/* A serialized outbound frame. A broadcast is built once and the same
+   Message is referenced from every client's queue; a GET reply is a
+   per-client Message holding a snapshot of the document whose lines are
+   written straight from the line storage. Binary clients are sent the
+   frame header first, so one Message serves both protocols. */
+typedef struct Message {
+    int refs;       /* atomic */
+    LineIter *iter; /* stream position in the snapshot, or NULL for a byte payload */
+    Document *doc;  /* owner of the snapshot */
+    LineNode *root; /* document snapshot */
+    LineNode *cur;  /* line being written, NULL once the document is sent */
+    int count;      /* lines in the snapshot */
+    uint64_t revision; /* of the snapshot */
+    size_t len;     /* payload length when iter == NULL */
+    unsigned char frame[FRAME_HEADER]; /* binary protocol header */
+    char data[];
+} Message;
+
+/* Per-client outbound bounds. A client that overflows them has its queued
+   output discarded, replies as well as broadcasts (a message already partly
+   written is finished first), and is resent the whole document once
+   ("RESYNC"); overflowing again before that resync has drained drops the
+   connection. */
+#define OUTQ_MAX_MSGS 1024
+#define OUTQ_MAX_BYTES (4 << 20)
+
+#define PROTO_UNKNOWN 0 /* nothing received yet */
+#define PROTO_TEXT 1
+#define PROTO_BINARY 2
+
+/* One collected op of an open BATCH */
+typedef struct {
+    int type;       /* INSERT_OP / DELETE_OP / UPDATE_OP, -1 for anything else */
+    int pos;
+    char *text;
+} BatchOp;
 
 typedef struct Client {
     int sock;
-    struct Client *next;
+    int reactor;            /* index of the reactor thread that owns the socket */
+    Document *doc;          /* the open document; changed only by the owning reactor */
+    int proto;              /* set by the owning reactor from the first byte received */
+    char *partial;          /* text: unterminated tail of the last read */
+    size_t partial_len;
+    int discarding;         /* dropping an over-long line up to its newline */
+    char *rbuf;             /* binary: reassembly buffer, frames are parsed in place */
+    size_t rlen;
+    size_t rcap;
+    BatchOp *batch;         /* ops collected since BATCH <n>, until END */
+    int batch_len;
+    int batch_expected;     /* n of the open BATCH, 0 when not in a batch */
+    int pending_input;      /* commands read behind a parked OPEN are still buffered */
+
+    pthread_mutex_t out_lock;
+    Message **outq;         /* ring of queued messages, grown on demand */
+    int outq_cap;
+    int outq_head;
+    int outq_len;
+    size_t out_bytes;       /* queued broadcast/reply bytes, for the bound */
+    size_t out_off;         /* progress through the head message (or its cur line) */
+    size_t out_hdr;         /* binary: bytes of the head message's frame header sent */
+    int head_sent;          /* some of the head message has been written */
+    int text_left;          /* queued before the client switched to binary, sent unframed */
+    int resync;             /* overflowed; skip broadcasts until resent */
+    Message *resync_msg;    /* resync document still in the queue */
+    int closed;             /* under out_lock: the reactor has closed it, queue nothing more */
+    /* under out_lock: an OPEN waiting for c's queued commands, while
+       nothing more is read from c (see run_command) */
+    struct QueuedCommand *parked;
+
+    /* one reference for the owning reactor and one per command in a
+       sequencer's ring; the last one frees the client. atomic */
+    int refs;
+
+    int in_flush_list;      /* guarded by the owning reactor's flush_lock */
+    struct Client *flush_next;
+    struct Client *next;    /* next subscriber of doc */
 } Client;
 
-Client *clients = NULL;
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t buf_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void add_client(int sock) {
-    Client *c = (Client*)malloc(sizeof(Client));
-    c->sock = sock;
-    pthread_mutex_lock(&clients_mutex);
-    c->next = clients;
-    clients = c;
-    pthread_mutex_unlock(&clients_mutex);
-}
-void remove_client(int sock) {
-    pthread_mutex_lock(&clients_mutex);
-    Client **pc = &clients;
+typedef struct Reactor {
+    int index;
+    int epfd;
+    int wakefd;             /* eventfd: clients on flush_list have new output */
+    pthread_t tid;
+    pthread_mutex_t flush_lock;
+    Client *flush_list;
+    char scratch[BUFSIZE * 2];
+} Reactor;
+
+static int client_count = 0; /* atomic */
+
+#define DOC_BUCKETS 1024
+static Document *doc_table[DOC_BUCKETS];
+static pthread_mutex_t docs_lock = PTHREAD_MUTEX_INITIALIZER; /* the table, not the documents */
+static Document *default_doc;
+
+/* settings every new document is created with */
+static int undo_ops = TB_DEFAULT_UNDO_OPS;
+static size_t undo_bytes = TB_DEFAULT_UNDO_BYTES;
+static const char *data_dir = NULL;
+static const char *files_dir = NULL;  /* -f: LOAD and SAVE are off without it */
+static int files_fd = -1;
+static struct stat data_dir_st;      /* to refuse LOAD/SAVE inside the log directory */
+static size_t checkpoint_bytes = WAL_CHECKPOINT_BYTES;
+static size_t version_budget = 0;
+
+static Reactor *reactors;
+static int n_reactors = 1;
+static int listen_fd = -1;
+static unsigned int next_reactor = 0;
+
+static const char newline_byte = '\n';
+
+/* ---- metrics ---- */
+
+/* Every reactor thread counts into its own ThreadStats, without locks;
+   STATS and the metrics port (-m) add them up when asked. */
+#define LOCK_DOCUMENT 0     /* Document.lock */
+#define LOCK_SUBSCRIBERS 1  /* Document.subs_lock */
+#define LOCK_DOCUMENTS 2    /* docs_lock */
+#define LOCK_KINDS 3
+#define STATS_OPS (OP_REPLACE + 1)
+
+static const char *lock_names[LOCK_KINDS] = { "document", "subscribers", "documents" };
+static const char *op_names[STATS_OPS] = {
+    "HELLO", "INS", "DEL", "UPD", "UNDO", "REDO", "SNAP", "RESTORE", "LIST_VERSIONS",
+    "DIFF", "GET", "PRINT", "BATCH", "END", "OPEN", "SYNC", "STATS", "INSC", "DELC", "LOAD", "SAVE",
+    "FIND", "REPLACE"
+};
+
+typedef struct ThreadStats {
+    StatsHist command[STATS_OPS];       /* by opcode, both protocols */
+    StatsHist lock_wait[LOCK_KINDS];
+    StatsHist lock_hold[LOCK_KINDS];
+    StatsHist broadcast;                /* queueing one message for every subscriber */
+    uint64_t recipients;                /* messages queued by broadcasts */
+    StatsHist sequencer_wait;           /* from the ring to the sequencer */
+    uint64_t sequenced;                 /* commands applied by a sequencer */
+    uint64_t drains;                    /* ring_pop calls that returned them */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    struct ThreadStats *next;
+} ThreadStats;
+
+static __thread ThreadStats *my_stats;  /* NULL on threads that do not count */
+static ThreadStats *all_stats;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int metrics_port = 0;
+static int search_workers = -1; /* -w; -1 = one per core but one */
+
+/* ---- sequencers ----
+
+   Reactors parse commands and push every edit into the ring of the
+   document's sequencer instead of applying it themselves. A sequencer takes
+   whatever has queued up (up to SEQ_DRAIN_MAX), applies it in order, makes
+   the whole drain durable with one wal_commit per log, and only then hands
+   the output to the clients: consecutive broadcasts to a document become a
+   single message, queued once per subscriber for the reactors to write. The
+   deeper the ring, the more every lock, log flush and fan-out is shared.
+
+   Once a client has commands in a ring, its later commands go through the
+   ring too, so its replies keep the order of its requests. Output made on a
+   sequencer waits in its Outbox until the drain is durable. */
+#define SEQ_RING_SIZE 4096
+#define SEQ_DRAIN_MAX 256
+#define SEQ_COALESCE_BYTES (64 << 10) /* largest merged broadcast */
+
+typedef struct Sequencer {
+    Ring ring;              /* of QueuedCommand */
+    pthread_t tid;
+} Sequencer;
+
+typedef struct {
+    struct Client *c;       /* a reply to c, or NULL for a broadcast to d */
+    Document *d;
+    Message *m;             /* the reply */
+    char *text;             /* the broadcast */
+    size_t len;
+} Outgoing;
+
+typedef struct {
+    Outgoing *items;
+    int len;
+    int cap;
+    struct { Wal *wal; uint64_t lsn; } commits[SEQ_DRAIN_MAX];
+    int commit_len;
+} Outbox;
+
+static Sequencer *sequencers;
+static int n_sequencers = 1;
+static unsigned int next_sequencer = 0;  /* under docs_lock */
+static __thread Outbox *my_outbox;      /* set on sequencer threads */
+
+static void stats_thread_start(void) {
+    ThreadStats *s = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+    if (!s) {
+        fprintf(stderr, "Memory allocation failed for ThreadStats\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&all_stats_lock);
+    s->next = all_stats;
+    all_stats = s;
+    pthread_mutex_unlock(&all_stats_lock);
+    my_stats = s;
+}
+
+/* Take m, recording how long that took; returns when it was taken, for
+   timed_unlock to record the hold time (0 on threads that do not count). */
+static uint64_t timed_lock(pthread_mutex_t *m, int kind) {
+    ThreadStats *s = my_stats;
+    if (!s) {
+        pthread_mutex_lock(m);
+        return 0;
+    }
+    uint64_t t0 = stats_now();
+    pthread_mutex_lock(m);
+    uint64_t t1 = stats_now();
+    stats_record(&s->lock_wait[kind], t1 - t0);
+    return t1;
+}
+
+static void timed_unlock(pthread_mutex_t *m, int kind, uint64_t since) {
+    if (since && my_stats) stats_record(&my_stats->lock_hold[kind], stats_now() - since);
+    pthread_mutex_unlock(m);
+}
+
+static void doc_lock(Document *d) {
+    uint64_t t = timed_lock(&d->lock, LOCK_DOCUMENT);
+    d->locked_at = t;
+}
+
+static void doc_unlock(Document *d) {
+    timed_unlock(&d->lock, LOCK_DOCUMENT, d->locked_at);
+}
+
+/* the same for the subscriber list; exclusive for joins and leaves */
+static uint64_t subs_lock(Document *d, int exclusive) {
+    ThreadStats *s = my_stats;
+    uint64_t t0 = s ? stats_now() : 0;
+    if (exclusive) pthread_rwlock_wrlock(&d->subs_lock);
+    else pthread_rwlock_rdlock(&d->subs_lock);
+    if (!s) return 0;
+    uint64_t t1 = stats_now();
+    stats_record(&s->lock_wait[LOCK_SUBSCRIBERS], t1 - t0);
+    return t1;
+}
+
+static void subs_unlock(Document *d, uint64_t since) {
+    if (since && my_stats) stats_record(&my_stats->lock_hold[LOCK_SUBSCRIBERS], stats_now() - since);
+    pthread_rwlock_unlock(&d->subs_lock);
+}
+
+/* returns 0, or -1 when MAX_CLIENTS connections are already registered */
+int add_client(void) {
+    if (__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED) > MAX_CLIENTS) {
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+void remove_client(void) {
+    __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+}
+
+/* ---- documents ---- */
+
+static void doc_subscribe(Document *d, Client *c) {
+    uint64_t t = subs_lock(d, 1);
+    c->next = d->subs;
+    d->subs = c;
+    subs_unlock(d, t);
+}
+
+/* after this no broadcast of d can reach c */
+static void doc_unsubscribe(Document *d, Client *c) {
+    uint64_t t = subs_lock(d, 1);
+    Client **pc = &d->subs;
     while (*pc) {
-        if ((*pc)->sock == sock) {
-            Client *tmp = *pc;
-            *pc = tmp->next;
-            free(tmp);
+        if (*pc == c) {
+            *pc = c->next;
             break;
         }
         pc = &(*pc)->next;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    subs_unlock(d, t);
+}
+
+/* names are also directory names under -d */
+static int doc_valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > DOC_NAME_MAX || name[0] == '.') return 0;
+    for (size_t i = 0; i < len; i++) {
+        char ch = name[i];
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+              ch == '_' || ch == '-' || ch == '.'))
+            return 0;
+    }
+    return 1;
 }
 
-void broadcast(const char *msg) {
-    pthread_mutex_lock(&clients_mutex);
-    Client *c = clients;
+static unsigned int doc_bucket(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % DOC_BUCKETS;
+}
+
+/* A reference to the current content of d and its revision, for reading
+   on any thread. Lock-free unless d was edited since the last read; release
+   it with buffer_read_release. */
+static LineNode* doc_read(Document *d, uint64_t *revision) {
+    LineNode *root;
+    if (buffer_read_acquire(d->buffer, &root, revision) == 0) return root;
+    doc_lock(d);
+    buffer_publish(d->buffer);
+    root = buffer_snapshot(d->buffer);
+    *revision = d->buffer->revision;
+    doc_unlock(d);
+    return root;
+}
+
+/* Find the document called name, creating it (and recovering it from its
+   log under -d) on first use. Returns NULL if its log cannot be opened.
+   Recovery runs under docs_lock, which only holds up other OPENs. */
+static Document* doc_open(const char *name) {
+    unsigned int b = doc_bucket(name);
+    uint64_t t = timed_lock(&docs_lock, LOCK_DOCUMENTS);
+    Document *d = doc_table[b];
+    while (d && strcmp(d->name, name) != 0) d = d->next;
+    if (d) {
+        timed_unlock(&docs_lock, LOCK_DOCUMENTS, t);
+        return d;
+    }
+    d = (Document*)calloc(1, sizeof(Document));
+    if (!d) {
+        fprintf(stderr, "Memory allocation failed for Document\n");
+        exit(1);
+    }
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->buffer = createBuffer();
+    setUndoLimits(d->buffer, undo_ops, undo_bytes);
+    vtree_init(&d->vtree);
+    /* set before recovery, which may rebuild many versions */
+    vtree_set_budget(&d->vtree, version_budget, data_dir);
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_rwlock_init(&d->subs_lock, NULL);
+    if (data_dir) {
+        /* the default document keeps the directory itself */
+        char dir[4096];
+        if (strcmp(name, DEFAULT_DOC) == 0) snprintf(dir, sizeof(dir), "%s", data_dir);
+        else snprintf(dir, sizeof(dir), "%s/%s.doc", data_dir, name);
+        d->wal = wal_open(dir, d->buffer, &d->vtree, &d->lock, checkpoint_bytes);
+        if (!d->wal) {
+            timed_unlock(&docs_lock, LOCK_DOCUMENTS, t);
+            vtree_destroy(&d->vtree, d->buffer);
+            freeBuffer(d->buffer);
+            pthread_mutex_destroy(&d->lock);
+            pthread_rwlock_destroy(&d->subs_lock);
+            free(d);
+            return NULL;
+        }
+        printf("Recovered %d lines and %d versions of %s from %s\n",
+               d->buffer->line_count, d->vtree.count, name, dir);
+    }
+    d->seq = &sequencers[next_sequencer++ % n_sequencers];
+    d->next = doc_table[b];
+    doc_table[b] = d;
+    timed_unlock(&docs_lock, LOCK_DOCUMENTS, t);
+    return d;
+}
+
+static void doc_close_all(void) {
+    for (int b = 0; b < DOC_BUCKETS; b++) {
+        Document *d = doc_table[b];
+        while (d) {
+            Document *next = d->next;
+            wal_close(d->wal);
+            vtree_destroy(&d->vtree, d->buffer); /* versions hold nodes of the buffer's pool */
+            freeBuffer(d->buffer);
+            pthread_mutex_destroy(&d->lock);
+            pthread_rwlock_destroy(&d->subs_lock);
+            free(d);
+            d = next;
+        }
+        doc_table[b] = NULL;
+    }
+}
+
+/* ---- messages ---- */
+
+static void frame_header(unsigned char *h, int op, int pos, uint32_t len) {
+    uint32_t p = htonl((uint32_t)pos), l = htonl(len);
+    h[0] = (unsigned char)op;
+    h[1] = h[2] = h[3] = 0;
+    memcpy(h + 4, &p, 4);
+    memcpy(h + 8, &l, 4);
+}
+
+static Message* msg_new(const char *data, size_t len) {
+    Message *m = (Message*)malloc(sizeof(Message) + len);
+    if (!m) return NULL;
+    m->refs = 1;
+    m->iter = NULL;
+    m->doc = NULL;
+    m->root = m->cur = NULL;
+    m->count = 0;
+    m->revision = 0;
+    m->len = len;
+    frame_header(m->frame, OP_EVENT, 0, (uint32_t)len);
+    if (data) memcpy(m->data, data, len); /* else the caller fills it in */
+    return m;
+}
+
+/* A stream message over root, a snapshot of d at revision (its reference
+   passes to the message). A framed document needs its size up front, which
+   costs one extra walk of the snapshot. */
+static Message* msg_snapshot(Document *d, LineNode *root, uint64_t revision, int framed) {
+    Message *m = (Message*)malloc(sizeof(Message) + sizeof(LineIter));
+    if (!m) {
+        buffer_read_release(d->buffer, root);
+        return NULL;
+    }
+    m->refs = 1;
+    m->len = 0;
+    m->iter = (LineIter*)(m + 1);
+    m->doc = d;
+    m->root = root;
+    m->revision = revision;
+    m->count = snapshot_line_count(m->root);
+    frame_header(m->frame, OP_DOC, m->count, framed ? (uint32_t)snapshot_byte_count(m->root) : 0);
+    line_iter_init(m->iter, m->root);
+    m->cur = line_iter_next(m->iter);
+    return m;
+}
+
+/* Snapshot the whole document into a stream message: O(1), and lock-free
+   unless the document changed since it was last read. */
+static Message* msg_document(Document *d, int framed) {
+    uint64_t revision;
+    LineNode *root = doc_read(d, &revision);
+    return msg_snapshot(d, root, revision, framed);
+}
+
+static void msg_release(Message *m) {
+    if (!m || __atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (m->iter) buffer_read_release(m->doc->buffer, m->root);
+    free(m);
+}
+
+/* ---- per-client outbound queue (out_lock held) ---- */
+
+static int outq_push(Client *c, Message *m) {
+    if (c->outq_len >= OUTQ_MAX_MSGS || c->out_bytes + m->len > OUTQ_MAX_BYTES) return -1;
+    if (c->outq_len == c->outq_cap) {
+        int cap = c->outq_cap ? c->outq_cap * 2 : 8;
+        Message **q = (Message**)malloc(sizeof(Message*) * cap);
+        if (!q) return -1;
+        for (int i = 0; i < c->outq_len; i++) q[i] = c->outq[(c->outq_head + i) % c->outq_cap];
+        free(c->outq);
+        c->outq = q;
+        c->outq_cap = cap;
+        c->outq_head = 0;
+    }
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    c->outq[(c->outq_head + c->outq_len) % c->outq_cap] = m;
+    c->outq_len++;
+    c->out_bytes += m->len;
+    return 0;
+}
+
+static void outq_pop(Client *c) {
+    Message *m = c->outq[c->outq_head];
+    c->outq_head = (c->outq_head + 1) % c->outq_cap;
+    c->outq_len--;
+    c->out_bytes -= m->len;
+    c->out_off = 0;
+    c->out_hdr = 0;
+    c->head_sent = 0;
+    if (c->text_left) c->text_left--;
+    if (m == c->resync_msg) c->resync_msg = NULL;
+    msg_release(m);
+}
+
+static void outq_clear(Client *c) {
+    while (c->outq_len) outq_pop(c);
+}
+
+/* Drop every message that has not started going out. A partly written
+   head stays, so the client never sees a cut-off line or frame. */
+static void outq_drop_unsent(Client *c) {
+    if (!c->head_sent) {
+        outq_clear(c);
+        return;
+    }
+    while (c->outq_len > 1) {
+        Message *m = c->outq[(c->outq_head + c->outq_len - 1) % c->outq_cap];
+        c->outq_len--;
+        c->out_bytes -= m->len;
+        if (c->text_left > c->outq_len) c->text_left = c->outq_len;
+        if (m == c->resync_msg) c->resync_msg = NULL;
+        msg_release(m);
+    }
+}
+
+static int outq_fill_iov(Client *c, struct iovec *iov) {
+    int n = 0;
+    for (int q = 0; q < c->outq_len && n + 2 <= IOV_MAX; q++) {
+        Message *m = c->outq[(c->outq_head + q) % c->outq_cap];
+        size_t off = q == 0 ? c->out_off : 0;
+        if (c->proto == PROTO_BINARY && q >= c->text_left) {
+            size_t hdr = q == 0 ? c->out_hdr : 0;
+            if (hdr < FRAME_HEADER) {
+                iov[n].iov_base = m->frame + hdr;
+                iov[n].iov_len = FRAME_HEADER - hdr;
+                n++;
+            }
+        }
+        if (!m->iter) {
+            if (off < m->len) {
+                iov[n].iov_base = m->data + off;
+                iov[n].iov_len = m->len - off;
+                n++;
+            }
+            continue;
+        }
+        /* look ahead on a copy; the stream only advances in outq_consume */
+        LineIter ahead = *m->iter;
+        for (LineNode *ln = m->cur; ln && n + 2 <= IOV_MAX; ln = line_iter_next(&ahead)) {
+            size_t len = line_length(ln->line);
+            if (off < len) {
+                iov[n].iov_base = ln->line + off;
+                iov[n].iov_len = len - off;
+                n++;
+            }
+            iov[n].iov_base = (void*)&newline_byte;
+            iov[n].iov_len = 1;
+            n++;
+            off = 0;
+        }
+    }
+    return n;
+}
+
+/* advance past n sent bytes, releasing messages that are done */
+static void outq_consume(Client *c, size_t n) {
+    while (c->outq_len) {
+        Message *m = c->outq[c->outq_head];
+        if (n) c->head_sent = 1;
+        if (c->proto == PROTO_BINARY && c->text_left == 0 && c->out_hdr < FRAME_HEADER) {
+            size_t rem = FRAME_HEADER - c->out_hdr;
+            if (n < rem) { c->out_hdr += n; return; }
+            n -= rem;
+            c->out_hdr = FRAME_HEADER;
+        }
+        if (!m->iter) {
+            size_t rem = m->len - c->out_off;
+            if (n < rem) { c->out_off += n; return; }
+            n -= rem;
+        } else {
+            while (m->cur) {
+                size_t rem = line_length(m->cur->line) + 1 - c->out_off;
+                if (n < rem) { c->out_off += n; return; }
+                n -= rem;
+                m->cur = line_iter_next(m->iter);
+                c->out_off = 0;
+            }
+        }
+        outq_pop(c);
+    }
+}
+
+/* Write as much queued output as the socket takes without blocking. Called
+   with out_lock held, only from the owning reactor. Returns -1 if the
+   connection is broken. */
+static int client_flush(Client *c) {
+    struct iovec iov[IOV_MAX];
+    while (c->outq_len) {
+        int cnt = outq_fill_iov(c, iov);
+        if (cnt == 0) { outq_consume(c, 0); continue; } /* empty document or payload */
+        struct msghdr mh = {0};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+        ssize_t n = sendmsg(c->sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0; /* EPOLLOUT resumes */
+            return -1;
+        }
+        if (my_stats) stats_add(&my_stats->bytes_out, (uint64_t)n);
+        outq_consume(c, (size_t)n);
+    }
+    return 0;
+}
+
+/* hand c to its reactor for draining; the first client queued wakes it */
+static void schedule_flush(Client *c) {
+    Reactor *r = &reactors[c->reactor];
+    pthread_mutex_lock(&r->flush_lock);
+    if (!c->in_flush_list) {
+        int was_empty = (r->flush_list == NULL);
+        c->in_flush_list = 1;
+        c->flush_next = r->flush_list;
+        r->flush_list = c;
+        if (was_empty) {
+            uint64_t one = 1;
+            ssize_t w = write(r->wakefd, &one, sizeof(one));
+            (void)w;
+        }
+    }
+    pthread_mutex_unlock(&r->flush_lock);
+}
+
+/* Queue m for c without doing any socket I/O. Returns 1 if c needs its
+   reactor to drain it. */
+static int client_enqueue(Client *c, Message *m) {
+    int wake = 0;
+    pthread_mutex_lock(&c->out_lock);
+    if (c->closed) {
+        /* on its way out */
+    } else if (c->resync) {
+        /* the pending resync document will include this change */
+    } else if (outq_push(c, m) == 0) {
+        wake = (c->outq_len == 1);
+    } else if (c->resync_msg) {
+        /* still has not drained the last resync: give up on it */
+        outq_clear(c);
+        shutdown(c->sock, SHUT_RDWR);
+    } else {
+        outq_drop_unsent(c);
+        c->resync = 1;
+        wake = 1;
+    }
+    pthread_mutex_unlock(&c->out_lock);
+    return wake;
+}
+
+static void outbox_reply(Client *c, Message *m);
+
+/* Reply to the client whose command is being handled. On the owning
+   reactor the queue is flushed right away; a sequencer keeps the reply
+   until its drain is durable (see outbox_flush). */
+static void client_send(Client *c, Message *m) {
+    if (my_outbox) {
+        outbox_reply(c, m);
+        return;
+    }
+    pthread_mutex_lock(&c->out_lock);
+    if (outq_push(c, m) < 0) {
+        outq_clear(c);
+        shutdown(c->sock, SHUT_RDWR);
+    } else if (client_flush(c) < 0) {
+        shutdown(c->sock, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+static void reply(Client *c, const char *msg) {
+    Message *m = msg_new(msg, strlen(msg));
+    if (!m) return;
+    client_send(c, m);
+    msg_release(m);
+}
+
+/* Enqueue a pointer to m for every subscriber of d; the reactors do the
+   writes. Nothing here blocks on a socket. */
+static void fan_out(Document *d, Message *m) {
+    uint64_t t0 = my_stats ? stats_now() : 0;
+    uint64_t t = subs_lock(d, 0), n = 0;
+    Client *c = d->subs;
     while (c) {
-        send(c->sock, msg, strlen(msg), 0);
+        if (client_enqueue(c, m)) schedule_flush(c);
         c = c->next;
+        n++;
+    }
+    subs_unlock(d, t);
+    if (my_stats) {
+        stats_record(&my_stats->broadcast, stats_now() - t0);
+        stats_add(&my_stats->recipients, n);
+    }
+}
+
+static void outbox_add(Outgoing *o) {
+    Outbox *box = my_outbox;
+    if (box->len == box->cap) {
+        int cap = box->cap ? box->cap * 2 : 64;
+        Outgoing *p = (Outgoing*)realloc(box->items, sizeof(Outgoing) * cap);
+        if (!p) {
+            fprintf(stderr, "Memory allocation failed for Outbox\n");
+            exit(1);
+        }
+        box->items = p;
+        box->cap = cap;
+    }
+    box->items[box->len++] = *o;
+}
+
+static void outbox_reply(Client *c, Message *m) {
+    Outgoing o = { c, NULL, m, NULL, 0 };
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    outbox_add(&o);
+}
+
+/* Serialize once and fan out to every subscriber of d */
+void broadcast(Document *d, const char *msg) {
+    size_t len = strlen(msg);
+    if (my_outbox) {
+        Outgoing o = { NULL, d, NULL, (char*)malloc(len), len };
+        if (!o.text) return;
+        memcpy(o.text, msg, len);
+        outbox_add(&o);
+        return;
+    }
+    Message *m = msg_new(msg, len);
+    if (!m) return;
+    fan_out(d, m);
+    msg_release(m);
+}
+
+/* A change made under d's lock at log position lsn is durable before its
+   broadcast goes out: right away here, or for the whole drain on a
+   sequencer. */
+static void doc_commit(Document *d, uint64_t lsn) {
+    Outbox *box = my_outbox;
+    if (!d->wal) return;
+    if (!box) {
+        wal_commit(d->wal, lsn);
+        return;
+    }
+    for (int i = 0; i < box->commit_len; i++) {
+        if (box->commits[i].wal == d->wal) {
+            if (lsn > box->commits[i].lsn) box->commits[i].lsn = lsn;
+            return;
+        }
+    }
+    box->commits[box->commit_len].wal = d->wal;
+    box->commits[box->commit_len].lsn = lsn;
+    box->commit_len++;
+}
+
+/* Commit the drain, then queue its output in order */
+static void outbox_flush(Outbox *box) {
+    for (int i = 0; i < box->commit_len; i++) wal_commit(box->commits[i].wal, box->commits[i].lsn);
+    box->commit_len = 0;
+    for (int i = 0; i < box->len;) {
+        Outgoing *o = &box->items[i];
+        if (o->c) {
+            Client *c = o->c;
+            pthread_mutex_lock(&c->out_lock);
+            if (c->closed) {
+                /* the reply has no one to go to */
+            } else if (outq_push(c, o->m) < 0) {
+                outq_clear(c);
+                shutdown(c->sock, SHUT_RDWR);
+            } else {
+                /* under out_lock, so close_client cannot have taken c off the list already */
+                schedule_flush(c);
+            }
+            pthread_mutex_unlock(&c->out_lock);
+            msg_release(o->m);
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        size_t total = o->len;
+        while (j < box->len && !box->items[j].c && box->items[j].d == o->d &&
+               total + box->items[j].len <= SEQ_COALESCE_BYTES)
+            total += box->items[j++].len;
+        Message *m = msg_new(NULL, total);
+        size_t off = 0;
+        for (int k = i; k < j; k++) {
+            if (m) memcpy(m->data + off, box->items[k].text, box->items[k].len);
+            off += box->items[k].len;
+            free(box->items[k].text);
+        }
+        if (m) {
+            fan_out(o->d, m);
+            msg_release(m);
+        }
+        i = j;
+    }
+    box->len = 0;
+}
+
+/* Resend the whole document to a client that overflowed its queue. The
+   snapshot is taken and the resync ended under the document lock, and
+   edits are broadcast only after it is released: a change made before is
+   in the document, and one made after is queued behind it, so none of the
+   broadcasts skipped meanwhile is lost. */
+static void client_resync(Client *c) {
+    Document *d = c->doc;
+    doc_lock(d);
+    LineNode *root = buffer_snapshot(d->buffer);
+    uint64_t revision = d->buffer->revision;
+    pthread_mutex_lock(&c->out_lock);
+    doc_unlock(d);
+    char header[64];
+    int hlen = snprintf(header, sizeof(header), "RESYNC\nDOC@%llu %d\n",
+                        (unsigned long long)revision, snapshot_line_count(root));
+    Message *doc = msg_snapshot(d, root, revision, c->proto == PROTO_BINARY);
+    Message *h = msg_new(header, hlen);
+    if (doc && h && outq_push(c, h) == 0 && outq_push(c, doc) == 0) {
+        c->resync_msg = doc;
+        c->resync = 0;
+    } else {
+        outq_clear(c);
+        shutdown(c->sock, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&c->out_lock);
+    msg_release(h);
+    msg_release(doc);
+}
+
+/* Reply to GET: take an O(1) snapshot (see doc_read), then queue it as a
+   stream that is written straight from the line storage with vectored I/O.
+   The lock is not held during the transfer and the document is never
+   copied; edits made meanwhile copy the nodes they touch instead. The
+   "DOC@<rev> <n>" header names the revision the snapshot shows, so a client
+   knows which broadcasts it already contains. Binary clients get the header
+   as an event and the document as a single OP_DOC frame. */
+static void send_document(Client *c) {
+    Message *doc = msg_document(c->doc, c->proto == PROTO_BINARY);
+    if (!doc) return;
+    char header[64];
+    int hlen = snprintf(header, sizeof(header), "DOC@%llu %d\n",
+                        (unsigned long long)doc->revision, doc->count);
+    Message *h = msg_new(header, hlen);
+    if (h) {
+        client_send(c, h);
+        client_send(c, doc);
+    }
+    msg_release(h);
+    msg_release(doc);
+}
+
+/* Reply to SYNC <rev> from a client that has the document as of revision
+   rev: the changes since, as "SYNC@<now> <n>" followed by n INS/DEL/UPD
+   lines, which cost as much as the edits rather than the document. If the
+   change log no longer reaches back to rev (or the replay would be larger
+   than a client queue), the whole document is sent instead, as for GET.
+   The replay is queued before the document lock is released, so every
+   later change reaches the client after it. */
+#define SYNC_HEADER 64 /* room reserved in front of the replayed changes */
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} SyncOut;
+
+static void sync_append(void *ctx, int type, int position, int column, const char *text) {
+    SyncOut *o = (SyncOut*)ctx;
+    size_t need = line_length(text) + 32;
+    if (o->failed) return;
+    if (o->len + need > o->cap) {
+        size_t cap = o->cap * 2 > o->len + need ? o->cap * 2 : o->len + need;
+        char *p = cap <= OUTQ_MAX_BYTES ? (char*)realloc(o->buf, cap) : NULL;
+        if (!p) {
+            o->failed = 1;
+            return;
+        }
+        o->buf = p;
+        o->cap = cap;
+    }
+    if (type == DELETE_OP) {
+        o->len += snprintf(o->buf + o->len, o->cap - o->len, "DEL %d\n", position);
+        return;
+    }
+    if (type == DELETE_CHARS_OP) {
+        o->len += snprintf(o->buf + o->len, o->cap - o->len, "DELC %d %d %zu\n", position, column,
+                           line_length(text));
+        return;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    if (type == INSERT_CHARS_OP)
+        o->len += snprintf(o->buf + o->len, o->cap - o->len, "INSC %d %d ", position, column);
+    else
+        o->len += snprintf(o->buf + o->len, o->cap - o->len, "%s %d ", type == INSERT_OP ? "INS" : "UPD", position);
+    memcpy(o->buf + o->len, text, line_length(text));
+    o->len += line_length(text);
+    o->buf[o->len++] = '\n';
 }
 
-void handle_command(char *line, int sock) {
+static void send_sync(Client *c, uint64_t since) {
+    Document *d = c->doc;
+    SyncOut o = { NULL, SYNC_HEADER, 0, 0 };
+    int wake = 0;
+    doc_lock(d);
+    int n = buffer_changes_since(d->buffer, since, sync_append, &o);
+    if (n >= 0 && !o.failed) {
+        char header[SYNC_HEADER];
+        int hlen = snprintf(header, sizeof(header), "SYNC@%llu %d\n",
+                            (unsigned long long)d->buffer->revision, n);
+        Message *m;
+        if (o.buf) {
+            memcpy(o.buf + SYNC_HEADER - hlen, header, hlen);
+            m = msg_new(o.buf + SYNC_HEADER - hlen, o.len - SYNC_HEADER + hlen);
+        } else {
+            m = msg_new(header, hlen);
+        }
+        if (m && my_outbox) outbox_reply(c, m);
+        else if (m) wake = client_enqueue(c, m);
+        msg_release(m);
+    }
+    doc_unlock(d);
+    free(o.buf);
+    if (n < 0 || o.failed) send_document(c);
+    else if (wake) schedule_flush(c);
+}
+
+/* doc_lock, first bringing versions a and b back if they were spilled
+   under the memory budget; the spill file is read with the lock dropped,
+   so edits and readers are not held up behind the disk. */
+static void doc_lock_versions(Document *d, int a, int b) {
+    doc_lock(d);
+    VersionLoad *l = vtree_load_plan(&d->vtree, vtree_find(&d->vtree, a), vtree_find(&d->vtree, b));
+    if (!l) return;
+    doc_unlock(d);
+    vtree_load_read(l);
+    doc_lock(d);
+    vtree_load_finish(&d->vtree, d->buffer, l);
+}
+
+/* Reply to DIFF <a> <b>: the changed hunks that turn version a into
+   version b, each as "@@ a_pos a_len b_pos b_len" followed by the removed
+   lines ("-") and the added lines ("+"). Both versions are held by snapshot
+   reference, so the diff itself runs without the document lock. Runs on
+   the sequencer (see is_slow): neither the diff nor reading spilled
+   versions back holds up a reactor. */
+static void send_diff(Client *c, int a, int b) {
+    Document *doc = c->doc;
+    doc_lock_versions(doc, a, b);
+    VersionNode *va = vtree_find(&doc->vtree, a), *vb = vtree_find(&doc->vtree, b);
+    LineNode *ra = NULL, *rb = NULL;
+    int rc = 0;
+    if (va && vb) {
+        /* a is retained first: loading b may evict it */
+        rc = vtree_root(&doc->vtree, doc->buffer, va, &ra);
+        ra = snapshot_retain(ra);
+        if (rc == 0) rc = vtree_root(&doc->vtree, doc->buffer, vb, &rb);
+        rb = snapshot_retain(rb);
+    }
+    doc_unlock(doc);
+    char msg[256];
+    if (!va || !vb) {
+        snprintf(msg, sizeof(msg), "ERR no version %d\n", va ? b : a);
+        reply(c, msg);
+    } else if (rc < 0) {
+        reply(c, "ERR cannot read back a spilled version\n");
+    } else {
+        VersionDiff d;
+        vtree_diff(ra, rb, &d);
+        size_t total = 64;
+        for (int h = 0; h < d.hunk_count; h++) {
+            DiffHunk *hk = &d.hunks[h];
+            total += 64;
+            for (int i = 0; i < hk->a_len; i++) total += line_length(d.a_lines[hk->a_pos + i]) + 2;
+            for (int i = 0; i < hk->b_len; i++) total += line_length(d.b_lines[hk->b_pos + i]) + 2;
+        }
+        char *out = total <= OUTQ_MAX_BYTES ? (char*)malloc(total) : NULL;
+        if (!out) {
+            reply(c, "ERR diff too large\n");
+        } else {
+            size_t len = snprintf(out, total, "DIFF %d %d %d\n", a, b, d.hunk_count);
+            for (int h = 0; h < d.hunk_count; h++) {
+                DiffHunk *hk = &d.hunks[h];
+                len += snprintf(out + len, total - len, "@@ %d %d %d %d\n",
+                                hk->a_pos, hk->a_len, hk->b_pos, hk->b_len);
+                for (int i = 0; i < hk->a_len + hk->b_len; i++) {
+                    const char *ln = i < hk->a_len ? d.a_lines[hk->a_pos + i] : d.b_lines[hk->b_pos + i - hk->a_len];
+                    size_t l = line_length(ln);
+                    out[len++] = i < hk->a_len ? '-' : '+';
+                    memcpy(out + len, ln, l);
+                    len += l;
+                    out[len++] = '\n';
+                }
+            }
+            Message *m = msg_new(out, len);
+            free(out);
+            if (m) client_send(c, m);
+            msg_release(m);
+        }
+        vtree_diff_free(&d);
+    }
+    buffer_read_release(doc->buffer, ra);
+    buffer_read_release(doc->buffer, rb);
+}
+
+/* ---- commands ---- */
+
+/* A request from either protocol. Text lines are parsed into one; binary
+   frames fill it straight from their header, with text pointing into the
+   reassembly buffer. */
+typedef struct {
+    int op;         /* OP_*, -1 if unknown */
+    int pos;        /* line, version id, batch size, first DIFF version or first line searched */
+    int arg;        /* second DIFF version, INSC/DELC column, or end of the lines searched (-1: the last) */
+    char *text;     /* INS/UPD line, INSC characters or FIND/REPLACE pattern, NUL-terminated */
+    int has_base;   /* INS/DEL/UPD/INSC/DELC made against revision base (INS@<rev>) */
+    uint64_t base;
+    int length;     /* DELC characters, or pattern length */
+    char *with;     /* REPLACE text, NUL-terminated */
+} Command;
+
+/* Every broadcast that changes the document is stamped with the revision
+   it leaves the document at: "APPLY@<rev> ..." */
+static void broadcast_edit(Document *d, uint64_t rev, const char *verb, int pos, const char *text) {
+    size_t n = strlen(text) + 64;
+    char *msg = (char*)malloc(n);
+    if (!msg) return;
+    snprintf(msg, n, "APPLY@%llu %s %d %s\n", (unsigned long long)rev, verb, pos, text);
+    broadcast(d, msg);
+    free(msg);
+}
+
+static void batch_free(BatchOp *ops, int len, int expected) {
+    for (int i = 0; i < len && i < expected; i++) free(ops[i].text);
+    free(ops);
+}
+
+static void batch_reset(Client *c) {
+    batch_free(c->batch, c->batch_len, c->batch_expected);
+    c->batch = NULL;
+    c->batch_len = 0;
+    c->batch_expected = 0;
+}
+
+/* Validate and apply every collected op under one acquisition of the
+   document lock, as one undo group, then send a single combined APPLY BATCH
+   frame. Either all ops apply or none do. Runs on the sequencer; the ops
+   are freed here. */
+static void run_batch(Client *c, BatchOp *ops, int n, int expected) {
+    Document *d = c->doc;
+    char err[256];
+    if (n != expected) {
+        snprintf(err, sizeof(err), "ERR batch expected %d ops, got %d\n", expected, n);
+        reply(c, err);
+        batch_free(ops, n, expected);
+        return;
+    }
+    size_t frame_len = 64;
+    for (int i = 0; i < n; i++) {
+        if (ops[i].type < 0) {
+            snprintf(err, sizeof(err), "ERR batch op %d: unknown command\n", i);
+            reply(c, err);
+            batch_free(ops, n, expected);
+            return;
+        }
+        frame_len += strlen(ops[i].text) + 32;
+    }
+
+    doc_lock(d);
+    /* positions are relative to the document as left by the earlier ops */
+    int count = d->buffer->line_count;
+    for (int i = 0; i < n; i++) {
+        int limit = ops[i].type == INSERT_OP ? count : count - 1;
+        if (ops[i].pos < 0 || ops[i].pos > limit) {
+            doc_unlock(d);
+            snprintf(err, sizeof(err), "ERR batch op %d: invalid position %d\n", i, ops[i].pos);
+            reply(c, err);
+            batch_free(ops, n, expected);
+            return;
+        }
+        if (ops[i].type == INSERT_OP) count++;
+        else if (ops[i].type == DELETE_OP) count--;
+    }
+    beginGroup(d->buffer);
+    for (int i = 0; i < n; i++) {
+        if (ops[i].type == INSERT_OP) insertLine(d->buffer, ops[i].pos, ops[i].text);
+        else if (ops[i].type == DELETE_OP) deleteLine(d->buffer, ops[i].pos);
+        else updateLine(d->buffer, ops[i].pos, ops[i].text);
+    }
+    endGroup(d->buffer);
+    uint64_t rev = d->buffer->revision;
+    uint64_t lsn = wal_position(d->wal);
+    doc_unlock(d);
+    doc_commit(d, lsn);
+
+    char *frame = (char*)malloc(frame_len);
+    if (frame) {
+        size_t off = snprintf(frame, frame_len, "APPLY@%llu BATCH %d\n", (unsigned long long)rev, n);
+        for (int i = 0; i < n; i++) {
+            if (ops[i].type == DELETE_OP)
+                off += snprintf(frame + off, frame_len - off, "DEL %d\n", ops[i].pos);
+            else
+                off += snprintf(frame + off, frame_len - off, "%s %d %s\n",
+                                ops[i].type == INSERT_OP ? "INS" : "UPD", ops[i].pos, ops[i].text);
+        }
+        snprintf(frame + off, frame_len - off, "END\n");
+        broadcast(d, frame);
+        free(frame);
+    }
+    batch_free(ops, n, expected);
+}
+
+/* LOAD and SAVE take paths relative to the -f directory; absolute paths
+   and ".." components are refused. */
+static int path_allowed(const char *path) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= PATH_MAX - 8 || path[0] == '/') return 0;
+    for (const char *p = path;;) {
+        const char *slash = strchr(p, '/');
+        size_t n = slash ? (size_t)(slash - p) : strlen(p);
+        if (n == 2 && p[0] == '.' && p[1] == '.') return 0;
+        if (!slash) return 1;
+        p = slash + 1;
+    }
+}
+
+static int in_data_dir(int fd) {
+    struct stat st;
+    if (!data_dir) return 0;
+    return fstat(fd, &st) < 0 || (st.st_dev == data_dir_st.st_dev && st.st_ino == data_dir_st.st_ino);
+}
+
+/* Open the directory that holds path, one component at a time from the -f
+   directory with O_NOFOLLOW, so no symlink can lead out of it, and refuse
+   the log directory (documents keep theirs below it). Returns the
+   directory, with *base set to the last component, or -1. */
+static int open_parent(const char *path, const char **base) {
+    if (files_fd < 0 || !path_allowed(path)) return -1;
+    int dir = dup(files_fd);
+    const char *p = path;
+    for (const char *slash; dir >= 0 && (slash = strchr(p, '/')); p = slash + 1) {
+        char name[NAME_MAX + 1];
+        size_t n = (size_t)(slash - p);
+        if (n > NAME_MAX) {
+            close(dir);
+            return -1;
+        }
+        memcpy(name, p, n);
+        name[n] = '\0';
+        int next = openat(dir, n ? name : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        close(dir);
+        dir = next;
+        if (dir >= 0 && in_data_dir(dir)) {
+            close(dir);
+            return -1;
+        }
+    }
+    if (dir < 0 || *p == '\0' || strcmp(p, ".") == 0) {
+        if (dir >= 0) close(dir);
+        return -1;
+    }
+    *base = p;
+    return dir;
+}
+
+/* LOAD: map the file and build the document from it in one pass under the
+   lock (see buffer_load). It is one undo step and one broadcast, after
+   which clients GET the new document. */
+static void load_file(Client *c, const char *path) {
+    Document *d = c->doc;
+    char msg[128];
+    struct stat st;
+    const char *base;
+    int dir = open_parent(path, &base), fd = -1;
+    if (dir >= 0) {
+        /* O_NONBLOCK: a FIFO must not stall the thread before the check below */
+        fd = openat(dir, base, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+        close(dir);
+    }
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        snprintf(msg, sizeof(msg), "ERR cannot load %.64s\n", path);
+        reply(c, msg);
+        return;
+    }
+    size_t len = (size_t)st.st_size;
+    void *map = NULL;
+    if (len) {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            snprintf(msg, sizeof(msg), "ERR cannot load %.64s\n", path);
+            reply(c, msg);
+            return;
+        }
+        madvise(map, len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    doc_lock(d);
+    int n = buffer_load(d->buffer, map ? (const char*)map : "", len);
+    uint64_t rev = d->buffer->revision;
+    uint64_t lsn = wal_position(d->wal);
+    doc_unlock(d);
+    if (map) munmap(map, len);
+    if (n < 0) {
+        snprintf(msg, sizeof(msg), "ERR %.64s is not a text file\n", path);
+        reply(c, msg);
+        return;
+    }
+    doc_commit(d, lsn);
+    snprintf(msg, sizeof(msg), "LOADED@%llu %d\n", (unsigned long long)rev, n);
+    broadcast(d, msg);
+}
+
+/* SAVE: write the published snapshot, without the lock, to a temporary
+   file that replaces the target once it is on disk. Runs on the sequencer
+   (see is_slow), so the write and fsync never stall a reactor. */
+static void save_file(Client *c, const char *path) {
+    Document *d = c->doc;
+    char msg[128], tmp[NAME_MAX + 8];
+    const char *base;
+    int dir = open_parent(path, &base);
+    if (dir < 0 || strlen(base) > NAME_MAX - 4) {
+        if (dir >= 0) close(dir);
+        snprintf(msg, sizeof(msg), "ERR cannot save %.64s\n", path);
+        reply(c, msg);
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", base);
+    uint64_t rev;
+    LineNode *root = doc_read(d, &rev);
+    int fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (fd >= 0 && !f) close(fd);
+    int ok = f != NULL;
+    if (f) {
+        setvbuf(f, NULL, _IOFBF, 1 << 16);
+        LineIter it;
+        line_iter_init(&it, root);
+        for (LineNode *n = line_iter_next(&it); n && ok; n = line_iter_next(&it)) {
+            size_t len = line_length(n->line);
+            ok = fwrite(n->line, 1, len, f) == len && putc('\n', f) != EOF;
+        }
+        ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+        /* renaming replaces a symlink at base rather than following it */
+        ok = ok && renameat(dir, tmp, dir, base) == 0;
+        if (!ok) unlinkat(dir, tmp, 0);
+    }
+    close(dir);
+    int lines = snapshot_line_count(root);
+    buffer_read_release(d->buffer, root);
+    if (ok) snprintf(msg, sizeof(msg), "SAVED@%llu %d\n", (unsigned long long)rev, lines);
+    else snprintf(msg, sizeof(msg), "ERR cannot save %.64s\n", path);
+    reply(c, msg);
+}
+
+/* FIND: search a snapshot, without the lock, on the worker pool (see
+   search.h). Replies "FOUND@<rev> <total> <n>" and the first n matches as
+   "<line> <column>" lines, n at most FIND_MAX_HITS. Runs on the sequencer
+   (see is_slow), so the reactor serves its other clients meanwhile. */
+static void find_text(Client *c, Command *cmd) {
+    Document *d = c->doc;
+    SearchQuery q = { cmd->text, (size_t)cmd->length, NULL, 0, cmd->pos, cmd->arg, FIND_MAX_HITS, 0 };
+    SearchResult r;
+    uint64_t rev;
+    LineNode *root = doc_read(d, &rev);
+    search_lines(root, &q, &r);
+    buffer_read_release(d->buffer, root);
+
+    size_t cap = 64 + (size_t)r.hit_count * 24;
+    char *out = (char*)malloc(cap);
+    if (out) {
+        size_t len = snprintf(out, cap, "FOUND@%llu %ld %d\n", (unsigned long long)rev, r.total, r.hit_count);
+        for (int i = 0; i < r.hit_count; i++)
+            len += snprintf(out + len, cap - len, "%d %d\n", r.hits[i].line, r.hits[i].column);
+        Message *m = msg_new(out, len);
+        if (m) {
+            client_send(c, m);
+            msg_release(m);
+        }
+        free(out);
+    }
+    search_result_free(&r);
+}
+
+/* REPLACE: every match in the range, found under the lock by the same
+   parallel search, becomes one UPD of its line; all of them are applied
+   in one walk of the tree (updateLines) as one undo group. Like BATCH, the
+   result is a single "APPLY@<rev> BATCH <n>" broadcast of the new lines,
+   or "REPLACED@<rev> <n>" (clients GET or SYNC) when that would not fit a
+   client queue. */
+static void replace_text(Client *c, Command *cmd) {
+    Document *d = c->doc;
+    SearchQuery q = { cmd->text, (size_t)cmd->length, cmd->with, strlen(cmd->with), cmd->pos, cmd->arg,
+                      0, FRAME_MAX_PAYLOAD };
+    SearchResult r;
+    char msg[128];
+    doc_lock(d);
+    int rc = search_lines(d->buffer->root, &q, &r);
+    if (rc == 0 && r.line_count) {
+        beginGroup(d->buffer);
+        updateLines(d->buffer, r.lines, r.texts, r.line_count);
+        endGroup(d->buffer);
+    }
+    uint64_t rev = d->buffer->revision;
+    uint64_t lsn = wal_position(d->wal);
+    doc_unlock(d);
+    if (rc < 0) {
+        reply(c, "ERR replacement makes a line too long\n");
+        return;
+    }
+    if (r.line_count == 0) {
+        snprintf(msg, sizeof(msg), "REPLACED@%llu 0\n", (unsigned long long)rev);
+        reply(c, msg);
+        search_result_free(&r);
+        return;
+    }
+    doc_commit(d, lsn);
+
+    size_t frame_len = 64;
+    for (int i = 0; i < r.line_count && frame_len <= OUTQ_MAX_BYTES; i++) frame_len += strlen(r.texts[i]) + 32;
+    char *frame = frame_len <= OUTQ_MAX_BYTES ? (char*)malloc(frame_len) : NULL;
+    if (frame) {
+        size_t off = snprintf(frame, frame_len, "APPLY@%llu BATCH %d\n", (unsigned long long)rev, r.line_count);
+        for (int i = 0; i < r.line_count; i++)
+            off += snprintf(frame + off, frame_len - off, "UPD %d %s\n", r.lines[i], r.texts[i]);
+        snprintf(frame + off, frame_len - off, "END\n");
+        broadcast(d, frame);
+        free(frame);
+    } else {
+        snprintf(msg, sizeof(msg), "REPLACED@%llu %d\n", (unsigned long long)rev, r.line_count);
+        broadcast(d, msg);
+    }
+    search_result_free(&r);
+}
+
+static void send_stats(Client *c);
+
+static void execute_command(Client *c, Command *cmd) {
+    Document *d = c->doc;
+    int pos = cmd->pos;
+    char msg[256];
+    switch (cmd->op) {
+    case OP_BATCH:
+        if (pos <= 0 || pos > MAX_BATCH_OPS) {
+            snprintf(msg, sizeof(msg), "ERR invalid batch size %d\n", pos);
+            reply(c, msg);
+            return;
+        }
+        c->batch = (BatchOp*)calloc(pos, sizeof(BatchOp));
+        if (!c->batch) return;
+        c->batch_expected = pos;
+        c->batch_len = 0;
+        break;
+    case OP_INS:
+    case OP_UPD:
+    case OP_DEL: {
+        doc_lock(d);
+        if (cmd->has_base) {
+            /* made against an older revision: move it past what was committed since */
+            int type = cmd->op == OP_INS ? INSERT_OP : cmd->op == OP_DEL ? DELETE_OP : UPDATE_OP;
+            int rc = buffer_transform(d->buffer, cmd->base, type, &pos);
+            if (rc != 0) {
+                doc_unlock(d);
+                if (rc < 0) snprintf(msg, sizeof(msg), "ERR stale revision %llu\n", (unsigned long long)cmd->base);
+                else snprintf(msg, sizeof(msg), "ERR conflict: line %d was deleted\n", cmd->pos);
+                reply(c, msg);
+                return;
+            }
+        }
+        if (!valid_position(d->buffer, pos) || (cmd->op != OP_INS && pos >= d->buffer->line_count)) {
+            doc_unlock(d);
+            snprintf(msg, sizeof(msg), "ERR invalid position %d\n", pos);
+            reply(c, msg);
+            return;
+        }
+        if (cmd->op == OP_INS) insertLine(d->buffer, pos, cmd->text);
+        else if (cmd->op == OP_UPD) updateLine(d->buffer, pos, cmd->text);
+        else deleteLine(d->buffer, pos);
+        uint64_t rev = d->buffer->revision;
+        uint64_t lsn = wal_position(d->wal);
+        doc_unlock(d);
+        doc_commit(d, lsn);
+        if (cmd->op == OP_DEL) {
+            snprintf(msg, sizeof(msg), "APPLY@%llu DEL %d\n", (unsigned long long)rev, pos);
+            broadcast(d, msg);
+        } else {
+            broadcast_edit(d, rev, cmd->op == OP_INS ? "INS" : "UPD", pos, cmd->text);
+        }
+        break;
+    }
+    case OP_INSC:
+    case OP_DELC: {
+        /* only the characters travel: the line itself is neither resent nor copied */
+        int col = cmd->arg, len = cmd->op == OP_INSC ? 0 : cmd->length;
+        if (cmd->op == OP_DELC && len <= 0) {
+            snprintf(msg, sizeof(msg), "ERR invalid length %d\n", len);
+            reply(c, msg);
+            return;
+        }
+        doc_lock(d);
+        if (cmd->has_base) {
+            int rc = buffer_transform_range(d->buffer, cmd->base, &pos, &col, &len);
+            if (rc != 0) {
+                doc_unlock(d);
+                if (rc < 0) snprintf(msg, sizeof(msg), "ERR stale revision %llu\n", (unsigned long long)cmd->base);
+                else snprintf(msg, sizeof(msg), "ERR conflict: line %d was changed\n", cmd->pos);
+                reply(c, msg);
+                return;
+            }
+        }
+        int rc = cmd->op == OP_INSC ? insertChars(d->buffer, pos, col, cmd->text, strlen(cmd->text))
+                                    : deleteChars(d->buffer, pos, col, len);
+        uint64_t rev = d->buffer->revision;
+        uint64_t lsn = wal_position(d->wal);
+        doc_unlock(d);
+        if (rc < 0) {
+            snprintf(msg, sizeof(msg), "ERR invalid range %d:%d\n", pos, col);
+            reply(c, msg);
+            return;
+        }
+        doc_commit(d, lsn);
+        if (cmd->op == OP_DELC) {
+            snprintf(msg, sizeof(msg), "APPLY@%llu DELC %d %d %d\n", (unsigned long long)rev, pos, col, len);
+            broadcast(d, msg);
+        } else {
+            size_t n = strlen(cmd->text) + 80;
+            char *out = (char*)malloc(n);
+            if (!out) return;
+            snprintf(out, n, "APPLY@%llu INSC %d %d %s\n", (unsigned long long)rev, pos, col, cmd->text);
+            broadcast(d, out);
+            free(out);
+        }
+        break;
+    }
+    case OP_UNDO:
+    case OP_REDO: {
+        doc_lock(d);
+        if (cmd->op == OP_UNDO) undo(d->buffer);
+        else redo(d->buffer);
+        uint64_t rev = d->buffer->revision;
+        uint64_t lsn = wal_position(d->wal);
+        doc_unlock(d);
+        doc_commit(d, lsn);
+        snprintf(msg, sizeof(msg), "APPLY@%llu %s\n", (unsigned long long)rev,
+                 cmd->op == OP_UNDO ? "UNDO" : "REDO");
+        broadcast(d, msg);
+        break;
+    }
+    case OP_SNAP: {
+        /* new versions branch off the one last snapshotted or restored */
+        doc_lock(d);
+        VersionNode *v = vtree_snapshot(&d->vtree, d->buffer, d->vtree.current);
+        wal_log_snapshot(d->wal);
+        uint64_t lsn = wal_position(d->wal);
+        doc_unlock(d);
+        doc_commit(d, lsn);
+        snprintf(msg, sizeof(msg), "SNAPSHOT v%d\n", v->id);
+        broadcast(d, msg);
+        break;
+    }
+    case OP_RESTORE: {
+        doc_lock_versions(d, pos, 0);
+        int rc = vtree_restore(&d->vtree, d->buffer, pos);
+        if (rc == 0) wal_log_restore(d->wal, pos);
+        uint64_t rev = d->buffer->revision;
+        uint64_t lsn = wal_position(d->wal);
+        doc_unlock(d);
+        doc_commit(d, lsn);
+        if (rc < 0) {
+            if (rc == -1) snprintf(msg, sizeof(msg), "ERR no version %d\n", pos);
+            else snprintf(msg, sizeof(msg), "ERR cannot read back version %d\n", pos);
+            reply(c, msg);
+            return;
+        }
+        snprintf(msg, sizeof(msg), "RESTORED@%llu v%d\n", (unsigned long long)rev, pos);
+        broadcast(d, msg);
+        break;
+    }
+    case OP_OPEN: {
+        Document *to = doc_valid_name(cmd->text) ? doc_open(cmd->text) : NULL;
+        if (!to) {
+            snprintf(msg, sizeof(msg), "ERR cannot open document %.64s\n", cmd->text);
+            reply(c, msg);
+            return;
+        }
+        if (to != d) {
+            doc_unsubscribe(d, c);
+            c->doc = to;
+            doc_subscribe(to, c);
+        }
+        doc_lock(to);
+        int lines = to->buffer->line_count;
+        doc_unlock(to);
+        snprintf(msg, sizeof(msg), "OPENED %s %d\n", to->name, lines);
+        reply(c, msg);
+        break;
+    }
+    case OP_LIST_VERSIONS:
+        doc_lock(d);
+        print_versions(d->vtree.root, 0);
+        doc_unlock(d);
+        break;
+    case OP_DIFF:
+        send_diff(c, pos, cmd->arg);
+        break;
+    case OP_GET:
+        send_document(c);
+        break;
+    case OP_SYNC:
+        send_sync(c, cmd->base);
+        break;
+    case OP_STATS:
+        send_stats(c);
+        break;
+    case OP_LOAD:
+        load_file(c, cmd->text);
+        break;
+    case OP_SAVE:
+        save_file(c, cmd->text);
+        break;
+    case OP_FIND:
+    case OP_REPLACE:
+        if (cmd->length <= 0 || pos < 0 || (cmd->arg >= 0 && cmd->arg < pos)) {
+            reply(c, cmd->length <= 0 ? "ERR empty pattern\n" : "ERR invalid range\n");
+            return;
+        }
+        if (cmd->op == OP_FIND) find_text(c, cmd);
+        else replace_text(c, cmd);
+        break;
+    case OP_PRINT: {
+        uint64_t rev;
+        LineNode *root = doc_read(d, &rev);
+        snapshot_print(root);
+        buffer_read_release(d->buffer, root);
+        break;
+    }
+    default:
+        reply(c, "ERR unknown command\n");
+    }
+}
+
+/* A command on its way to a sequencer, with its strings copied out of the
+   reactor's buffers */
+typedef struct QueuedCommand {
+    Client *c;
+    Command cmd;
+    BatchOp *batch;         /* END: the collected ops, owned from here on */
+    int batch_len;
+    int batch_expected;
+    uint64_t queued_at;     /* for the sequencer_wait histogram */
+    char data[];
+} QueuedCommand;
+
+static int is_edit(int op) {
+    return op == OP_INS || op == OP_DEL || op == OP_UPD || op == OP_INSC || op == OP_DELC ||
+           op == OP_UNDO || op == OP_REDO || op == OP_SNAP || op == OP_RESTORE || op == OP_LOAD ||
+           op == OP_REPLACE;
+}
+
+/* Commands that can block for long (on the disk, the search pool or a
+   diff of two versions) go to the sequencer as well, so that no reactor
+   ever waits for them; their replies go out through the outbox like an
+   edit's. */
+static int is_slow(int op) {
+    return op == OP_SAVE || op == OP_FIND || op == OP_DIFF;
+}
+
+/* a copy of cmd that outlives the read buffer */
+static QueuedCommand* command_copy(Client *c, Command *cmd) {
+    /* a binary REPLACE's pattern runs straight into its text */
+    size_t tlen = !cmd->text ? 0 : cmd->op == OP_FIND || cmd->op == OP_REPLACE ?
+                  (size_t)(cmd->length > 0 ? cmd->length : 0) : strlen(cmd->text);
+    size_t wlen = cmd->with ? strlen(cmd->with) : 0;
+    QueuedCommand *q = (QueuedCommand*)malloc(sizeof(QueuedCommand) + tlen + wlen + 2);
+    if (!q) {
+        fprintf(stderr, "Memory allocation failed for QueuedCommand\n");
+        exit(1);
+    }
+    q->c = c;
+    q->cmd = *cmd;
+    q->batch = NULL;
+    q->batch_len = 0;
+    q->batch_expected = 0;
+    if (cmd->text) {
+        memcpy(q->data, cmd->text, tlen);
+        q->data[tlen] = '\0';
+        q->cmd.text = q->data;
+    }
+    if (cmd->with) {
+        memcpy(q->data + tlen + 1, cmd->with, wlen);
+        q->data[tlen + 1 + wlen] = '\0';
+        q->cmd.with = q->data + tlen + 1;
+    }
+    return q;
+}
+
+static void sequence_command(Client *c, Command *cmd) {
+    QueuedCommand *q = command_copy(c, cmd);
+    if (cmd->op == OP_END && c->batch_expected) {
+        q->batch = c->batch;
+        q->batch_len = c->batch_len;
+        q->batch_expected = c->batch_expected;
+        c->batch = NULL;
+        c->batch_len = 0;
+        c->batch_expected = 0;
+    }
+    q->queued_at = my_stats ? stats_now() : 0;
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+    ring_push(&c->doc->seq->ring, q);
+}
+
+/* On the reactor: collect BATCH ops, hand edits (and anything behind
+   them) to the document's sequencer, and run the rest here. */
+static void run_command(Client *c, Command *cmd) {
+    if (c->batch_expected && cmd->op != OP_END) {
+        if (c->batch_len < c->batch_expected) {
+            char *copy = strdup(cmd->text ? cmd->text : "");
+            if (!copy) return;
+            BatchOp *op = &c->batch[c->batch_len++];
+            /* ops in a batch are relative to each other, not to a revision */
+            op->type = cmd->has_base ? -1 : cmd->op == OP_INS ? INSERT_OP :
+                       cmd->op == OP_DEL ? DELETE_OP : cmd->op == OP_UPD ? UPDATE_OP : -1;
+            op->pos = cmd->pos;
+            op->text = copy;
+        } else {
+            c->batch_len++; /* counted only, reported at END */
+        }
+        return;
+    }
+    if (cmd->op == OP_BATCH && cmd->pos > 0 && cmd->pos <= MAX_BATCH_OPS) {
+        execute_command(c, cmd); /* starts collecting; only a bad size is answered */
+        return;
+    }
+    if (cmd->op == OP_OPEN && __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 1) {
+        /* OPEN moves c to another document, so the current one's sequencer
+           must be done with c first. Rather than wait here, park the OPEN
+           and stop reading from c; the sequencer's last client_put hands it
+           back to this reactor (resume_client). */
+        QueuedCommand *q = command_copy(c, cmd);
+        pthread_mutex_lock(&c->out_lock);
+        c->parked = q;
+        int idle = __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) == 1;
+        if (idle) schedule_flush(c);
+        pthread_mutex_unlock(&c->out_lock);
+        return;
+    }
+    if (cmd->op != OP_OPEN && ((cmd->op == OP_END && c->batch_expected) || is_edit(cmd->op) ||
+                               is_slow(cmd->op) || __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 1)) {
+        sequence_command(c, cmd);
+        return;
+    }
+    if (!my_stats || cmd->op < 0 || cmd->op >= STATS_OPS) {
+        execute_command(c, cmd);
+        return;
+    }
+    uint64_t t0 = stats_now();
+    execute_command(c, cmd);
+    stats_record(&my_stats->command[cmd->op], stats_now() - t0);
+}
+
+/* drop one of c's references; see close_client. Under out_lock, so that
+   a parked OPEN (see run_command) is either seen here or sees the count. */
+static void client_put(Client *c) {
+    pthread_mutex_lock(&c->out_lock);
+    int left = __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+    if (left == 1 && c->parked) schedule_flush(c);
+    pthread_mutex_unlock(&c->out_lock);
+    if (left != 0) return;
+    pthread_mutex_destroy(&c->out_lock);
+    free(c->outq);
+    free(c);
+}
+
+static void *sequencer_loop(void *arg) {
+    Sequencer *s = (Sequencer*)arg;
+    void *items[SEQ_DRAIN_MAX];
+    Outbox box;
+    memset(&box, 0, sizeof(box));
+    stats_thread_start();
+    my_outbox = &box;
+    for (;;) {
+        int n = ring_pop(&s->ring, items, SEQ_DRAIN_MAX);
+        for (int i = 0; i < n; i++) {
+            QueuedCommand *q = (QueuedCommand*)items[i];
+            uint64_t t0 = stats_now();
+            if (q->queued_at) stats_record(&my_stats->sequencer_wait, t0 - q->queued_at);
+            if (q->batch_expected) run_batch(q->c, q->batch, q->batch_len, q->batch_expected);
+            else execute_command(q->c, &q->cmd);
+            if (q->cmd.op >= 0 && q->cmd.op < STATS_OPS)
+                stats_record(&my_stats->command[q->cmd.op], stats_now() - t0);
+        }
+        outbox_flush(&box);
+        stats_add(&my_stats->sequenced, (uint64_t)n);
+        stats_add(&my_stats->drains, 1);
+        for (int i = 0; i < n; i++) {
+            QueuedCommand *q = (QueuedCommand*)items[i];
+            client_put(q->c);
+            free(q);
+        }
+    }
+    return NULL;
+}
+
+/* text protocol: one command per line */
+void handle_command(char *line, Client *c) {
     if (!line) return;
     size_t L = strlen(line);
     if (L && line[L-1] == '\n') line[L-1] = '\0';
 
-    if (strncmp(line, "INS ", 4) == 0) {
-        char *p = line + 4;
-        int pos = (int)strtol(p, &p, 10);
-        while (*p == ' ') p++;
-        char *text = p;
-        if (!valid_position(g_buffer, pos)) {
-            char err[256];
-            snprintf(err, sizeof(err), "ERR invalid position %d\n", pos);
-            send(sock, err, strlen(err), 0);
-            return;
-        }
-        pthread_mutex_lock(&buf_mutex);
-        insertLine(g_buffer, pos, text);
-        pthread_mutex_unlock(&buf_mutex);
-        char msg[BUFSIZE];
-        snprintf(msg, sizeof(msg), "APPLY INS %d %s\n", pos, text);
-        broadcast(msg);
-    } else if (strncmp(line, "DEL ", 4) == 0) {
-        char *p = line + 4;
-        int pos = (int)strtol(p, NULL, 10);
-        if (!valid_position(g_buffer, pos) || pos >= g_buffer->line_count) {
-            char err[256];
-            snprintf(err, sizeof(err), "ERR invalid position %d\n", pos);
-            send(sock, err, strlen(err), 0);
-            return;
-        }
-        pthread_mutex_lock(&buf_mutex);
-        deleteLine(g_buffer, pos);
-        pthread_mutex_unlock(&buf_mutex);
-        char msg[BUFSIZE];
-        snprintf(msg, sizeof(msg), "APPLY DEL %d\n", pos);
-        broadcast(msg);
-    } else if (strncmp(line, "UPD ", 4) == 0) {
-        char *p = line + 4;
-        int pos = (int)strtol(p, &p, 10);
-        while (*p == ' ') p++;
-        char *text = p;
-        if (!valid_position(g_buffer, pos) || pos >= g_buffer->line_count) {
-            char err[256];
-            snprintf(err, sizeof(err), "ERR invalid position %d\n", pos);
-            send(sock, err, strlen(err), 0);
-            return;
-        }
-        pthread_mutex_lock(&buf_mutex);
-        updateLine(g_buffer, pos, text);
-        pthread_mutex_unlock(&buf_mutex);
-        char msg[BUFSIZE];
-        snprintf(msg, sizeof(msg), "APPLY UPD %d %s\n", pos, text);
-        broadcast(msg);
-    } else if (strcmp(line, "UNDO") == 0) {
-        pthread_mutex_lock(&buf_mutex);
-        undo(g_buffer);
-        pthread_mutex_unlock(&buf_mutex);
-        broadcast("APPLY UNDO\n");
-    } else if (strcmp(line, "REDO") == 0) {
-        pthread_mutex_lock(&buf_mutex);
-        redo(g_buffer);
-        pthread_mutex_unlock(&buf_mutex);
-        broadcast("APPLY REDO\n");
-    } else if (strcmp(line, "SNAP") == 0) {
-        pthread_mutex_lock(&buf_mutex);
-        VersionNode *v = vtree_snapshot(&g_vtree, g_buffer, g_vtree.root);
-        pthread_mutex_unlock(&buf_mutex);
-        char msg[256];
-        snprintf(msg, sizeof(msg), "SNAPSHOT v%d\n", v->id);
-        broadcast(msg);
-    } else if (strcmp(line, "GET") == 0) {
-        pthread_mutex_lock(&buf_mutex);
-        char *doc = buffer_to_string(g_buffer);
-        pthread_mutex_unlock(&buf_mutex);
-        if (!doc) doc = strdup("");
-        char reply[BUFSIZE*2];
-        snprintf(reply, sizeof(reply), "DOC %d\n%s", g_buffer->line_count, doc);
-        send(sock, reply, strlen(reply), 0);
-        free(doc);
-    } else if (strcmp(line, "PRINT") == 0) {
-        pthread_mutex_lock(&buf_mutex);
-        printBuffer(g_buffer);
-        pthread_mutex_unlock(&buf_mutex);
-    } else {
-        char err[256];
-        snprintf(err, sizeof(err), "ERR unknown command\n");
-        send(sock, err, strlen(err), 0);
-    }
-}
-
-void *client_thread(void *arg) {
-    int sock = *(int*)arg;
-    free(arg);
-    add_client(sock);
-    char buf[BUFSIZE];
-    ssize_t n;
-    while ((n = recv(sock, buf, sizeof(buf)-1, 0)) > 0) {
-        buf[n] = '\0';
-        char *saveptr = NULL;
-        char *line = strtok_r(buf, "\n", &saveptr);
-        while (line) {
-            char cmdline[BUFSIZE];
-            snprintf(cmdline, sizeof(cmdline), "%s\n", line);
-            handle_command(cmdline, sock);
-            line = strtok_r(NULL, "\n", &saveptr);
-        }
-    }
-    remove_client(sock);
-    close(sock);
+    Command cmd = { -1, 0, 0, NULL, 0, 0, 0, NULL };
+    char *p;
+    if ((strncmp(line, "INS", 3) == 0 || strncmp(line, "UPD", 3) == 0 || strncmp(line, "DEL", 3) == 0) &&
+        (line[3] == ' ' || line[3] == '@')) {
+        cmd.op = line[0] == 'I' ? OP_INS : line[0] == 'U' ? OP_UPD : OP_DEL;
+        p = line + 3;
+        if (*p == '@') {
+            cmd.has_base = 1;
+            cmd.base = strtoull(p + 1, &p, 10);
+        }
+        cmd.pos = (int)strtol(p, &p, 10);
+        if (cmd.op != OP_DEL) {
+            while (*p == ' ') p++;
+            cmd.text = p;
+        }
+    } else if ((strncmp(line, "INSC", 4) == 0 || strncmp(line, "DELC", 4) == 0) &&
+               (line[4] == ' ' || line[4] == '@')) {
+        cmd.op = line[0] == 'I' ? OP_INSC : OP_DELC;
+        p = line + 4;
+        if (*p == '@') {
+            cmd.has_base = 1;
+            cmd.base = strtoull(p + 1, &p, 10);
+        }
+        cmd.pos = (int)strtol(p, &p, 10);
+        cmd.arg = (int)strtol(p, &p, 10);
+        if (cmd.op == OP_DELC) {
+            cmd.length = (int)strtol(p, NULL, 10);
+        } else {
+            /* one space separates the column from the characters, which may themselves be spaces */
+            if (*p == ' ') p++;
+            cmd.text = p;
+        }
+    } else if (strncmp(line, "RESTORE ", 8) == 0) {
+        cmd.op = OP_RESTORE;
+        cmd.pos = (int)strtol(line + 8, NULL, 10);
+    } else if (strncmp(line, "DIFF ", 5) == 0) {
+        cmd.op = OP_DIFF;
+        cmd.pos = (int)strtol(line + 5, &p, 10);
+        cmd.arg = (int)strtol(p, NULL, 10);
+    } else if (strncmp(line, "SYNC ", 5) == 0) {
+        cmd.op = OP_SYNC;
+        cmd.base = strtoull(line + 5, NULL, 10);
+    } else if (strncmp(line, "OPEN ", 5) == 0) {
+        cmd.op = OP_OPEN;
+        cmd.text = line + 5;
+    } else if (strncmp(line, "LOAD ", 5) == 0 || strncmp(line, "SAVE ", 5) == 0) {
+        cmd.op = line[0] == 'L' ? OP_LOAD : OP_SAVE;
+        cmd.text = line + 5;
+    } else if ((strncmp(line, "FIND", 4) == 0 && (line[4] == ' ' || line[4] == '[')) ||
+               (strncmp(line, "REPLACE", 7) == 0 && (line[7] == ' ' || line[7] == '['))) {
+        /* FIND[<first>:<end>] <pattern>, REPLACE[<first>:<end>] <pattern> <text>: the
+           range is optional, either bound may be left out, and the pattern is
+           everything after one space (FIND) or one word (REPLACE) */
+        cmd.op = line[0] == 'F' ? OP_FIND : OP_REPLACE;
+        p = line + (cmd.op == OP_FIND ? 4 : 7);
+        cmd.arg = -1;
+        if (*p == '[') {
+            cmd.pos = (int)strtol(p + 1, &p, 10);
+            if (*p == ':') p++;
+            if (*p != ']') cmd.arg = (int)strtol(p, &p, 10);
+            if (*p != ']') cmd.pos = -1;
+            else p++;
+        }
+        if (*p == ' ') p++;
+        cmd.text = p;
+        if (cmd.op == OP_REPLACE) {
+            char *space = strchr(p, ' ');
+            cmd.with = space ? space + 1 : p + strlen(p);
+            if (space) *space = '\0';
+        }
+        cmd.length = (int)strlen(cmd.text);
+    } else if (strncmp(line, "BATCH ", 6) == 0) {
+        cmd.op = OP_BATCH;
+        cmd.pos = (int)strtol(line + 6, NULL, 10);
+    } else if (strcmp(line, "UNDO") == 0) cmd.op = OP_UNDO;
+    else if (strcmp(line, "REDO") == 0) cmd.op = OP_REDO;
+    else if (strcmp(line, "SNAP") == 0) cmd.op = OP_SNAP;
+    else if (strcmp(line, "LIST_VERSIONS") == 0) cmd.op = OP_LIST_VERSIONS;
+    else if (strcmp(line, "GET") == 0) cmd.op = OP_GET;
+    else if (strcmp(line, "PRINT") == 0) cmd.op = OP_PRINT;
+    else if (strcmp(line, "STATS") == 0) cmd.op = OP_STATS;
+    else if (strcmp(line, "END") == 0) cmd.op = OP_END;
+    run_command(c, &cmd);
+}
+
+/* binary protocol: one command per frame; payload is NUL-terminated in place */
+static void handle_frame(Client *c, int op, int flags, int pos, char *payload, uint32_t len) {
+    Command cmd = { op, pos, 0, payload, 0, 0, 0, NULL };
+    if (op == OP_HELLO) {
+        Message *m = msg_new("", 0);
+        if (!m) return;
+        frame_header(m->frame, OP_HELLO, PROTO_VERSION, 0);
+        client_send(c, m);
+        msg_release(m);
+        return;
+    }
+    if (flags & FRAME_F_REVISION) {
+        uint32_t hi, lo;
+        if (len < 8) {
+            reply(c, "ERR revision flag needs an 8-byte revision\n");
+            return;
+        }
+        memcpy(&hi, payload, 4);
+        memcpy(&lo, payload + 4, 4);
+        cmd.has_base = 1;
+        cmd.base = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+        payload += 8;
+        len -= 8;
+        cmd.text = payload;
+    }
+    if (op == OP_INSC || op == OP_DELC) {
+        uint32_t v[2];
+        if (len < (op == OP_INSC ? 4u : 8u)) {
+            reply(c, op == OP_INSC ? "ERR INSC needs a column\n" : "ERR DELC needs a column and a length\n");
+            return;
+        }
+        memcpy(v, payload, op == OP_INSC ? 4 : 8);
+        cmd.arg = (int)ntohl(v[0]);
+        if (op == OP_DELC) cmd.length = (int)ntohl(v[1]);
+        payload += 4;
+        len -= 4;
+        cmd.text = payload;
+    }
+    if (op == OP_FIND || op == OP_REPLACE) {
+        uint32_t v[2];
+        size_t head = op == OP_FIND ? 4 : 8;
+        if (len < head) {
+            reply(c, op == OP_FIND ? "ERR FIND needs an end line\n" : "ERR REPLACE needs an end line and a pattern length\n");
+            return;
+        }
+        memcpy(v, payload, head);
+        cmd.arg = (int)ntohl(v[0]);
+        payload += head;
+        len -= head;
+        cmd.text = payload;
+        cmd.length = (int)len;
+        if (op == OP_REPLACE) {
+            if (ntohl(v[1]) > len) {
+                reply(c, "ERR pattern length exceeds the payload\n");
+                return;
+            }
+            cmd.length = (int)ntohl(v[1]);
+            cmd.with = payload + cmd.length;
+        }
+    }
+    if ((op == OP_INS || op == OP_UPD || op == OP_OPEN || op == OP_INSC || op == OP_LOAD || op == OP_SAVE ||
+         op == OP_FIND || op == OP_REPLACE) &&
+        (memchr(payload, '\n', len) || memchr(payload, '\0', len))) {
+        reply(c, "ERR line text may not contain newline or NUL\n");
+        return;
+    }
+    if (op == OP_DIFF) {
+        uint32_t b;
+        if (len < 4) {
+            reply(c, "ERR DIFF needs a second version\n");
+            return;
+        }
+        memcpy(&b, payload, 4);
+        cmd.arg = (int)ntohl(b);
+    }
+    run_command(c, &cmd);
+}
+
+/* ---- epoll reactor ---- */
+
+/* Commands c still has in a sequencer's ring keep the struct alive (see
+   client_put); they run, but their output is dropped. */
+static void close_client(Reactor *r, Client *c) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    doc_unsubscribe(c->doc, c); /* after this no broadcaster can reach c */
+    remove_client();
+
+    pthread_mutex_lock(&c->out_lock);
+    c->closed = 1; /* ...nor a sequencer's reply */
+    outq_clear(c);
+    free(c->parked);
+    c->parked = NULL;
+    pthread_mutex_unlock(&c->out_lock);
+
+    /* the list of the reactor broadcasters queue c on, whichever runs this */
+    Reactor *fr = &reactors[c->reactor];
+    pthread_mutex_lock(&fr->flush_lock);
+    if (c->in_flush_list) {
+        Client **pc = &fr->flush_list;
+        while (*pc && *pc != c) pc = &(*pc)->flush_next;
+        if (*pc) *pc = c->flush_next;
+        c->in_flush_list = 0;
+    }
+    pthread_mutex_unlock(&fr->flush_lock);
+
+    close(c->sock);
+    batch_reset(c);
+    free(c->partial);
+    free(c->rbuf);
+    client_put(c);
+}
+
+static int client_read(Reactor *r, Client *c);
+
+/* The sequencer is done with c: run its parked OPEN, then the commands
+   read behind it and whatever arrived on the socket meanwhile */
+static void resume_client(Reactor *r, Client *c) {
+    pthread_mutex_lock(&c->out_lock);
+    QueuedCommand *q = __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) == 1 ? c->parked : NULL;
+    if (q) c->parked = NULL;
+    pthread_mutex_unlock(&c->out_lock);
+    if (!q) return;
+    run_command(c, &q->cmd);
+    free(q);
+    if (client_read(r, c) < 0) shutdown(c->sock, SHUT_RDWR);
+}
+
+/* Drain clients that were handed output by other threads, and resume
+   those whose OPEN was parked. Broken sockets are only shut down here; the
+   resulting EPOLLHUP closes them, so no event still pending in this batch
+   can refer to a freed client. */
+static void run_flush_list(Reactor *r) {
+    for (;;) {
+        pthread_mutex_lock(&r->flush_lock);
+        Client *c = r->flush_list;
+        if (c) {
+            r->flush_list = c->flush_next;
+            c->in_flush_list = 0;
+        }
+        pthread_mutex_unlock(&r->flush_lock);
+        if (!c) break;
+        if (c->parked) resume_client(r, c);
+
+        pthread_mutex_lock(&c->out_lock);
+        int resync = c->resync;
+        pthread_mutex_unlock(&c->out_lock);
+        if (resync) client_resync(c);
+
+        pthread_mutex_lock(&c->out_lock);
+        if (client_flush(c) < 0) shutdown(c->sock, SHUT_RDWR);
+        pthread_mutex_unlock(&c->out_lock);
+    }
+}
+
+/* Text clients: dispatch every complete line. Lines are NUL-terminated in
+   place inside the reactor's scratch buffer; only an unterminated tail is
+   kept per client, or, behind a parked OPEN, everything not yet handled.
+   Returns -1 on EOF/error. */
+static int client_read_lines(Reactor *r, Client *c) {
+    char *buf = r->scratch;
+    for (;;) {
+        if (c->parked) return 0; /* left in the socket until resume_client */
+        size_t have = c->partial_len, end = have;
+        if (have) memcpy(buf, c->partial, have);
+        if (!c->pending_input) {
+            ssize_t n = recv(c->sock, buf + have, sizeof(r->scratch) - have - 1, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            if (n == 0) return -1;
+            if (my_stats) stats_add(&my_stats->bytes_in, (uint64_t)n);
+            end += (size_t)n;
+        }
+        c->pending_input = 0;
+        buf[end] = '\0';
+
+        char *line = buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', end - (line - buf)))) {
+            *nl = '\0';
+            if (c->discarding) c->discarding = 0;
+            else if (nl > line) handle_command(line, c);
+            line = nl + 1;
+            if (c->parked) break;
+        }
+
+        size_t rest = end - (line - buf);
+        if (c->parked) c->pending_input = 1;
+        else if (c->discarding) rest = 0;
+        else if (rest >= BUFSIZE) {
+            reply(c, "ERR line too long\n");
+            c->discarding = 1;
+            rest = 0;
+        }
+        if (rest) {
+            char *p = (char*)realloc(c->partial, rest);
+            if (!p) return -1;
+            memmove(p, line, rest);
+            c->partial = p;
+        }
+        c->partial_len = rest;
+    }
+}
+
+/* Binary clients: frames are received straight into the client's
+   reassembly buffer and handled where they lie. The buffer grows to fit the
+   largest frame in flight and only a trailing partial frame is moved down.
+   Returns -1 on EOF/error or on a frame over FRAME_MAX_PAYLOAD. */
+static int client_read_frames(Client *c) {
+    for (;;) {
+        if (c->parked) return 0; /* left in the socket until resume_client */
+        if (c->pending_input) {
+            c->pending_input = 0;
+            goto parse;
+        }
+        /* one spare byte past the data, so the last payload can be terminated */
+        if (c->rcap - c->rlen < BUFSIZE + 1) {
+            size_t cap = c->rcap ? c->rcap * 2 : BUFSIZE * 2;
+            char *p = (char*)realloc(c->rbuf, cap);
+            if (!p) return -1;
+            c->rbuf = p;
+            c->rcap = cap;
+        }
+        ssize_t n = recv(c->sock, c->rbuf + c->rlen, c->rcap - c->rlen - 1, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            if (c->rlen == 0 && c->rcap > BUFSIZE * 8) {
+                free(c->rbuf); /* idle after a large frame: give it back */
+                c->rbuf = NULL;
+                c->rcap = 0;
+            }
+            return 0;
+        }
+        if (n == 0) return -1;
+        if (my_stats) stats_add(&my_stats->bytes_in, (uint64_t)n);
+        c->rlen += (size_t)n;
+
+    parse:;
+        size_t off = 0;
+        while (c->rlen - off >= FRAME_HEADER && !c->parked) {
+            unsigned char *h = (unsigned char*)c->rbuf + off;
+            uint32_t pos, len;
+            memcpy(&pos, h + 4, 4);
+            memcpy(&len, h + 8, 4);
+            len = ntohl(len);
+            if (len > FRAME_MAX_PAYLOAD) {
+                reply(c, "ERR frame too large\n");
+                return -1;
+            }
+            if (c->rlen - off - FRAME_HEADER < len) break;
+            /* borrow the byte after the payload for its terminator */
+            char *payload = c->rbuf + off + FRAME_HEADER;
+            char saved = payload[len];
+            payload[len] = '\0';
+            handle_frame(c, h[0], h[1], (int)ntohl(pos), payload, len);
+            payload[len] = saved;
+            off += FRAME_HEADER + len;
+        }
+        if (c->parked) c->pending_input = 1;
+        if (off) {
+            memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+            c->rlen -= off;
+        }
+    }
+}
+
+/* Drain the socket (edge-triggered). The first byte picks the protocol: a
+   binary client opens with OP_HELLO, whose opcode byte is 0. */
+static int client_read(Reactor *r, Client *c) {
+    if (c->proto == PROTO_UNKNOWN) {
+        char first;
+        ssize_t n;
+        do n = recv(c->sock, &first, 1, MSG_PEEK);
+        while (n < 0 && errno == EINTR);
+        if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        if (n == 0) return -1;
+        if (first == OP_HELLO) {
+            /* whatever is queued already goes out as text, ahead of the hello */
+            pthread_mutex_lock(&c->out_lock);
+            c->proto = PROTO_BINARY;
+            c->text_left = c->outq_len;
+            pthread_mutex_unlock(&c->out_lock);
+        } else {
+            c->proto = PROTO_TEXT;
+        }
+    }
+    return c->proto == PROTO_BINARY ? client_read_frames(c) : client_read_lines(r, c);
+}
+
+static void accept_clients(void) {
+    for (;;) {
+        struct sockaddr_in caddr;
+        socklen_t clen = sizeof(caddr);
+        int csock = accept4(listen_fd, (struct sockaddr*)&caddr, &clen, SOCK_NONBLOCK);
+        if (csock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        Client *c = (Client*)calloc(1, sizeof(Client));
+        if (!c) { close(csock); continue; }
+        c->sock = csock;
+        c->refs = 1;
+        pthread_mutex_init(&c->out_lock, NULL);
+        if (add_client() < 0) {
+            const char *full = "ERR server full\n";
+            send(csock, full, strlen(full), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(csock);
+            pthread_mutex_destroy(&c->out_lock);
+            free(c);
+            continue;
+        }
+        int one = 1;
+        setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->doc = default_doc;
+
+        /* shard connections round-robin across the reactors. The reactor
+           is fixed and registered before any broadcaster can see c, so a
+           flush is never scheduled on the wrong reactor and a failed
+           registration frees a client nobody else holds. */
+        c->reactor = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED) % n_reactors;
+        /* registered with no events until it is subscribed: a command
+           handled before that (an OPEN, say) would race the subscription */
+        struct epoll_event ev = {0};
+        ev.data.ptr = c;
+        if (epoll_ctl(reactors[c->reactor].epfd, EPOLL_CTL_ADD, csock, &ev) < 0) {
+            perror("epoll_ctl");
+            remove_client();
+            close(csock);
+            pthread_mutex_destroy(&c->out_lock);
+            free(c);
+            continue;
+        }
+        doc_subscribe(c->doc, c);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        if (epoll_ctl(reactors[c->reactor].epfd, EPOLL_CTL_MOD, csock, &ev) < 0) {
+            perror("epoll_ctl");
+            close_client(&reactors[c->reactor], c); /* its reactor never saw it */
+            continue;
+        }
+        printf("Client connected: %s:%d\n", inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
+    }
+}
+
+#define MAX_EVENTS 256
+
+static void *reactor_loop(void *arg) {
+    Reactor *r = (Reactor*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    stats_thread_start();
+    while (1) {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (!ptr) { accept_clients(); continue; }
+            if (ptr == r) {
+                uint64_t cnt;
+                ssize_t rd = read(r->wakefd, &cnt, sizeof(cnt));
+                (void)rd;
+                continue;
+            }
+            Client *c = (Client*)ptr;
+            uint32_t ev = events[i].events;
+            int dead = 0;
+            if (ev & EPOLLIN) dead = client_read(r, c) < 0;
+            if (!dead && (ev & EPOLLOUT)) {
+                pthread_mutex_lock(&c->out_lock);
+                dead = client_flush(c) < 0;
+                pthread_mutex_unlock(&c->out_lock);
+            }
+            if (dead || (ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) close_client(r, c);
+        }
+        run_flush_list(r);
+    }
     return NULL;
 }
 
-int main() {
-    g_buffer = createBuffer();
-    vtree_init(&g_vtree);
+/* ---- metrics output ---- */
+
+/* Prometheus text format: every thread's counters added up, plus gauges
+   read from the documents. Documents are never freed before shutdown, so
+   they are listed under docs_lock and then read one at a time. */
+static void format_metrics(StatsOut *out) {
+    ThreadStats *sum = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+    if (!sum) {
+        fprintf(stderr, "Memory allocation failed for ThreadStats\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&all_stats_lock);
+    for (ThreadStats *s = all_stats; s; s = s->next) {
+        for (int i = 0; i < STATS_OPS; i++) stats_merge(&sum->command[i], &s->command[i]);
+        for (int i = 0; i < LOCK_KINDS; i++) {
+            stats_merge(&sum->lock_wait[i], &s->lock_wait[i]);
+            stats_merge(&sum->lock_hold[i], &s->lock_hold[i]);
+        }
+        stats_merge(&sum->broadcast, &s->broadcast);
+        sum->recipients += stats_load(&s->recipients);
+        stats_merge(&sum->sequencer_wait, &s->sequencer_wait);
+        sum->sequenced += stats_load(&s->sequenced);
+        sum->drains += stats_load(&s->drains);
+        sum->bytes_in += stats_load(&s->bytes_in);
+        sum->bytes_out += stats_load(&s->bytes_out);
+    }
+    pthread_mutex_unlock(&all_stats_lock);
+
+    char labels[64];
+    stats_printf(out, "# HELP collabwrite_command_seconds Time to handle a command, by opcode.\n");
+    stats_printf(out, "# TYPE collabwrite_command_seconds histogram\n");
+    for (int i = 0; i < STATS_OPS; i++) {
+        uint64_t n = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) n += sum->command[i].counts[b];
+        if (!n) continue;
+        snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[i]);
+        stats_print_hist(out, "collabwrite_command_seconds", labels, &sum->command[i]);
+    }
+    stats_printf(out, "# HELP collabwrite_lock_wait_seconds Time spent waiting for a lock.\n");
+    stats_printf(out, "# TYPE collabwrite_lock_wait_seconds histogram\n");
+    for (int i = 0; i < LOCK_KINDS; i++) {
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", lock_names[i]);
+        stats_print_hist(out, "collabwrite_lock_wait_seconds", labels, &sum->lock_wait[i]);
+    }
+    stats_printf(out, "# HELP collabwrite_lock_hold_seconds Time a lock was held.\n");
+    stats_printf(out, "# TYPE collabwrite_lock_hold_seconds histogram\n");
+    for (int i = 0; i < LOCK_KINDS; i++) {
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", lock_names[i]);
+        stats_print_hist(out, "collabwrite_lock_hold_seconds", labels, &sum->lock_hold[i]);
+    }
+    stats_printf(out, "# HELP collabwrite_broadcast_seconds Time to queue a broadcast for every subscriber.\n");
+    stats_printf(out, "# TYPE collabwrite_broadcast_seconds histogram\n");
+    stats_print_hist(out, "collabwrite_broadcast_seconds", "", &sum->broadcast);
+    stats_printf(out, "# TYPE collabwrite_broadcast_recipients_total counter\n");
+    stats_printf(out, "collabwrite_broadcast_recipients_total %llu\n", (unsigned long long)sum->recipients);
+    stats_printf(out, "# HELP collabwrite_sequencer_wait_seconds Time a command waited in a sequencer's ring.\n");
+    stats_printf(out, "# TYPE collabwrite_sequencer_wait_seconds histogram\n");
+    stats_print_hist(out, "collabwrite_sequencer_wait_seconds", "", &sum->sequencer_wait);
+    stats_printf(out, "# TYPE collabwrite_sequencer_commands_total counter\n");
+    stats_printf(out, "collabwrite_sequencer_commands_total %llu\n", (unsigned long long)sum->sequenced);
+    stats_printf(out, "# HELP collabwrite_sequencer_drains_total Batches taken from the rings; commands / drains is the batch size.\n");
+    stats_printf(out, "# TYPE collabwrite_sequencer_drains_total counter\n");
+    stats_printf(out, "collabwrite_sequencer_drains_total %llu\n", (unsigned long long)sum->drains);
+    stats_printf(out, "# TYPE collabwrite_received_bytes_total counter\n");
+    stats_printf(out, "collabwrite_received_bytes_total %llu\n", (unsigned long long)sum->bytes_in);
+    stats_printf(out, "# TYPE collabwrite_sent_bytes_total counter\n");
+    stats_printf(out, "collabwrite_sent_bytes_total %llu\n", (unsigned long long)sum->bytes_out);
+    free(sum);
+
+    int n_docs = 0, cap = 16;
+    Document **docs = (Document**)malloc(sizeof(Document*) * cap);
+    if (!docs) {
+        fprintf(stderr, "Memory allocation failed for document list\n");
+        exit(1);
+    }
+    uint64_t t = timed_lock(&docs_lock, LOCK_DOCUMENTS);
+    for (int b = 0; b < DOC_BUCKETS; b++) {
+        for (Document *d = doc_table[b]; d; d = d->next) {
+            if (n_docs == cap) {
+                Document **p = (Document**)realloc(docs, sizeof(Document*) * cap * 2);
+                if (!p) {
+                    fprintf(stderr, "Memory allocation failed for document list\n");
+                    exit(1);
+                }
+                docs = p;
+                cap *= 2;
+            }
+            docs[n_docs++] = d;
+        }
+    }
+    timed_unlock(&docs_lock, LOCK_DOCUMENTS, t);
+
+    stats_printf(out, "# TYPE collabwrite_clients gauge\n");
+    stats_printf(out, "collabwrite_clients %d\n", __atomic_load_n(&client_count, __ATOMIC_RELAXED));
+    stats_printf(out, "# TYPE collabwrite_documents gauge\n");
+    stats_printf(out, "collabwrite_documents %d\n", n_docs);
+    stats_printf(out, "# TYPE collabwrite_document_lines gauge\n");
+    stats_printf(out, "# TYPE collabwrite_document_bytes gauge\n");
+    stats_printf(out, "# TYPE collabwrite_document_undo_depth gauge\n");
+    stats_printf(out, "# TYPE collabwrite_document_versions gauge\n");
+    stats_printf(out, "# TYPE collabwrite_document_versions_spilled gauge\n");
+    stats_printf(out, "# TYPE collabwrite_document_version_bytes gauge\n");
+    stats_printf(out, "# TYPE collabwrite_document_revision gauge\n");
+    for (int i = 0; i < n_docs; i++) {
+        Document *d = docs[i];
+        doc_lock(d);
+        int undo_depth = d->buffer->undoStack->count;
+        int versions = d->vtree.count;
+        int spilled = d->vtree.spilled;
+        size_t version_bytes = d->vtree.hot_bytes;
+        doc_unlock(d);
+        uint64_t rev;
+        LineNode *root = doc_read(d, &rev);
+        size_t bytes = snapshot_byte_count(root);
+        int lines = snapshot_line_count(root);
+        buffer_read_release(d->buffer, root);
+        stats_printf(out, "collabwrite_document_lines{doc=\"%s\"} %d\n", d->name, lines);
+        stats_printf(out, "collabwrite_document_bytes{doc=\"%s\"} %zu\n", d->name, bytes);
+        stats_printf(out, "collabwrite_document_undo_depth{doc=\"%s\"} %d\n", d->name, undo_depth);
+        stats_printf(out, "collabwrite_document_versions{doc=\"%s\"} %d\n", d->name, versions);
+        stats_printf(out, "collabwrite_document_versions_spilled{doc=\"%s\"} %d\n", d->name, spilled);
+        stats_printf(out, "collabwrite_document_version_bytes{doc=\"%s\"} %zu\n", d->name, version_bytes);
+        stats_printf(out, "collabwrite_document_revision{doc=\"%s\"} %llu\n", d->name, (unsigned long long)rev);
+    }
+    free(docs);
+}
+
+/* STATS: the same text as the metrics port, as "STATS <n>" and n lines */
+static void send_stats(Client *c) {
+    StatsOut out = { NULL, 0, 0 };
+    format_metrics(&out);
+    int lines = 0;
+    for (size_t i = 0; i < out.len; i++) lines += out.buf[i] == '\n';
+    char header[32];
+    int hlen = snprintf(header, sizeof(header), "STATS %d\n", lines);
+    Message *m = msg_new(NULL, hlen + out.len);
+    if (m) {
+        memcpy(m->data, header, hlen);
+        memcpy(m->data + hlen, out.buf, out.len);
+        client_send(c, m);
+        msg_release(m);
+    }
+    free(out.buf);
+}
+
+/* -m: a scraper's HTTP GET on 127.0.0.1:<port> gets the metrics. One
+   request per connection, served in turn on this thread, so a scrape
+   never runs on a reactor. */
+static void *metrics_loop(void *arg) {
+    int fd = *(int*)arg;
+    while (1) {
+        int s = accept(fd, NULL, NULL);
+        if (s < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        /* the request itself is not parsed; wait for it so the reply is not reset */
+        struct timeval tv = { 1, 0 };
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        ssize_t rd = recv(s, req, sizeof(req), 0);
+        (void)rd;
+        StatsOut out = { NULL, 0, 0 };
+        format_metrics(&out);
+        char header[160];
+        int hlen = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", out.len);
+        if (send(s, header, hlen, MSG_NOSIGNAL) == hlen) {
+            size_t off = 0;
+            while (off < out.len) {
+                ssize_t n = send(s, out.buf + off, out.len - off, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                off += (size_t)n;
+            }
+        }
+        free(out.buf);
+        close(s);
+    }
+    return NULL;
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+static void start_metrics(int port) {
+    static int fd;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1); }
+    if (listen(fd, 16) < 0) { perror("listen"); exit(1); }
+    pthread_t tid;
+    pthread_create(&tid, NULL, metrics_loop, &fd);
+    pthread_detach(tid);
+    printf("Metrics on http://127.0.0.1:%d/metrics\n", port);
+}
+
+static void pin_to_core(pthread_t tid, int index) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    pthread_setaffinity_np(tid, sizeof(set), &set);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-t reactor_threads] [-a] [-u undo_ops] [-U undo_mb] [-d dir] [-C ckpt_mb] [-m port] [-w search_threads] [-s sequencers] [-f files_dir] [-V version_mb]\n", prog);
+    fprintf(stderr, "  -t N  number of epoll reactor threads (default 1)\n");
+    fprintf(stderr, "  -a    pin each reactor thread to its own core\n");
+    fprintf(stderr, "  -u N  keep at most N undo steps (default %d, 0 = unlimited)\n", TB_DEFAULT_UNDO_OPS);
+    fprintf(stderr, "  -U N  keep at most N MB of undo history (default %d, 0 = unlimited)\n",
+            (int)(TB_DEFAULT_UNDO_BYTES >> 20));
+    fprintf(stderr, "  -d D  keep documents and versions in directory D (write-ahead log + checkpoints)\n");
+    fprintf(stderr, "  -C N  checkpoint after N MB of log (default %d, 0 = never)\n",
+            (int)(WAL_CHECKPOINT_BYTES >> 20));
+    fprintf(stderr, "  -m P  serve Prometheus metrics over HTTP on 127.0.0.1:P\n");
+    fprintf(stderr, "  -w N  threads that help FIND/REPLACE search large documents (default: cores - 1)\n");
+    fprintf(stderr, "  -s N  sequencer threads that apply edits; each document belongs to one (default 1)\n");
+    fprintf(stderr, "  -f D  let LOAD and SAVE read and write files below directory D (default: off)\n");
+    fprintf(stderr, "  -V N  keep at most N MB of each document's versions in memory, spilling the rest\n"
+                    "        to disk (in D under -d, else $TMPDIR; default 0 = unlimited)\n");
+}
+
+int main(int argc, char **argv) {
+    int pin = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:au:U:d:C:m:w:s:V:f:")) != -1) {
+        if (opt == 't') n_reactors = atoi(optarg);
+        else if (opt == 'a') pin = 1;
+        else if (opt == 'u') undo_ops = atoi(optarg);
+        else if (opt == 'U') undo_bytes = (size_t)atol(optarg) << 20;
+        else if (opt == 'd') data_dir = optarg;
+        else if (opt == 'C') checkpoint_bytes = (size_t)atol(optarg) << 20;
+        else if (opt == 'm') metrics_port = atoi(optarg);
+        else if (opt == 'w') search_workers = atoi(optarg);
+        else if (opt == 's') n_sequencers = atoi(optarg);
+        else if (opt == 'f') files_dir = optarg;
+        else if (opt == 'V') version_budget = (size_t)atol(optarg) << 20;
+        else { usage(argv[0]); return 1; }
+    }
+    if (n_reactors < 1) n_reactors = 1;
+    if (n_sequencers < 1) n_sequencers = 1;
+    if (search_workers < 0) {
+        /* the thread that runs a search takes part in it */
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        search_workers = ncpu > 1 ? (int)ncpu - 1 : 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    /* every connection is an fd; allow as many as the hard limit permits */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    search_start(search_workers);
+    sequencers = (Sequencer*)calloc(n_sequencers, sizeof(Sequencer));
+    if (!sequencers) { fprintf(stderr, "Memory allocation failed for sequencers\n"); exit(1); }
+    for (int i = 0; i < n_sequencers; i++) {
+        ring_init(&sequencers[i].ring, SEQ_RING_SIZE);
+        if (pthread_create(&sequencers[i].tid, NULL, sequencer_loop, &sequencers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    default_doc = doc_open(DEFAULT_DOC);
+    if (!default_doc) exit(1);
+    if (files_dir) {
+        files_fd = open(files_dir, O_RDONLY | O_DIRECTORY);
+        if (files_fd < 0) { perror(files_dir); exit(1); }
+        if (data_dir) {
+            /* the log directory exists by now; -f must not be inside it */
+            char files_real[PATH_MAX], data_real[PATH_MAX];
+            size_t n;
+            if (stat(data_dir, &data_dir_st) < 0 || !realpath(files_dir, files_real) ||
+                !realpath(data_dir, data_real)) { perror("-f"); exit(1); }
+            n = strlen(data_real);
+            if (strncmp(files_real, data_real, n) == 0 && (files_real[n] == '\0' || files_real[n] == '/')) {
+                fprintf(stderr, "-f %s is inside the data directory %s\n", files_dir, data_dir);
+                exit(1);
+            }
+        }
+    }
+
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server_fd < 0) { perror("socket"); exit(1); }
 
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    int one = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
@@ -187,25 +2522,46 @@ int main() {
     if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind"); exit(1);
     }
-    if (listen(server_fd, 16) < 0) { perror("listen"); exit(1); }
+    if (listen(server_fd, SOMAXCONN) < 0) { perror("listen"); exit(1); }
+    listen_fd = server_fd;
 
-    printf("Server listening on port %d\n", PORT);
+    reactors = (Reactor*)calloc(n_reactors, sizeof(Reactor));
+    if (!reactors) { fprintf(stderr, "Memory allocation failed for reactors\n"); exit(1); }
+    for (int i = 0; i < n_reactors; i++) {
+        reactors[i].index = i;
+        reactors[i].epfd = epoll_create1(0);
+        if (reactors[i].epfd < 0) { perror("epoll_create1"); exit(1); }
+        reactors[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if (reactors[i].wakefd < 0) { perror("eventfd"); exit(1); }
+        pthread_mutex_init(&reactors[i].flush_lock, NULL);
+        struct epoll_event wev = {0};
+        wev.events = EPOLLIN;
+        wev.data.ptr = &reactors[i];
+        if (epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, reactors[i].wakefd, &wev) < 0) {
+            perror("epoll_ctl"); exit(1);
+        }
+        /* every reactor watches the listener; EPOLLEXCLUSIVE wakes only one */
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+            perror("epoll_ctl"); exit(1);
+        }
+    }
 
-    while (1) {
-        struct sockaddr_in caddr;
-        socklen_t clen = sizeof(caddr);
-        int csock = accept(server_fd, (struct sockaddr*)&caddr, &clen);
-        if (csock < 0) { perror("accept"); continue; }
-        printf("Client connected: %s:%d\n", inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
-        pthread_t tid;
-        int *p = malloc(sizeof(int));
-        *p = csock;
-        pthread_create(&tid, NULL, client_thread, p);
-        pthread_detach(tid);
+    printf("Server listening on port %d (%d reactor thread%s)\n",
+           PORT, n_reactors, n_reactors == 1 ? "" : "s");
+    if (metrics_port > 0) start_metrics(metrics_port);
+
+    for (int i = 1; i < n_reactors; i++) {
+        pthread_create(&reactors[i].tid, NULL, reactor_loop, &reactors[i]);
+        if (pin) pin_to_core(reactors[i].tid, i);
     }
+    reactors[0].tid = pthread_self();
+    if (pin) pin_to_core(reactors[0].tid, 0);
+    reactor_loop(&reactors[0]);
 
-    freeBuffer(g_buffer);
-    if (g_vtree.root) vtree_free(g_vtree.root);
+    doc_close_all();
     close(server_fd);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Only the owner writes, so a load and a store replace an atomic add;
+   the stores are atomic only so that readers never see a torn value. */
+void stats_record(StatsHist *h, uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+    __atomic_store_n(&h->counts[b], h->counts[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+}
+
+void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stats_merge(StatsHist *into, const StatsHist *from) {
+    for (int b = 0; b < STATS_BUCKETS; b++) into->counts[b] += stats_load(&from->counts[b]);
+    into->sum_ns += stats_load(&from->sum_ns);
+}
+
+void stats_printf(StatsOut *out, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(out->buf ? out->buf + out->len : NULL, out->cap - out->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (out->len + (size_t)n < out->cap) {
+            out->len += (size_t)n;
+            return;
+        }
+        size_t cap = out->cap ? out->cap * 2 : 4096;
+        while (cap <= out->len + (size_t)n) cap *= 2;
+        char *p = (char*)realloc(out->buf, cap);
+        if (!p) {
+            fprintf(stderr, "Memory allocation failed for stats output\n");
+            exit(1);
+        }
+        out->buf = p;
+        out->cap = cap;
+    }
+}
+
+/* buckets from 1 us to 4 s are exported; shorter times fold into the
+   first, longer ones only into +Inf */
+#define FIRST_EXPORTED 10
+#define LAST_EXPORTED 32
+
+void stats_print_hist(StatsOut *out, const char *name, const char *labels, const StatsHist *h) {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cum = 0, total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) total += h->counts[b];
+    for (int b = 0; b <= LAST_EXPORTED; b++) {
+        cum += h->counts[b];
+        if (b < FIRST_EXPORTED) continue;
+        stats_printf(out, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                     (double)(1ull << b) / 1e9, (unsigned long long)cum);
+    }
+    stats_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)total);
+    const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+    stats_printf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close, (double)h->sum_ns / 1e9);
+    stats_printf(out, "%s_count%s%s%s %llu\n", name, open, labels, close, (unsigned long long)total);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Latency histograms and counters for server metrics. Each one is written
+   by a single owning thread, with plain stores and no locks, so recording
+   costs a clock read and a few adds; readers on other threads merge every
+   thread's copies when asked. A reader sees each value whole, but not all
+   of them from the same instant. */
+
+#define STATS_BUCKETS 40    /* bucket b counts times below 2^b ns; the last also everything longer */
+
+typedef struct {
+    uint64_t counts[STATS_BUCKETS];
+    uint64_t sum_ns;
+} StatsHist;
+
+uint64_t stats_now(void);                           /* monotonic ns */
+void stats_record(StatsHist *h, uint64_t ns);       /* owning thread only */
+void stats_add(uint64_t *counter, uint64_t n);      /* owning thread only */
+uint64_t stats_load(const uint64_t *counter);       /* any thread */
+void stats_merge(StatsHist *into, const StatsHist *from); /* into is private to the reader */
+
+/* Prometheus text exposition, built in a growable buffer */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} StatsOut;
+
+void stats_printf(StatsOut *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/* name_bucket{labels,le="<seconds>"} lines, then name_sum and name_count;
+   labels may be "" */
+void stats_print_hist(StatsOut *out, const char *name, const char *labels, const StatsHist *h);
+
+#endif
\ No newline at end of file
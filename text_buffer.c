@@ -3,201 +3,1255 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/* Helper: create a line node */
-static LineNode* createLineNode(const char *text) {
-    LineNode *newNode = (LineNode*)malloc(sizeof(LineNode));
-    if (!newNode) {
-        fprintf(stderr, "Memory allocation failed for LineNode\n");
-        exit(1);
+/* ---- reference counted line text ---- */
+
+typedef struct {
+    int refs;
+    uint32_t hash;  /* of the text, 0 until line_hash computes it; atomic */
+    uint32_t len;
+    uint32_t cap;   /* characters the block has room for */
+    ObjPool *pool;  /* size-class pool the block came from, NULL if malloc'd */
+} LineHeader;
+
+#define LINE_HEADER(s) ((LineHeader*)((char*)(s) - sizeof(LineHeader)))
+
+static const size_t text_class_size[TB_TEXT_CLASSES] = { 32, 64, 128, 256 };
+
+/* a line holding text[0, len) with room for at least cap characters */
+static char* line_alloc_cap(ObjPool *pools, const char *text, size_t len, size_t cap) {
+    size_t need = sizeof(LineHeader) + cap + 1;
+    ObjPool *pool = NULL;
+    LineHeader *h;
+    for (int i = 0; pools && i < TB_TEXT_CLASSES; i++) {
+        if (need <= text_class_size[i]) {
+            pool = &pools[i];
+            cap = text_class_size[i] - sizeof(LineHeader) - 1;
+            break;
+        }
     }
-    newNode->line = strdup(text ? text : "");
-    newNode->prev = newNode->next = NULL;
-    return newNode;
+    if (pool) {
+        h = (LineHeader*)pool_alloc(pool);
+    } else {
+        h = (LineHeader*)malloc(need);
+        if (!h) {
+            fprintf(stderr, "Memory allocation failed for line text\n");
+            exit(1);
+        }
+    }
+    h->refs = 1;
+    h->hash = 0;
+    h->len = (uint32_t)len;
+    h->cap = (uint32_t)cap;
+    h->pool = pool;
+    char *s = (char*)(h + 1);
+    memcpy(s, text, len);
+    s[len] = '\0';
+    return s;
+}
+
+static char* line_alloc_len(ObjPool *pools, const char *text, size_t len) {
+    return line_alloc_cap(pools, text, len, len);
 }
 
+static char* line_alloc(ObjPool *pools, const char *text) {
+    if (!text) text = "";
+    return line_alloc_len(pools, text, strlen(text));
+}
+
+char* line_new(const char *text) {
+    return line_alloc(NULL, text);
+}
+
+char* line_new_len(const char *text, size_t len) {
+    return line_alloc_len(NULL, text, len);
+}
+
+char* line_retain(char *line) {
+    if (line) LINE_HEADER(line)->refs++;
+    return line;
+}
+
+void line_release(char *line) {
+    if (!line) return;
+    LineHeader *h = LINE_HEADER(line);
+    if (--h->refs != 0) return;
+    if (h->pool) pool_free(h->pool, h);
+    else free(h);
+}
+
+size_t line_length(const char *line) {
+    return line ? LINE_HEADER(line)->len : 0;
+}
+
+/* FNV-1a, never 0. Lines edited in place are not shared, so the cached
+   value is only ever cleared by the one thread that can see the line; on
+   shared lines readers may race to store the same value. */
+uint32_t line_hash(const char *line) {
+    if (!line) return 0;
+    LineHeader *h = LINE_HEADER(line);
+    uint32_t hash = __atomic_load_n(&h->hash, __ATOMIC_RELAXED);
+    if (hash) return hash;
+    hash = 2166136261u;
+    for (size_t i = 0; i < h->len; i++) hash = (hash ^ (unsigned char)line[i]) * 16777619u;
+    if (!hash) hash = 1;
+    __atomic_store_n(&h->hash, hash, __ATOMIC_RELAXED);
+    return hash;
+}
+
+/* Return line, or a replacement holding the same text, that nothing else
+   references and that has room for `need` characters, so it may be
+   changed in place. Replacements get half as much again of slack, so a
+   line edited a character at a time is only reallocated O(log n) times.
+   Lock held. */
+static char* line_reserve(TextBuffer *buffer, char *line, size_t need) {
+    LineHeader *h = LINE_HEADER(line);
+    if (need < h->len) need = h->len; /* the whole text is copied before a delete shrinks it */
+    if (h->refs == 1 && h->cap >= need) return line;
+    size_t cap = need + need / 2;
+    if (h->refs == 1 && !h->pool) {
+        h = (LineHeader*)realloc(h, sizeof(LineHeader) + cap + 1);
+        if (!h) {
+            fprintf(stderr, "Memory allocation failed for line text\n");
+            exit(1);
+        }
+        h->cap = (uint32_t)cap;
+        return (char*)(h + 1);
+    }
+    char *copy = line_alloc_cap(buffer->textPools, line, h->len, cap);
+    line_release(line);
+    return copy;
+}
+
+/* replace `del` characters at `at` with ins[0, n); returns the line, which
+   may have moved (see line_reserve) */
+static char* line_splice(TextBuffer *buffer, char *line, size_t at, size_t del, const char *ins, size_t n) {
+    size_t len = line_length(line);
+    char *s = line_reserve(buffer, line, len - del + n);
+    memmove(s + at + n, s + at + del, len - at - del + 1);
+    if (n) memcpy(s + at, ins, n);
+    LineHeader *h = LINE_HEADER(s);
+    h->len = (uint32_t)(len - del + n);
+    h->hash = 0;
+    return s;
+}
+
+/* one entry of the change log, see buffer_transform */
+struct BufferChange {
+    int type;
+    int position;
+    int column;     /* character edits */
+    char *line;     /* retained: the line, or the characters inserted or deleted; NULL for a delete */
+};
+
+/* buffer->published while the root has changed since the last publish */
+static LineNode unpublished_marker;
+#define UNPUBLISHED (&unpublished_marker)
+
 TextBuffer* createBuffer() {
     TextBuffer *buffer = (TextBuffer*)malloc(sizeof(TextBuffer));
     if (!buffer) { fprintf(stderr, "Memory allocation failed for TextBuffer\n"); exit(1); }
-    buffer->head = buffer->tail = NULL;
+    buffer->root = NULL;
     buffer->line_count = 0;
     buffer->undoStack = createStack();
     buffer->redoStack = createStack();
+    buffer->openGroup = NULL;
+    pool_init(&buffer->nodePool, sizeof(LineNode));
+    pool_init(&buffer->opPool, sizeof(EditOperation));
+    for (int i = 0; i < TB_TEXT_CLASSES; i++) pool_init(&buffer->textPools[i], text_class_size[i]);
+    buffer->undoStack->opPool = &buffer->opPool;
+    buffer->redoStack->opPool = &buffer->opPool;
+    buffer->undoStack->owner = buffer;
+    buffer->redoStack->owner = buffer;
+    buffer->undoMaxOps = TB_DEFAULT_UNDO_OPS;
+    buffer->undoMaxBytes = TB_DEFAULT_UNDO_BYTES;
+    buffer->coalesceMs = TB_DEFAULT_COALESCE_MS;
+    buffer->lastRecorded = NULL;
+    buffer->editHook = NULL;
+    buffer->editHookCtx = NULL;
+    buffer->revision = 0;
+    buffer->log_floor = 0;
+    buffer->changes = (struct BufferChange*)calloc(TB_CHANGE_LOG, sizeof(struct BufferChange));
+    if (!buffer->changes) { fprintf(stderr, "Memory allocation failed for change log\n"); exit(1); }
+    buffer->published = UNPUBLISHED;
+    buffer->published_revision = 0;
+    buffer->publish_seq = 0;
+    buffer->epoch = 0;
+    buffer->readers[0] = buffer->readers[1] = 0;
+    buffer->retired = NULL;
+    buffer->retired_len = buffer->retired_cap = 0;
+    buffer->orphans = NULL;
     return buffer;
 }
 
-/* internal helpers to traverse to a node; returns pointer to node at position,
-   or NULL if position == line_count (insertion at end) or out-of-range */
-static LineNode* node_at(TextBuffer *buffer, int position) {
-    if (position < 0 || position > buffer->line_count) return NULL;
-    LineNode *cur = buffer->head;
-    int idx = 0;
-    while (cur && idx < position) {
-        cur = cur->next;
-        idx++;
+/* ---- order-statistic AVL tree helpers ---- */
+
+static int node_size(LineNode *n) { return n ? n->size : 0; }
+static int node_height(LineNode *n) { return n ? n->height : 0; }
+static size_t node_bytes(LineNode *n) { return n ? n->bytes : 0; }
+
+/* Node reference counts are atomic: lock-free readers retain and release
+   published roots concurrently with the writer (see buffer_read_acquire). */
+static void node_retain(LineNode *n) {
+    if (n) __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void tree_release(TextBuffer *buffer, LineNode *n);
+static void unpublish(TextBuffer *buffer);
+
+static void node_update(LineNode *n) {
+    int hl = node_height(n->left), hr = node_height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+    n->size = node_size(n->left) + node_size(n->right) + 1;
+    n->bytes = node_bytes(n->left) + node_bytes(n->right) + line_length(n->line) + 1;
+}
+
+/* Nodes are shared between the live tree and snapshots. A node referenced
+   more than once is immutable; before an edit changes a node on its path it
+   takes ownership here, copying the node if it is shared (path copying).
+   The copy references the same children and text, so only the O(log n)
+   nodes along the edited path are ever duplicated. */
+static LineNode* node_own(TextBuffer *buffer, LineNode *n) {
+    if (__atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1) return n;
+    LineNode *copy = (LineNode*)pool_alloc(&buffer->nodePool);
+    copy->line = n->line;
+    copy->left = n->left;
+    copy->right = n->right;
+    copy->size = n->size;
+    copy->height = n->height;
+    copy->bytes = n->bytes;
+    copy->refs = 1;
+    line_retain(copy->line);
+    node_retain(copy->left);
+    node_retain(copy->right);
+    tree_release(buffer, n); /* a reader may have let go meanwhile */
+    return copy;
+}
+
+/* rotations take ownership of the nodes they relink */
+static LineNode* rotate_right(TextBuffer *buffer, LineNode *n) {
+    n = node_own(buffer, n);
+    LineNode *l = node_own(buffer, n->left);
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static LineNode* rotate_left(TextBuffer *buffer, LineNode *n) {
+    n = node_own(buffer, n);
+    LineNode *r = node_own(buffer, n->right);
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+/* restore the AVL invariant at n (owned) after one of its subtrees changed
+   height by one */
+static LineNode* rebalance(TextBuffer *buffer, LineNode *n) {
+    node_update(n);
+    int bal = node_height(n->left) - node_height(n->right);
+    if (bal > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right))
+            n->left = rotate_left(buffer, n->left);
+        return rotate_right(buffer, n);
+    }
+    if (bal < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left))
+            n->right = rotate_right(buffer, n->right);
+        return rotate_left(buffer, n);
     }
-    return cur; /* if position == line_count, cur == NULL (end) */
+    return n;
 }
 
-/* No-record versions: used by undo/redo to avoid pushing operations onto the stacks */
-void insertLine_no_record(TextBuffer *buffer, int position, const char *text) {
-    if (position < 0 || position > buffer->line_count) return;
-    LineNode *newNode = createLineNode(text);
-    if (buffer->line_count == 0) {
-        buffer->head = buffer->tail = newNode;
-    } else if (position == 0) {
-        newNode->next = buffer->head;
-        buffer->head->prev = newNode;
-        buffer->head = newNode;
-    } else if (position == buffer->line_count) {
-        buffer->tail->next = newNode;
-        newNode->prev = buffer->tail;
-        buffer->tail = newNode;
+/* insert nn so that it becomes line `position` of the subtree rooted at n */
+static LineNode* tree_insert(TextBuffer *buffer, LineNode *n, int position, LineNode *nn) {
+    if (!n) return nn;
+    n = node_own(buffer, n);
+    int ls = node_size(n->left);
+    if (position <= ls) n->left = tree_insert(buffer, n->left, position, nn);
+    else n->right = tree_insert(buffer, n->right, position - ls - 1, nn);
+    return rebalance(buffer, n);
+}
+
+/* detach the leftmost node of the subtree into *out */
+static LineNode* tree_remove_min(TextBuffer *buffer, LineNode *n, LineNode **out) {
+    n = node_own(buffer, n);
+    if (!n->left) {
+        *out = n;
+        return n->right;
+    }
+    n->left = tree_remove_min(buffer, n->left, out);
+    return rebalance(buffer, n);
+}
+
+/* detach line `position` of the subtree into *out (owned by the caller, who
+   frees it); its children are handed back to the tree */
+static LineNode* tree_remove(TextBuffer *buffer, LineNode *n, int position, LineNode **out) {
+    n = node_own(buffer, n);
+    int ls = node_size(n->left);
+    if (position < ls) {
+        n->left = tree_remove(buffer, n->left, position, out);
+    } else if (position > ls) {
+        n->right = tree_remove(buffer, n->right, position - ls - 1, out);
     } else {
-        LineNode *cur = node_at(buffer, position);
-        LineNode *prev = cur->prev;
-        prev->next = newNode;
-        newNode->prev = prev;
-        newNode->next = cur;
-        cur->prev = newNode;
+        *out = n;
+        if (!n->left) return n->right;
+        if (!n->right) return n->left;
+        LineNode *succ;
+        LineNode *right = tree_remove_min(buffer, n->right, &succ);
+        succ->left = n->left;
+        succ->right = right;
+        n->left = n->right = NULL;
+        return rebalance(buffer, succ);
+    }
+    return rebalance(buffer, n);
+}
+
+/* drop one reference to n; nodes no longer shared with anything are freed */
+static void node_free(TextBuffer *buffer, LineNode *n) {
+    tree_release(buffer, n->left);
+    tree_release(buffer, n->right);
+    line_release(n->line);
+    pool_free(&buffer->nodePool, n);
+}
+
+static void tree_release(TextBuffer *buffer, LineNode *n) {
+    if (!n || __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    node_free(buffer, n);
+}
+
+/* internal helper to descend to a node; returns pointer to node at position,
+   or NULL if position is out-of-range */
+static LineNode* node_at(LineNode *root, int position) {
+    if (position < 0 || position >= node_size(root)) return NULL;
+    LineNode *cur = root;
+    while (cur) {
+        int ls = node_size(cur->left);
+        if (position < ls) cur = cur->left;
+        else if (position > ls) { position -= ls + 1; cur = cur->right; }
+        else break;
+    }
+    return cur;
+}
+
+/* like node_at, but takes ownership of every node on the way down so the
+   returned node may be modified */
+static LineNode* node_at_owned(TextBuffer *buffer, int position) {
+    if (position < 0 || position >= buffer->line_count) return NULL;
+    unpublish(buffer);
+    LineNode **slot = &buffer->root;
+    for (;;) {
+        LineNode *cur = *slot = node_own(buffer, *slot);
+        int ls = node_size(cur->left);
+        if (position < ls) slot = &cur->left;
+        else if (position > ls) { position -= ls + 1; slot = &cur->right; }
+        else return cur;
+    }
+}
+
+/* after the text of line `position` changed length in place: the nodes
+   above it, all taken over by node_at_owned, count delta more bytes */
+static void path_add_bytes(TextBuffer *buffer, int position, long delta) {
+    LineNode *cur = buffer->root;
+    while (cur) {
+        cur->bytes += delta;
+        int ls = node_size(cur->left);
+        if (position < ls) cur = cur->left;
+        else if (position > ls) { position -= ls + 1; cur = cur->right; }
+        else break;
+    }
+}
+
+/* in-order iteration with an explicit stack (height is bounded by TB_MAX_HEIGHT) */
+
+static void iter_push_left(LineIter *it, LineNode *n) {
+    while (n) {
+        it->stack[it->top++] = n;
+        n = n->left;
     }
+}
+
+void line_iter_init(LineIter *it, LineNode *root) {
+    it->top = 0;
+    iter_push_left(it, root);
+}
+
+LineNode* line_iter_next(LineIter *it) {
+    if (it->top == 0) return NULL;
+    LineNode *n = it->stack[--it->top];
+    iter_push_left(it, n->right);
+    return n;
+}
+
+/* the stack holds the nodes at and after `position` still to be visited:
+   every node the descent leaves to its left */
+void line_iter_init_at(LineIter *it, LineNode *root, int position) {
+    it->top = 0;
+    LineNode *n = root;
+    while (n) {
+        int ls = node_size(n->left);
+        if (position > ls) {
+            position -= ls + 1;
+            n = n->right;
+            continue;
+        }
+        it->stack[it->top++] = n;
+        if (position == ls) break;
+        n = n->left;
+    }
+}
+
+void setEditHook(TextBuffer *buffer, EditHook hook, void *ctx) {
+    buffer->editHook = hook;
+    buffer->editHookCtx = ctx;
+}
+
+static void notify_edit(TextBuffer *buffer, int type, int position, int column, char *text) {
+    struct BufferChange *c = &buffer->changes[buffer->revision++ & (TB_CHANGE_LOG - 1)];
+    line_release(c->line);
+    c->type = type;
+    c->position = position;
+    c->column = column;
+    c->line = line_retain(text);
+    if (buffer->editHook) buffer->editHook(buffer->editHookCtx, type, position, column, text);
+}
+
+/* unlink line `position` and hand its text to the caller (caller must line_release) */
+static char* detach_line(TextBuffer *buffer, int position) {
+    LineNode *cur = NULL;
+    unpublish(buffer);
+    buffer->root = tree_remove(buffer, buffer->root, position, &cur);
+    buffer->line_count--;
+    notify_edit(buffer, DELETE_OP, position, 0, NULL);
+    char *text = cur->line;
+    pool_free(&buffer->nodePool, cur);
+    return text;
+}
+
+/* link a new node holding `line` (ownership passes to the tree) at position */
+static void attach_line(TextBuffer *buffer, int position, char *line) {
+    LineNode *newNode = (LineNode*)pool_alloc(&buffer->nodePool);
+    newNode->line = line;
+    newNode->left = newNode->right = NULL;
+    newNode->size = 1;
+    newNode->height = 1;
+    newNode->bytes = line_length(line) + 1;
+    newNode->refs = 1;
+    unpublish(buffer);
+    buffer->root = tree_insert(buffer, buffer->root, position, newNode);
     buffer->line_count++;
+    notify_edit(buffer, INSERT_OP, position, 0, line);
+}
+
+/* replace the text of line `position` with `line` (ownership passes to the tree) */
+static void replace_line(TextBuffer *buffer, int position, char *line) {
+    LineNode *cur = node_at_owned(buffer, position);
+    if (!cur) { line_release(line); return; }
+    path_add_bytes(buffer, position, (long)line_length(line) - (long)line_length(cur->line));
+    line_release(cur->line);
+    cur->line = line;
+    notify_edit(buffer, UPDATE_OP, position, 0, line);
+}
+
+/* Character edits: the line is changed in place unless a snapshot, the
+   published document or the change log shares it, and the change log and
+   hook see only the characters inserted or deleted (`chars`, a line). */
+static void splice_chars(TextBuffer *buffer, int type, int position, int column, char *chars) {
+    LineNode *cur = node_at_owned(buffer, position);
+    if (!cur) return;
+    size_t n = line_length(chars), had = line_length(cur->line);
+    if (type == INSERT_CHARS_OP) cur->line = line_splice(buffer, cur->line, column, 0, chars, n);
+    else cur->line = line_splice(buffer, cur->line, column, n, NULL, 0);
+    path_add_bytes(buffer, position, (long)line_length(cur->line) - (long)had);
+    notify_edit(buffer, type, position, column, chars);
+}
+
+/* No-record versions: used by undo/redo to avoid pushing operations onto the stacks */
+void insertLine_no_record(TextBuffer *buffer, int position, const char *text) {
+    if (position < 0 || position > buffer->line_count) return;
+    attach_line(buffer, position, line_alloc(buffer->textPools, text));
 }
 
 void deleteLine_no_record(TextBuffer *buffer, int position) {
     if (position < 0 || position >= buffer->line_count) return;
-    LineNode *cur = node_at(buffer, position);
-    if (!cur) return;
-    if (cur->prev) cur->prev->next = cur->next;
-    else buffer->head = cur->next;
-    if (cur->next) cur->next->prev = cur->prev;
-    else buffer->tail = cur->prev;
-    free(cur->line);
-    free(cur);
-    buffer->line_count--;
+    line_release(detach_line(buffer, position));
 }
 
 void updateLine_no_record(TextBuffer *buffer, int position, const char *newText) {
     if (position < 0 || position >= buffer->line_count) return;
-    LineNode *cur = node_at(buffer, position);
-    if (!cur) return;
-    free(cur->line);
-    cur->line = strdup(newText);
+    replace_line(buffer, position, line_alloc(buffer->textPools, newText));
+}
+
+static int edit_chars(TextBuffer *buffer, int type, int position, int column, const char *text, size_t len,
+                      int record);
+
+int insertChars_no_record(TextBuffer *buffer, int position, int column, const char *text, size_t len) {
+    return edit_chars(buffer, INSERT_CHARS_OP, position, column, text, len, 0);
+}
+
+int deleteChars_no_record(TextBuffer *buffer, int position, int column, int length) {
+    return edit_chars(buffer, DELETE_CHARS_OP, position, column, NULL, length < 0 ? 0 : (size_t)length, 0);
+}
+
+/* ---- undo history bounds and coalescing ---- */
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t op_bytes(EditOperation *op) {
+    size_t n = sizeof(EditOperation) + line_length(op->oldText) + line_length(op->newText);
+    for (EditOperation *c = op->children; c; c = c->next) n += c->bytes;
+    return n;
+}
+
+/* drop the oldest history until the undo stack fits its budget */
+static void enforce_undo_limits(TextBuffer *buffer) {
+    OperationStack *st = buffer->undoStack;
+    while (st->count > 1 &&
+           ((buffer->undoMaxOps > 0 && st->count > buffer->undoMaxOps) ||
+            (buffer->undoMaxBytes > 0 && st->bytes > buffer->undoMaxBytes))) {
+        EditOperation *old = removeOldest(st);
+        if (old == buffer->lastRecorded) buffer->lastRecorded = NULL;
+        freeOperation(st, old);
+    }
+}
+
+void setUndoLimits(TextBuffer *buffer, int maxOps, size_t maxBytes) {
+    buffer->undoMaxOps = maxOps;
+    buffer->undoMaxBytes = maxBytes;
+    enforce_undo_limits(buffer);
+}
+
+void setUndoCoalesce(TextBuffer *buffer, int windowMs) {
+    buffer->coalesceMs = windowMs;
+}
+
+/* Fold an update of `position` into the previous op when it continues a burst
+   of small edits to the same line (typing): same line, recorded last, within
+   the coalescing window and changing the length only a little. The merged op
+   keeps the original oldText and takes the new text. */
+static int coalesce_update(TextBuffer *buffer, int position, char *text) {
+    EditOperation *top = buffer->undoStack->top;
+    if (buffer->coalesceMs <= 0 || buffer->openGroup || !top || top != buffer->lastRecorded) return 0;
+    if (top->type != UPDATE_OP || top->position != position) return 0;
+    size_t prev = line_length(top->newText), len = line_length(text);
+    size_t delta = len > prev ? len - prev : prev - len;
+    if (len > TB_COALESCE_MAX_LINE || delta > TB_COALESCE_MAX_DELTA) return 0;
+    long long now = now_ms();
+    if (now - top->stamp > buffer->coalesceMs) return 0;
+
+    OperationStack *st = buffer->undoStack;
+    st->bytes -= top->bytes;
+    line_release(top->newText);
+    top->newText = line_retain(text);
+    top->bytes = op_bytes(top);
+    top->stamp = now;
+    st->bytes += top->bytes;
+    return 1;
+}
+
+/* Typing and backspacing: fold a character edit into the previous op when
+   it continues that op's run on the same line within the coalescing
+   window, so a burst of keystrokes is one undo step. The first merge
+   copies the run, since the change log still holds it as the first edit's
+   characters; the copy has slack (see line_reserve), so later merges
+   extend it in place and a burst costs amortized O(1) per keystroke. */
+static int coalesce_chars(TextBuffer *buffer, int type, int position, int column, char *chars) {
+    EditOperation *top = buffer->undoStack->top;
+    if (buffer->coalesceMs <= 0 || buffer->openGroup || !top || top != buffer->lastRecorded) return 0;
+    if (top->type != type || top->position != position) return 0;
+    char **run = type == INSERT_CHARS_OP ? &top->newText : &top->oldText;
+    size_t have = line_length(*run), n = line_length(chars);
+    if (have + n > TB_COALESCE_MAX_RUN) return 0;
+    size_t at;
+    if (type == INSERT_CHARS_OP && (size_t)column == top->column + have) at = have;  /* typing on */
+    else if (type == DELETE_CHARS_OP && column == top->column) at = have;           /* delete key */
+    else if (type == DELETE_CHARS_OP && column + n == (size_t)top->column) at = 0;  /* backspace */
+    else return 0;
+    long long now = now_ms();
+    if (now - top->stamp > buffer->coalesceMs) return 0;
+
+    OperationStack *st = buffer->undoStack;
+    st->bytes -= top->bytes;
+    *run = line_splice(buffer, *run, at, 0, chars, n);
+    if (at == 0) top->column = column;
+    top->bytes = op_bytes(top);
+    top->stamp = now;
+    st->bytes += top->bytes;
+    return 1;
+}
+
+/* Record an applied edit: inside a group it joins the group, otherwise it is
+   pushed on the undo stack and invalidates the redo history. */
+static void push_operation(TextBuffer *buffer, EditOperation *op) {
+    if (buffer->openGroup) {
+        /* most recent first: the order the group's undo walks them */
+        op->next = buffer->openGroup->children;
+        buffer->openGroup->children = op;
+        return;
+    }
+    op->stamp = now_ms(); /* a group is stamped as a whole, at endGroup */
+    pushOperation(buffer->undoStack, op);
+    buffer->lastRecorded = op;
+    /* clear redo (ops go back to the pool, the stack is kept) */
+    clearStack(buffer->redoStack);
+    enforce_undo_limits(buffer);
 }
 
-/* Public functions that RECORD operations on undo stack and clear redo stack */
+/* Text passed in is owned by the op (callers retain what they share with
+   the tree). */
+static void record_operation(TextBuffer *buffer, int type, int position, int column, char *oldText,
+                             char *newText) {
+    EditOperation *op = (EditOperation*)pool_alloc(&buffer->opPool);
+    op->type = type;
+    op->position = position;
+    op->column = column;
+    op->oldText = oldText;
+    op->newText = newText;
+    op->oldRoot = op->newRoot = NULL;
+    op->stamp = 0;
+    op->children = NULL;
+    op->next = op->prev = NULL;
+    op->bytes = op_bytes(op);
+    push_operation(buffer, op);
+}
+
+/* Public functions that RECORD operations on undo stack and clear redo stack.
+   The line text is allocated once and shared by the tree and the op. */
 void insertLine(TextBuffer *buffer, int position, const char *text) {
     if (position < 0 || position > buffer->line_count) return;
-    /* record operation */
-    EditOperation *op = (EditOperation*)malloc(sizeof(EditOperation));
-    op->type = INSERT_OP;
-    op->position = position;
-    op->oldText = NULL;
-    op->newText = strdup(text ? text : "");
-    op->next = NULL;
-    pushOperation(buffer->undoStack, op);
-    /* clear redo */
-    freeStack(buffer->redoStack);
-    buffer->redoStack = createStack();
-    /* apply */
-    insertLine_no_record(buffer, position, text);
+    char *line = line_alloc(buffer->textPools, text);
+    record_operation(buffer, INSERT_OP, position, 0, NULL, line_retain(line));
+    attach_line(buffer, position, line);
 }
 
 void deleteLine(TextBuffer *buffer, int position) {
     if (position < 0 || position >= buffer->line_count) return;
-    LineNode *cur = node_at(buffer, position);
-    if (!cur) return;
-    /* record operation (capture old text) */
-    EditOperation *op = (EditOperation*)malloc(sizeof(EditOperation));
-    op->type = DELETE_OP;
-    op->position = position;
-    op->oldText = strdup(cur->line);
-    op->newText = NULL;
-    op->next = NULL;
-    pushOperation(buffer->undoStack, op);
-    /* clear redo */
-    freeStack(buffer->redoStack);
-    buffer->redoStack = createStack();
-    /* apply delete */
-    deleteLine_no_record(buffer, position);
+    /* the detached line text moves into the op, so the tree is only
+       descended once */
+    record_operation(buffer, DELETE_OP, position, 0, detach_line(buffer, position), NULL);
 }
 
 void updateLine(TextBuffer *buffer, int position, const char *newText) {
-    if (position < 0 || position >= buffer->line_count) return;
-    LineNode *cur = node_at(buffer, position);
+    LineNode *cur = node_at_owned(buffer, position);
     if (!cur) return;
-    /* record operation (capture old and new text) */
-    EditOperation *op = (EditOperation*)malloc(sizeof(EditOperation));
-    op->type = UPDATE_OP;
-    op->position = position;
-    op->oldText = strdup(cur->line);
-    op->newText = strdup(newText);
-    op->next = NULL;
-    pushOperation(buffer->undoStack, op);
-    /* clear redo */
-    freeStack(buffer->redoStack);
-    buffer->redoStack = createStack();
-    /* apply update */
-    updateLine_no_record(buffer, position, newText);
+    char *line = line_alloc(buffer->textPools, newText);
+    path_add_bytes(buffer, position, (long)line_length(line) - (long)line_length(cur->line));
+    if (coalesce_update(buffer, position, line)) {
+        line_release(cur->line);
+    } else {
+        /* old text moves into the op */
+        record_operation(buffer, UPDATE_OP, position, 0, cur->line, line_retain(line));
+    }
+    cur->line = line;
+    notify_edit(buffer, UPDATE_OP, position, 0, line);
+}
+
+/* One walk down the tree for all the lines: a node on the paths to several
+   of them is taken over (and copied, if shared) once, and the subtrees
+   between them are not visited. Ops and notifications go in line order. */
+static LineNode* update_lines(TextBuffer *buffer, LineNode *n, int base, const int *positions,
+                              const char *const *texts, int count) {
+    if (count == 0) return n;
+    n = node_own(buffer, n);
+    int at = base + node_size(n->left);
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (positions[mid] < at) lo = mid + 1;
+        else hi = mid;
+    }
+    n->left = update_lines(buffer, n->left, base, positions, texts, lo);
+    if (lo < count && positions[lo] == at) {
+        char *line = line_alloc(buffer->textPools, texts[lo]);
+        record_operation(buffer, UPDATE_OP, at, 0, n->line, line_retain(line));
+        n->line = line;
+        notify_edit(buffer, UPDATE_OP, at, 0, line);
+        lo++;
+    }
+    n->right = update_lines(buffer, n->right, at + 1, positions + lo, texts + lo, count - lo);
+    node_update(n);
+    return n;
+}
+
+void updateLines(TextBuffer *buffer, const int *positions, const char *const *texts, int count) {
+    for (int i = 0; i < count; i++)
+        if (positions[i] < 0 || positions[i] >= buffer->line_count || (i && positions[i] <= positions[i - 1]))
+            return;
+    if (count == 0) return;
+    unpublish(buffer);
+    buffer->root = update_lines(buffer, buffer->root, 0, positions, texts, count);
+}
+
+/* The characters inserted or deleted become a line of their own, shared by
+   the undo op and the change log; the edited line is not copied. */
+static int edit_chars(TextBuffer *buffer, int type, int position, int column, const char *text, size_t len,
+                      int record) {
+    LineNode *n = node_at(buffer->root, position);
+    if (!n || column < 0 || (size_t)column > line_length(n->line) || len == 0) return -1;
+    if (type == DELETE_CHARS_OP) {
+        if (len > line_length(n->line) - column) return -1;
+        text = n->line + column;
+    }
+    char *chars = line_alloc_len(buffer->textPools, text, len);
+    if (record && !coalesce_chars(buffer, type, position, column, chars)) {
+        if (type == INSERT_CHARS_OP) record_operation(buffer, type, position, column, NULL, line_retain(chars));
+        else record_operation(buffer, type, position, column, line_retain(chars), NULL);
+    }
+    splice_chars(buffer, type, position, column, chars);
+    line_release(chars);
+    return 0;
+}
+
+int insertChars(TextBuffer *buffer, int position, int column, const char *text, size_t len) {
+    return edit_chars(buffer, INSERT_CHARS_OP, position, column, text, len, 1);
+}
+
+int deleteChars(TextBuffer *buffer, int position, int column, int length) {
+    return edit_chars(buffer, DELETE_CHARS_OP, position, column, NULL, length < 0 ? 0 : (size_t)length, 1);
+}
+
+/* Grouped editing: every edit recorded between beginGroup and endGroup is
+   undone/redone as one BATCH_OP. Groups do not nest. */
+void beginGroup(TextBuffer *buffer) {
+    if (buffer->openGroup) return;
+    EditOperation *group = (EditOperation*)pool_alloc(&buffer->opPool);
+    memset(group, 0, sizeof(EditOperation));
+    group->type = BATCH_OP;
+    group->position = -1;
+    buffer->openGroup = group;
+}
+
+void endGroup(TextBuffer *buffer) {
+    EditOperation *group = buffer->openGroup;
+    if (!group) return;
+    buffer->openGroup = NULL;
+    if (!group->children) {
+        freeOperation(buffer->undoStack, group);
+        return;
+    }
+    group->bytes = op_bytes(group);
+    group->stamp = now_ms();
+    pushOperation(buffer->undoStack, group);
+    buffer->lastRecorded = group;
+    clearStack(buffer->redoStack);
+    enforce_undo_limits(buffer);
 }
 
 /* Print buffer lines with numbers */
 void printBuffer(TextBuffer *buffer) {
-    LineNode *curr = buffer->head;
+    snapshot_print(buffer->root);
+}
+
+char* buffer_to_string(TextBuffer *buffer) {
+    return snapshot_to_string(buffer->root);
+}
+
+void snapshot_print(LineNode *root) {
+    LineIter it;
+    line_iter_init(&it, root);
+    LineNode *curr;
     int lineNum = 0;
-    while (curr) {
+    while ((curr = line_iter_next(&it))) {
         printf("%d: %s\n", lineNum, curr->line);
-        curr = curr->next;
         lineNum++;
     }
 }
 
-/* Return full document as a single dynamically allocated string (caller must free) */
-char* buffer_to_string(TextBuffer *buffer) {
-    /* estimate required size */
-    size_t total = 0;
-    LineNode *cur = buffer->head;
-    while (cur) {
-        total += strlen(cur->line) + 1; /* +1 for newline */
-        cur = cur->next;
-    }
-    char *s = (char*)malloc(total + 1);
+/* Return full document as a single dynamically allocated string (caller must free).
+   One pass over the tree: the root already knows the size of the result. */
+char* snapshot_to_string(LineNode *root) {
+    char *s = (char*)malloc(snapshot_byte_count(root) + 1);
     if (!s) return NULL;
-    s[0] = '\0';
-    cur = buffer->head;
-    while (cur) {
-        strcat(s, cur->line);
-        strcat(s, "\n");
-        cur = cur->next;
+    char *out = s;
+    LineIter it;
+    LineNode *cur;
+    line_iter_init(&it, root);
+    while ((cur = line_iter_next(&it))) {
+        size_t len = line_length(cur->line);
+        memcpy(out, cur->line, len);
+        out += len;
+        *out++ = '\n';
     }
+    *out = '\0';
     return s;
 }
 
+/* line i of a bulk build, as a new reference */
+typedef char* (*LineSource)(TextBuffer *buffer, void *ctx, int i);
+
+/* build a perfectly balanced subtree over lines [lo, hi) */
+static LineNode* tree_build(TextBuffer *buffer, LineSource line, void *ctx, int lo, int hi) {
+    if (lo >= hi) return NULL;
+    int mid = lo + (hi - lo) / 2;
+    LineNode *n = (LineNode*)pool_alloc(&buffer->nodePool);
+    n->line = line(buffer, ctx, mid);
+    n->refs = 1;
+    n->left = tree_build(buffer, line, ctx, lo, mid);
+    n->right = tree_build(buffer, line, ctx, mid + 1, hi);
+    node_update(n);
+    return n;
+}
+
+static char* array_line(TextBuffer *buffer, void *ctx, int i) {
+    (void)buffer;
+    return line_retain(((char**)ctx)[i]);
+}
+
+static void discard_history(TextBuffer *buffer) {
+    freeOperation(buffer->undoStack, buffer->openGroup);
+    buffer->openGroup = NULL;
+    buffer->lastRecorded = NULL;
+    clearStack(buffer->undoStack);
+    clearStack(buffer->redoStack);
+}
+
+void buffer_replace_lines(TextBuffer *buffer, char **lines, int count) {
+    unpublish(buffer);
+    tree_release(buffer, buffer->root);
+    buffer->root = tree_build(buffer, array_line, lines, 0, count);
+    buffer->line_count = count;
+    buffer->log_floor = ++buffer->revision;
+    discard_history(buffer);
+}
+
+LineNode* snapshot_splice(TextBuffer *buffer, LineNode *root, int position, int remove,
+                          char **lines, int count) {
+    if (!root && remove == 0) return tree_build(buffer, array_line, lines, 0, count);
+    for (int i = 0; i < remove; i++) {
+        LineNode *cur = NULL;
+        root = tree_remove(buffer, root, position, &cur);
+        line_release(cur->line);
+        pool_free(&buffer->nodePool, cur);
+    }
+    for (int i = 0; i < count; i++) {
+        LineNode *n = (LineNode*)pool_alloc(&buffer->nodePool);
+        n->line = line_retain(lines[i]);
+        n->left = n->right = NULL;
+        n->size = 1;
+        n->height = 1;
+        n->bytes = line_length(n->line) + 1;
+        n->refs = 1;
+        root = tree_insert(buffer, root, position + i, n);
+    }
+    return root;
+}
+
+/* ---- bulk import ---- */
+
+/* Record where every line of data[0, len) ends: the offset of its '\n', or
+   len for a last line without one. Returns the count, or -1 if data holds
+   a NUL. With SSE2 both bytes are looked for 16 at a time and the line ends
+   in each block are read off its match mask, so short lines cost no more
+   per byte than long ones. */
+static long split_lines(const char *data, size_t len, size_t **ends_out) {
+    size_t cap = 1024, n = 0, i = 0;
+    size_t *ends = (size_t*)malloc(sizeof(size_t) * cap);
+    if (!ends) { fprintf(stderr, "Memory allocation failed for line ends\n"); exit(1); }
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) { free(ends); return -1; }
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (n + 16 > cap) {
+            cap *= 2;
+            size_t *p = (size_t*)realloc(ends, sizeof(size_t) * cap);
+            if (!p) { fprintf(stderr, "Memory allocation failed for line ends\n"); exit(1); }
+            ends = p;
+        }
+        while (mask) {
+            ends[n++] = i + (size_t)__builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i <= len; i++) {
+        if (i < len && data[i] == '\0') { free(ends); return -1; }
+        if (i < len ? data[i] != '\n' : (len == 0 || data[len - 1] == '\n')) continue;
+        if (n == cap) {
+            cap *= 2;
+            size_t *p = (size_t*)realloc(ends, sizeof(size_t) * cap);
+            if (!p) { fprintf(stderr, "Memory allocation failed for line ends\n"); exit(1); }
+            ends = p;
+        }
+        ends[n++] = i;
+    }
+    *ends_out = ends;
+    return (long)n;
+}
+
+typedef struct {
+    const char *data;
+    const size_t *ends;
+} Spans;
+
+static char* span_line(TextBuffer *buffer, void *ctx, int i) {
+    Spans *sp = (Spans*)ctx;
+    size_t start = i ? sp->ends[i - 1] + 1 : 0;
+    return line_alloc_len(buffer->textPools, sp->data + start, sp->ends[i] - start);
+}
+
+/* make root (whose reference passes to the buffer) the whole document, as
+   one revision that nothing is transformed across */
+static void swap_document(TextBuffer *buffer, LineNode *root) {
+    unpublish(buffer);
+    tree_release(buffer, buffer->root);
+    buffer->root = root;
+    buffer->line_count = node_size(root);
+    notify_edit(buffer, REPLACE_OP, buffer->line_count, 0, NULL);
+    buffer->log_floor = buffer->revision;
+}
+
+/* The undo step holds both documents; as trees are persistent, undoing
+   and redoing the load just swap roots. */
+static int load_text(TextBuffer *buffer, const char *data, size_t len, int record) {
+    if (len >= UINT32_MAX) return -1; /* LineHeader lengths */
+    size_t *ends;
+    long n = split_lines(data, len, &ends);
+    if (n < 0) return -1;
+    if (n > INT_MAX / 2) {
+        free(ends);
+        return -1;
+    }
+    Spans sp = { data, ends };
+    LineNode *root = tree_build(buffer, span_line, &sp, 0, (int)n);
+    free(ends);
+    if (record) {
+        EditOperation *op = (EditOperation*)pool_alloc(&buffer->opPool);
+        memset(op, 0, sizeof(EditOperation));
+        op->type = REPLACE_OP;
+        op->position = -1;
+        /* the op keeps whichever document is not current: holding the new
+           one as well would make every edit after the load copy its path */
+        op->oldRoot = snapshot_retain(buffer->root);
+        op->newRoot = NULL;
+        /* both documents, though either may be shared with snapshots */
+        op->bytes = sizeof(EditOperation) + snapshot_byte_count(buffer->root) + len;
+        push_operation(buffer, op);
+    }
+    swap_document(buffer, root);
+    return (int)n;
+}
+
+int buffer_load(TextBuffer *buffer, const char *data, size_t len) {
+    return load_text(buffer, data, len, 1);
+}
+
+int buffer_load_no_record(TextBuffer *buffer, const char *data, size_t len) {
+    return load_text(buffer, data, len, 0);
+}
+
+/* ---- persistent snapshots ---- */
+
+LineNode* buffer_snapshot(TextBuffer *buffer) {
+    node_retain(buffer->root);
+    return buffer->root;
+}
+
+LineNode* snapshot_retain(LineNode *root) {
+    node_retain(root);
+    return root;
+}
+
+void buffer_release_snapshot(TextBuffer *buffer, LineNode *root) {
+    tree_release(buffer, root);
+}
+
+void buffer_restore_snapshot(TextBuffer *buffer, LineNode *root) {
+    unpublish(buffer);
+    node_retain(root);
+    tree_release(buffer, buffer->root);
+    buffer->root = root;
+    buffer->line_count = node_size(root);
+    buffer->log_floor = ++buffer->revision;
+    discard_history(buffer);
+}
+
+/* whether the change log still holds every change after revision base */
+static int log_covers(TextBuffer *buffer, uint64_t base) {
+    return base <= buffer->revision && base >= buffer->log_floor &&
+           buffer->revision - base <= TB_CHANGE_LOG;
+}
+
+int buffer_transform(TextBuffer *buffer, uint64_t base, int type, int *position) {
+    if (!log_covers(buffer, base)) return -1;
+    int pos = *position;
+    for (uint64_t r = base; r < buffer->revision; r++) {
+        struct BufferChange *c = &buffer->changes[r & (TB_CHANGE_LOG - 1)];
+        if (c->type == INSERT_OP) {
+            /* an insert at the same line lands after the one already made */
+            if (pos >= c->position) pos++;
+        } else if (c->type == DELETE_OP) {
+            if (pos > c->position) pos--;
+            else if (pos == c->position && type != INSERT_OP) return 1;
+        }
+    }
+    *position = pos;
+    return 0;
+}
+
+/* where column col of a line ends up after the character edit c; a
+   column at an insert goes after it only if `after` */
+static int shift_column(int col, struct BufferChange *c, int after) {
+    int n = (int)line_length(c->line);
+    if (c->type == INSERT_CHARS_OP) return col > c->column || (col == c->column && after) ? col + n : col;
+    if (col >= c->column + n) return col - n;
+    return col > c->column ? c->column : col;
+}
+
+int buffer_transform_range(TextBuffer *buffer, uint64_t base, int *position, int *column, int *length) {
+    if (!log_covers(buffer, base)) return -1;
+    int pos = *position, start = *column, end = *column + *length;
+    for (uint64_t r = base; r < buffer->revision; r++) {
+        struct BufferChange *c = &buffer->changes[r & (TB_CHANGE_LOG - 1)];
+        if (c->type == INSERT_OP) {
+            if (pos >= c->position) pos++;
+        } else if (c->type == DELETE_OP) {
+            if (pos > c->position) pos--;
+            else if (pos == c->position) return 1;
+        } else if (c->position == pos) {
+            if (c->type == UPDATE_OP) return 1;
+            /* text inserted at either end of a range is left alone */
+            int empty = start == end;
+            start = shift_column(start, c, 1);
+            end = empty ? start : shift_column(end, c, 0);
+            if (!empty && start == end) return 1; /* deleted already */
+        }
+    }
+    *position = pos;
+    *column = start;
+    *length = end - start;
+    return 0;
+}
+
+int buffer_changes_since(TextBuffer *buffer, uint64_t since, EditHook fn, void *ctx) {
+    if (!log_covers(buffer, since)) return -1;
+    for (uint64_t r = since; r < buffer->revision; r++) {
+        struct BufferChange *c = &buffer->changes[r & (TB_CHANGE_LOG - 1)];
+        fn(ctx, c->type, c->position, c->column, c->line);
+    }
+    return (int)(buffer->revision - since);
+}
+
+int snapshot_line_count(LineNode *root) {
+    return node_size(root);
+}
+
+size_t snapshot_byte_count(LineNode *root) {
+    return node_bytes(root);
+}
+
+char* snapshot_line_at(LineNode *root, int position) {
+    LineNode *n = node_at(root, position);
+    return n ? n->line : NULL;
+}
+
+/* ---- lock-free readers ---- */
+
+struct RetiredRoot {
+    LineNode *root;
+    unsigned int epoch;     /* when it was withdrawn */
+};
+
+struct Orphan {
+    LineNode *root;
+    struct Orphan *next;
+};
+
+/* Free what no reader can reach any more. Called by the writer. Readers
+   only ever count themselves into the current epoch's parity, so once the
+   other parity is empty every reader from before the current epoch is
+   gone, and the epoch may advance. A root withdrawn in epoch e is
+   therefore unreachable from epoch e + 2 on. */
+static void reclaim(TextBuffer *buffer) {
+    if (!buffer->retired_len && !__atomic_load_n(&buffer->orphans, __ATOMIC_RELAXED)) return;
+    unsigned int e = __atomic_load_n(&buffer->epoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&buffer->readers[(e + 1) & 1], __ATOMIC_SEQ_CST) == 0) {
+        e++;
+        __atomic_store_n(&buffer->epoch, e, __ATOMIC_SEQ_CST);
+    }
+    int done = 0;
+    while (done < buffer->retired_len && buffer->retired[done].epoch + 2 <= e)
+        tree_release(buffer, buffer->retired[done++].root);
+    if (done) {
+        buffer->retired_len -= done;
+        memmove(buffer->retired, buffer->retired + done, sizeof(struct RetiredRoot) * buffer->retired_len);
+    }
+    struct Orphan *o = __atomic_exchange_n(&buffer->orphans, NULL, __ATOMIC_ACQUIRE);
+    while (o) {
+        struct Orphan *next = o->next;
+        node_free(buffer, o->root);
+        free(o);
+        o = next;
+    }
+}
+
+/* the root is about to change: withdraw the published one */
+static void unpublish(TextBuffer *buffer) {
+    LineNode *old = buffer->published;
+    if (old == UNPUBLISHED) {
+        reclaim(buffer); /* roots withdrawn earlier may be due */
+        return;
+    }
+    __atomic_add_fetch(&buffer->publish_seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&buffer->published, UNPUBLISHED, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&buffer->publish_seq, 1, __ATOMIC_SEQ_CST);
+    if (old) {
+        if (buffer->retired_len == buffer->retired_cap) {
+            int cap = buffer->retired_cap ? buffer->retired_cap * 2 : 16;
+            struct RetiredRoot *r = (struct RetiredRoot*)realloc(buffer->retired,
+                                                                 sizeof(struct RetiredRoot) * cap);
+            if (!r) {
+                fprintf(stderr, "Memory allocation failed for retired roots\n");
+                exit(1);
+            }
+            buffer->retired = r;
+            buffer->retired_cap = cap;
+        }
+        buffer->retired[buffer->retired_len].root = old;
+        buffer->retired[buffer->retired_len].epoch = __atomic_load_n(&buffer->epoch, __ATOMIC_SEQ_CST);
+        buffer->retired_len++;
+    }
+    reclaim(buffer);
+}
+
+void buffer_publish(TextBuffer *buffer) {
+    if (buffer->published == UNPUBLISHED) {
+        node_retain(buffer->root); /* held by publication: the next edit copies its path */
+        __atomic_add_fetch(&buffer->publish_seq, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&buffer->published_revision, buffer->revision, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&buffer->published, buffer->root, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&buffer->publish_seq, 1, __ATOMIC_SEQ_CST);
+    }
+    reclaim(buffer);
+}
+
+/* The root and its revision are read as a pair: publish_seq is odd while
+   the writer changes them, and a reader that sees it move tries again. */
+int buffer_read_acquire(TextBuffer *buffer, LineNode **root, uint64_t *revision) {
+    for (;;) {
+        unsigned int e = __atomic_load_n(&buffer->epoch, __ATOMIC_SEQ_CST);
+        int *pin = &buffer->readers[e & 1];
+        __atomic_add_fetch(pin, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&buffer->epoch, __ATOMIC_SEQ_CST) != e) {
+            __atomic_sub_fetch(pin, 1, __ATOMIC_SEQ_CST); /* raced an advance: pin again */
+            continue;
+        }
+        unsigned int seq = __atomic_load_n(&buffer->publish_seq, __ATOMIC_SEQ_CST);
+        LineNode *r = __atomic_load_n(&buffer->published, __ATOMIC_SEQ_CST);
+        uint64_t rev = __atomic_load_n(&buffer->published_revision, __ATOMIC_SEQ_CST);
+        if ((seq & 1) || __atomic_load_n(&buffer->publish_seq, __ATOMIC_SEQ_CST) != seq) {
+            __atomic_sub_fetch(pin, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (r != UNPUBLISHED) node_retain(r);
+        __atomic_sub_fetch(pin, 1, __ATOMIC_SEQ_CST);
+        if (r == UNPUBLISHED) return -1;
+        *root = r;
+        *revision = rev;
+        return 0;
+    }
+}
+
+void buffer_read_release(TextBuffer *buffer, LineNode *root) {
+    if (!root || __atomic_sub_fetch(&root->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    /* last one out: the writer frees it, since the pools are not thread-safe */
+    struct Orphan *o = (struct Orphan*)malloc(sizeof(struct Orphan));
+    if (!o) {
+        fprintf(stderr, "Memory allocation failed for Orphan\n");
+        exit(1);
+    }
+    o->root = root;
+    o->next = __atomic_load_n(&buffer->orphans, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffer->orphans, &o->next, o, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
 int valid_position(TextBuffer *buffer, int position) {
     return (position >= 0 && position <= buffer->line_count);
 }
 
 /* Undo / Redo implementations that use no-record internal functions */
 
-void undo(TextBuffer *buffer) {
-    if (isStackEmpty(buffer->undoStack)) {
-        printf("Nothing to undo.\n");
-        return;
+static EditOperation* reverse_ops(EditOperation *op) {
+    EditOperation *prev = NULL;
+    while (op) {
+        EditOperation *next = op->next;
+        op->next = prev;
+        prev = op;
+        op = next;
     }
-    EditOperation *op = popOperation(buffer->undoStack);
-    if (!op) return;
+    return prev;
+}
 
+static void apply_undo(TextBuffer *buffer, EditOperation *op) {
     if (op->type == INSERT_OP) {
         /* undo insert => delete the inserted line */
         deleteLine_no_record(buffer, op->position);
     } else if (op->type == DELETE_OP) {
-        /* undo delete => insert oldText back */
-        insertLine_no_record(buffer, op->position, op->oldText);
+        /* undo delete => insert oldText back (shared, not copied) */
+        attach_line(buffer, op->position, line_retain(op->oldText));
     } else if (op->type == UPDATE_OP) {
         /* undo update => restore oldText */
-        updateLine_no_record(buffer, op->position, op->oldText);
+        replace_line(buffer, op->position, line_retain(op->oldText));
+    } else if (op->type == REPLACE_OP) {
+        /* every later op is undone, so the document is the one the op made */
+        op->newRoot = snapshot_retain(buffer->root);
+        swap_document(buffer, op->oldRoot);
+        op->oldRoot = NULL;
+    } else if (op->type == INSERT_CHARS_OP) {
+        splice_chars(buffer, DELETE_CHARS_OP, op->position, op->column, op->newText);
+    } else if (op->type == DELETE_CHARS_OP) {
+        splice_chars(buffer, INSERT_CHARS_OP, op->position, op->column, op->oldText);
+    } else if (op->type == BATCH_OP) {
+        /* children are most recent first; leave them oldest first for redo */
+        for (EditOperation *c = op->children; c; c = c->next) apply_undo(buffer, c);
+        op->children = reverse_ops(op->children);
+    }
+}
+
+static void apply_redo(TextBuffer *buffer, EditOperation *op) {
+    if (op->type == INSERT_OP) {
+        attach_line(buffer, op->position, line_retain(op->newText));
+    } else if (op->type == DELETE_OP) {
+        deleteLine_no_record(buffer, op->position);
+    } else if (op->type == UPDATE_OP) {
+        replace_line(buffer, op->position, line_retain(op->newText));
+    } else if (op->type == REPLACE_OP) {
+        op->oldRoot = snapshot_retain(buffer->root);
+        swap_document(buffer, op->newRoot);
+        op->newRoot = NULL;
+    } else if (op->type == INSERT_CHARS_OP || op->type == DELETE_CHARS_OP) {
+        splice_chars(buffer, op->type, op->position, op->column,
+                     op->type == INSERT_CHARS_OP ? op->newText : op->oldText);
+    } else if (op->type == BATCH_OP) {
+        for (EditOperation *c = op->children; c; c = c->next) apply_redo(buffer, c);
+        op->children = reverse_ops(op->children);
     }
+}
 
+void undo(TextBuffer *buffer) {
+    if (isStackEmpty(buffer->undoStack)) {
+        printf("Nothing to undo.\n");
+        return;
+    }
+    EditOperation *op = popOperation(buffer->undoStack);
+    if (!op) return;
+    apply_undo(buffer, op);
+    buffer->lastRecorded = NULL;
     /* push op onto redo stack (same op object) */
     pushOperation(buffer->redoStack, op);
 }
@@ -209,29 +1263,28 @@ void redo(TextBuffer *buffer) {
     }
     EditOperation *op = popOperation(buffer->redoStack);
     if (!op) return;
-
-    if (op->type == INSERT_OP) {
-        insertLine_no_record(buffer, op->position, op->newText);
-    } else if (op->type == DELETE_OP) {
-        deleteLine_no_record(buffer, op->position);
-    } else if (op->type == UPDATE_OP) {
-        updateLine_no_record(buffer, op->position, op->newText);
-    }
-
+    apply_redo(buffer, op);
+    buffer->lastRecorded = NULL;
     pushOperation(buffer->undoStack, op);
 }
 
 void freeBuffer(TextBuffer *buffer) {
     if (!buffer) return;
-    LineNode *curr = buffer->head;
-    while (curr) {
-        LineNode *temp = curr;
-        curr = curr->next;
-        free(temp->line);
-        free(temp);
-    }
+    /* no readers may remain, so everything retired can go */
+    for (int i = 0; i < buffer->retired_len; i++) tree_release(buffer, buffer->retired[i].root);
+    buffer->retired_len = 0;
+    free(buffer->retired);
+    if (buffer->published != UNPUBLISHED) tree_release(buffer, buffer->published);
+    reclaim(buffer);
+    tree_release(buffer, buffer->root);
+    freeOperation(buffer->undoStack, buffer->openGroup);
     /* free stacks */
     freeStack(buffer->undoStack);
     freeStack(buffer->redoStack);
+    pool_destroy(&buffer->nodePool);
+    pool_destroy(&buffer->opPool);
+    for (int i = 0; i < TB_CHANGE_LOG; i++) line_release(buffer->changes[i].line);
+    free(buffer->changes);
+    for (int i = 0; i < TB_TEXT_CLASSES; i++) pool_destroy(&buffer->textPools[i]);
     free(buffer);
 }
\ No newline at end of file
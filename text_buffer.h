@@ -4,24 +4,108 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include "pool.h"
 
+/* Lines are kept in an AVL tree ordered by position (an order-statistic
+   tree): each node stores the size of its subtree, so lookup, insert and
+   delete by line number are O(log n), and the bytes of its text, so the
+   size of a document or snapshot is known without walking it. The tree is persistent: nodes are
+   reference counted and shared with snapshots, and an edit copies only the
+   shared nodes on the path it touches (see buffer_snapshot). */
 typedef struct LineNode {
     char *line;
-    struct LineNode *prev;
-    struct LineNode *next;
+    struct LineNode *left;
+    struct LineNode *right;
+    size_t bytes; /* text of this subtree, a newline per line included */
+    int size;   /* number of lines in this subtree */
+    int height; /* AVL height, leaf == 1 */
+    int refs;   /* parents and snapshots holding the node; immutable while > 1; atomic */
 } LineNode;
 
-typedef struct OperationStack OperationStack; /* forward declaration */
+/* upper bound on tree height; an AVL tree of 2^31 lines is < 46 high */
+#define TB_MAX_HEIGHT 64
 
+/* in-order iteration over a tree or snapshot */
 typedef struct {
-    LineNode *head;
-    LineNode *tail;
+    LineNode *stack[TB_MAX_HEIGHT];
+    int top;
+} LineIter;
+
+typedef struct OperationStack OperationStack; /* forward declaration */
+
+/* line text of up to 32/64/128/256 bytes (header included) comes from
+   per-buffer size-class pools; longer lines are malloc'd */
+#define TB_TEXT_CLASSES 4
+
+/* undo history defaults; see setUndoLimits / setUndoCoalesce */
+#define TB_DEFAULT_UNDO_OPS 10000
+#define TB_DEFAULT_UNDO_BYTES ((size_t)64 << 20)
+#define TB_DEFAULT_COALESCE_MS 1000
+#define TB_COALESCE_MAX_LINE 1024   /* only lines up to this long are merged */
+#define TB_COALESCE_MAX_DELTA 16    /* ...and only when the length changes this little */
+#define TB_COALESCE_MAX_RUN 1024    /* typed or deleted characters merge into runs up to this long */
+
+/* changes remembered for buffer_transform and buffer_changes_since; a power of two */
+#define TB_CHANGE_LOG 4096
+
+/* Called after every change to the line tree, with the EditOperation type
+   (INSERT_OP/DELETE_OP/UPDATE_OP), the line number and the new text (NULL
+   for a delete); for INSERT_CHARS_OP/DELETE_CHARS_OP, the column and the
+   characters inserted or deleted; for REPLACE_OP, the new line count
+   (the document is the buffer's root). Fires for recorded edits and for
+   undo/redo alike, under the buffer's lock; used to journal edits (see
+   wal.h). Texts are lines (see line_length). */
+typedef void (*EditHook)(void *ctx, int type, int position, int column, const char *text);
+
+typedef struct TextBuffer {
+    LineNode *root;
     int line_count;
 
     OperationStack *undoStack;
     OperationStack *redoStack;
+    struct EditOperation *openGroup; /* group being recorded, see beginGroup */
+    struct EditOperation *lastRecorded; /* top op if nothing was undone since; may be coalesced into */
+    int undoMaxOps;                  /* 0 = unlimited */
+    size_t undoMaxBytes;             /* 0 = unlimited */
+    int coalesceMs;                  /* 0 disables merging of UPD bursts */
+
+    /* per-buffer allocators, used under the buffer's lock */
+    ObjPool nodePool;                     /* LineNode */
+    ObjPool opPool;                       /* EditOperation */
+    ObjPool textPools[TB_TEXT_CLASSES];   /* line text by size class */
+
+    EditHook editHook;                    /* NULL when nobody listens */
+    void *editHookCtx;
+
+    /* revisions, see buffer_transform */
+    uint64_t revision;                    /* changes made so far */
+    uint64_t log_floor;                   /* no transform across revisions before this */
+    struct BufferChange *changes;         /* ring of the last TB_CHANGE_LOG changes */
+
+    /* lock-free readers, see buffer_read_acquire */
+    LineNode *published;                  /* root, or a marker if edited since buffer_publish; atomic */
+    uint64_t published_revision;          /* revision of the published root; atomic */
+    unsigned int publish_seq;             /* odd while the two above change; atomic */
+    unsigned int epoch;                   /* atomic */
+    int readers[2];                       /* readers inside acquire, by epoch parity; atomic */
+    struct RetiredRoot *retired;          /* replaced roots waiting out their grace period */
+    int retired_len;
+    int retired_cap;
+    struct Orphan *orphans;               /* roots a reader let go of last; atomic push */
 } TextBuffer;
 
+/* Line text is immutable and reference counted, so it is shared by the
+   tree, snapshots and the undo history without copying. A small header sits just before the characters, so
+   a line is still an ordinary NUL-terminated char*. Reference counts are
+   not atomic: retain/release only while holding the buffer's lock. */
+char* line_new(const char *text);       /* refcount 1, malloc'd */
+char* line_new_len(const char *text, size_t len); /* text need not be NUL-terminated */
+char* line_retain(char *line);
+void line_release(char *line);
+size_t line_length(const char *line);  /* O(1) */
+uint32_t line_hash(const char *line);  /* O(1) after the first call on a line */
+
 /* creation & destruction */
 TextBuffer* createBuffer();
 void freeBuffer(TextBuffer *buffer);
@@ -30,16 +114,117 @@ void freeBuffer(TextBuffer *buffer);
 void insertLine(TextBuffer *buffer, int position, const char *text);
 void deleteLine(TextBuffer *buffer, int position);
 void updateLine(TextBuffer *buffer, int position, const char *newText);
+/* updateLine for many lines at once (positions ascending), in a single
+   walk of the tree rather than one per line; nothing changes if a position
+   is out of range or out of order. Each line is its own undo op: wrap the
+   call in a group to undo them together. */
+void updateLines(TextBuffer *buffer, const int *positions, const char *const *texts, int count);
+
+/* Character edits within line `position`, recorded like the above. Undo
+   keeps only the characters, and a line that nothing else shares (no
+   snapshot or reader holds it) is changed in place with room to grow, so
+   typing costs the same in a short line and a long one. Return -1,
+   changing nothing, if the line or the range does not exist or is empty. */
+int insertChars(TextBuffer *buffer, int position, int column, const char *text, size_t len);
+int deleteChars(TextBuffer *buffer, int position, int column, int length);
+
+/* group the edits made until endGroup into one undo/redo step */
+void beginGroup(TextBuffer *buffer);
+void endGroup(TextBuffer *buffer);
+
+/* Bound the undo history by op count and by bytes (0 = unlimited); the
+   oldest ops are evicted first. Consecutive small updates of one line within
+   windowMs of each other are merged into a single undo step. */
+void setUndoLimits(TextBuffer *buffer, int maxOps, size_t maxBytes);
+void setUndoCoalesce(TextBuffer *buffer, int windowMs);
+void setEditHook(TextBuffer *buffer, EditHook hook, void *ctx);
 
 /* internal editing helpers that DO NOT record operations (used by undo/redo) */
 void insertLine_no_record(TextBuffer *buffer, int position, const char *text);
 void deleteLine_no_record(TextBuffer *buffer, int position);
 void updateLine_no_record(TextBuffer *buffer, int position, const char *newText);
+int insertChars_no_record(TextBuffer *buffer, int position, int column, const char *text, size_t len);
+int deleteChars_no_record(TextBuffer *buffer, int position, int column, int length);
 
 /* utility */
 void printBuffer(TextBuffer *buffer);
 char* buffer_to_string(TextBuffer *buffer); /* caller must free */
+void snapshot_print(LineNode *root);
+char* snapshot_to_string(LineNode *root);   /* caller must free */
+/* replace the whole document with `lines` (retained, not copied), building a
+   balanced tree in O(n); undo/redo history is discarded */
+void buffer_replace_lines(TextBuffer *buffer, char **lines, int count);
+/* Bulk import: replace the document with the lines of data[0, len), each
+   ended by '\n' (a last line may lack it), in one pass and O(n). The
+   replacement is a single undo step, which keeps the previous document
+   as a snapshot. Returns the line count, or -1 (changing nothing) if data
+   holds a NUL byte or too many lines. */
+int buffer_load(TextBuffer *buffer, const char *data, size_t len);
+int buffer_load_no_record(TextBuffer *buffer, const char *data, size_t len);
 int valid_position(TextBuffer *buffer, int position);
+void line_iter_init(LineIter *it, LineNode *root);
+void line_iter_init_at(LineIter *it, LineNode *root, int position); /* starting at line position */
+LineNode* line_iter_next(LineIter *it); /* NULL when done */
+
+/* Snapshots: O(1) regardless of document size. A snapshot is a retained
+   root; because shared nodes are never modified, it keeps its content while
+   the buffer is edited, and it can be read without the buffer lock.
+   Taking, releasing and restoring must hold the lock, and a snapshot must
+   be released before its buffer is freed. */
+LineNode* buffer_snapshot(TextBuffer *buffer);
+LineNode* snapshot_retain(LineNode *root); /* another reference to a snapshot */
+void buffer_release_snapshot(TextBuffer *buffer, LineNode *root);
+/* make a snapshot the document again; undo/redo history is discarded */
+void buffer_restore_snapshot(TextBuffer *buffer, LineNode *root);
+int snapshot_line_count(LineNode *root);
+size_t snapshot_byte_count(LineNode *root); /* O(1): the text with a newline per line */
+char* snapshot_line_at(LineNode *root, int position); /* NULL if out of range */
+/* root with `remove` lines at position replaced by lines[0, count)
+   (retained, not copied). Takes over the caller's reference to root and
+   returns one to the result; shared nodes are copied, so other holders of
+   root see no change. O((remove + count) log n), or O(count) into an empty
+   root. Lock held. */
+LineNode* snapshot_splice(TextBuffer *buffer, LineNode *root, int position, int remove,
+                          char **lines, int count);
+
+/* Lock-free reads. Readers on any thread take a reference to the current
+   document with buffer_read_acquire, without the buffer lock, and drop it
+   with buffer_read_release. The document is published lazily: every edit
+   withdraws the published root, and the first reader after an edit gets -1
+   and must publish under the lock (buffer_publish, then buffer_snapshot).
+   So while nothing changes reads never touch the lock, and edits with no
+   reader in between never copy nodes for publication. Withdrawn roots are
+   reclaimed by the writer: epochs make sure no reader is still between
+   loading the published root and counting itself in, and a document whose
+   last reader leaves is handed back to the writer to free. */
+void buffer_publish(TextBuffer *buffer);     /* lock held */
+/* 0 with the root and the revision it shows, or -1 if unpublished */
+int buffer_read_acquire(TextBuffer *buffer, LineNode **root, uint64_t *revision);
+void buffer_read_release(TextBuffer *buffer, LineNode *root);
+
+/* Revisions. Every change to the line tree (edits and undo/redo alike)
+   gets the next revision number, and the last TB_CHANGE_LOG changes are
+   remembered with their position and text. An edit a client made against an older
+   revision is moved onto the current document with buffer_transform: lines
+   inserted before it push it down, lines deleted before it pull it up.
+   Restoring or replacing the whole document is one revision that nothing
+   can be transformed across. Lock held. */
+int buffer_transform(TextBuffer *buffer, uint64_t base, int type, int *position);
+/* returns 0 with *position moved, 1 if the line the edit targets was
+   deleted since, -1 if base is ahead of the buffer or no longer covered */
+
+/* The same for a character edit of line *position: the columns
+   [*column, *column + *length) are moved past character edits of that
+   line since base (for an insert, *length is 0). Text inserted at either
+   end of a range stays out of it. Returns 1 if the line was deleted or
+   replaced (UPD) since, or a range was deleted already. Lock held. */
+int buffer_transform_range(TextBuffer *buffer, uint64_t base, int *position, int *column, int *length);
+
+/* Replay the changes made after revision `since`, oldest first, into fn
+   (same arguments as an EditHook), e.g. to bring a client that missed
+   them up to date. Returns how many there were, or -1 (calling fn for
+   none) if the log no longer covers them. Lock held. */
+int buffer_changes_since(TextBuffer *buffer, uint64_t since, EditHook fn, void *ctx);
 
 /* undo/redo wrappers (operate using the stacks) */
 void undo(TextBuffer *buffer);
@@ -1,69 +1,822 @@
 #include "version.h"
+#include "editoperation.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 void vtree_init(VersionTree *vt) {
     vt->root = NULL;
+    vt->last_root = NULL;
     vt->next_id = 1;
+    vt->current = NULL;
+    vt->current_revision = 0;
+    vt->index = NULL;
+    vt->index_cap = 0;
+    vt->count = 0;
+    vt->budget = 0;
+    vt->hot_bytes = 0;
+    vt->spilled = 0;
+    vt->lru_head = NULL;
+    vt->lru_tail = NULL;
+    vt->spill_dir = NULL;
+    vt->spill_fd = -1;
+    vt->spill_end = 0;
 }
 
+void vtree_set_budget(VersionTree *vt, size_t bytes, const char *dir) {
+    vt->budget = bytes;
+    vt->spill_dir = dir;
+}
+
+static unsigned int id_slot(int id, int cap) {
+    return ((unsigned int)id * 2654435761u) & (unsigned int)(cap - 1);
+}
+
+static void index_put(VersionNode **index, int cap, VersionNode *n) {
+    unsigned int i = id_slot(n->id, cap);
+    while (index[i]) i = (i + 1) & (unsigned int)(cap - 1);
+    index[i] = n;
+}
+
+static void index_add(VersionTree *vt, VersionNode *n) {
+    if ((vt->count + 1) * 2 > vt->index_cap) {
+        int cap = vt->index_cap ? vt->index_cap * 2 : 64;
+        VersionNode **index = (VersionNode**)calloc(cap, sizeof(VersionNode*));
+        if (!index) {
+            fprintf(stderr, "Memory allocation failed for version index\n");
+            exit(1);
+        }
+        for (int i = 0; i < vt->index_cap; i++)
+            if (vt->index[i]) index_put(index, cap, vt->index[i]);
+        free(vt->index);
+        vt->index = index;
+        vt->index_cap = cap;
+    }
+    index_put(vt->index, vt->index_cap, n);
+    vt->count++;
+}
+
+/* ---- changes since the current version ---- */
+
+/* The new version as runs of lines: `len` lines of the current version
+   from `pos` on, or `len` new or changed lines if pos is -1 */
+typedef struct {
+    int pos;
+    int len;
+} Run;
+
+typedef struct {
+    Run *runs;
+    int count;
+    int cap;
+    int failed;         /* a whole-document change; no delta */
+} RunList;
+
+static void runs_insert(RunList *rl, int i, int pos, int len) {
+    if (rl->count == rl->cap) {
+        rl->cap *= 2;
+        rl->runs = (Run*)realloc(rl->runs, sizeof(Run) * rl->cap);
+        if (!rl->runs) {
+            fprintf(stderr, "Memory allocation failed for version runs\n");
+            exit(1);
+        }
+    }
+    memmove(rl->runs + i + 1, rl->runs + i, sizeof(Run) * (rl->count - i));
+    rl->runs[i].pos = pos;
+    rl->runs[i].len = len;
+    rl->count++;
+}
+
+/* the index of the run that starts at line position, splitting one if needed */
+static int runs_split(RunList *rl, int position) {
+    int i = 0;
+    while (i < rl->count && position >= rl->runs[i].len) position -= rl->runs[i++].len;
+    if (i == rl->count || position == 0) return i;
+    Run *r = &rl->runs[i];
+    runs_insert(rl, i + 1, r->pos < 0 ? -1 : r->pos + position, r->len - position);
+    rl->runs[i].len = position;
+    return i + 1;
+}
+
+/* an EditHook replaying the change log onto the runs */
+static void runs_apply(void *ctx, int type, int position, int column, const char *text) {
+    RunList *rl = (RunList*)ctx;
+    (void)column;
+    (void)text;
+    if (rl->failed) return;
+    if (type == REPLACE_OP) {
+        rl->failed = 1;
+        return;
+    }
+    int i = runs_split(rl, position);
+    if (type == INSERT_OP) {
+        if (i > 0 && rl->runs[i - 1].pos < 0) rl->runs[i - 1].len++;
+        else runs_insert(rl, i, -1, 1);
+        return;
+    }
+    if (i == rl->count) return;
+    if (rl->runs[i].pos >= 0 && rl->runs[i].len > 1) runs_split(rl, position + 1);
+    if (type == DELETE_OP) {
+        if (--rl->runs[i].len == 0) {
+            memmove(rl->runs + i, rl->runs + i + 1, sizeof(Run) * (rl->count - i - 1));
+            rl->count--;
+        }
+    } else {
+        rl->runs[i].pos = -1; /* UPD and character edits */
+    }
+}
+
+static void hunk_add(DiffHunk **hunks, int *count, int *cap, DiffHunk h) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 4;
+        *hunks = (DiffHunk*)realloc(*hunks, sizeof(DiffHunk) * *cap);
+        if (!*hunks) {
+            fprintf(stderr, "Memory allocation failed for version hunks\n");
+            exit(1);
+        }
+    }
+    (*hunks)[(*count)++] = h;
+}
+
+/* The hunks that turn the current version (base_count lines) into the
+   buffer, from the changes logged since the current version was taken:
+   O(changes) rather than a walk or diff of the document. -1 if the log no
+   longer covers them. */
+static int changed_hunks(VersionTree *vt, TextBuffer *tb, int base_count, DiffHunk **out) {
+    RunList rl;
+    rl.cap = 16;
+    rl.count = 0;
+    rl.failed = 0;
+    rl.runs = (Run*)malloc(sizeof(Run) * rl.cap);
+    if (!rl.runs) {
+        fprintf(stderr, "Memory allocation failed for version runs\n");
+        exit(1);
+    }
+    if (base_count > 0) runs_insert(&rl, 0, 0, base_count);
+    if (buffer_changes_since(tb, vt->current_revision, runs_apply, &rl) < 0) rl.failed = 1;
+    int count = 0, cap = 0, open = 0, a = 0, b = 0;
+    DiffHunk *hunks = NULL, h;
+    for (int i = 0; i < rl.count && !rl.failed; i++) {
+        Run *r = &rl.runs[i];
+        if (r->pos != a || r->pos < 0) {
+            if (!open) {
+                h.a_pos = a;
+                h.a_len = 0;
+                h.b_pos = b;
+                h.b_len = 0;
+                open = 1;
+            }
+            if (r->pos < 0) {
+                h.b_len += r->len;
+                b += r->len;
+                continue;
+            }
+            h.a_len += r->pos - a; /* lines of the base deleted before this run */
+        }
+        if (open) hunk_add(&hunks, &count, &cap, h);
+        open = 0;
+        a = r->pos + r->len;
+        b += r->len;
+    }
+    if (!rl.failed && a < base_count) {
+        if (!open) {
+            h.a_pos = a;
+            h.a_len = 0;
+            h.b_pos = b;
+            h.b_len = 0;
+            open = 1;
+        }
+        h.a_len += base_count - a;
+    }
+    if (!rl.failed && open) hunk_add(&hunks, &count, &cap, h);
+    free(rl.runs);
+    if (rl.failed) {
+        free(hunks);
+        return -1;
+    }
+    *out = hunks;
+    return count;
+}
+
+/* ---- memory budget ---- */
+
+static void lru_unlink(VersionTree *vt, VersionNode *n) {
+    if (n->lru_prev) n->lru_prev->lru_next = n->lru_next;
+    else vt->lru_head = n->lru_next;
+    if (n->lru_next) n->lru_next->lru_prev = n->lru_prev;
+    else vt->lru_tail = n->lru_prev;
+    n->lru_prev = n->lru_next = NULL;
+}
+
+static void lru_push(VersionTree *vt, VersionNode *n) {
+    n->lru_prev = NULL;
+    n->lru_next = vt->lru_head;
+    if (vt->lru_head) vt->lru_head->lru_prev = n;
+    else vt->lru_tail = n;
+    vt->lru_head = n;
+}
+
+/* What a version is charged: the lines its hunks add and their tree
+   nodes. The rest it shares with its base. */
+static size_t delta_bytes(VersionNode *n) {
+    size_t bytes = sizeof(DiffHunk) * n->hunk_count;
+    for (int h = 0; h < n->hunk_count; h++) {
+        LineIter it;
+        line_iter_init_at(&it, n->root, n->hunks[h].b_pos);
+        for (int i = 0; i < n->hunks[h].b_len; i++)
+            bytes += line_length(line_iter_next(&it)->line) + 1 + sizeof(LineNode);
+    }
+    return bytes;
+}
+
+/* The spill file is unlinked as soon as it is created: it only extends
+   memory, and recovery never reads it (the log and checkpoints hold every
+   version). */
+static int spill_open(VersionTree *vt) {
+    if (vt->spill_fd != -1) return vt->spill_fd;
+    const char *dir = vt->spill_dir ? vt->spill_dir : getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/versions.spill.XXXXXX", dir ? dir : "/tmp");
+    vt->spill_fd = mkstemp(path);
+    if (vt->spill_fd < 0) {
+        perror("version spill");
+        vt->spill_fd = -2;
+    } else {
+        unlink(path);
+    }
+    return vt->spill_fd;
+}
+
+typedef struct {
+    int fd;
+    int64_t off;
+    size_t len;
+    int failed;
+    char buf[1 << 16];
+} SpillWriter;
+
+static void spill_flush(SpillWriter *w) {
+    size_t done = 0;
+    while (done < w->len && !w->failed) {
+        ssize_t k = pwrite(w->fd, w->buf + done, w->len - done, w->off);
+        if (k <= 0) w->failed = 1;
+        else {
+            done += (size_t)k;
+            w->off += k;
+        }
+    }
+    w->len = 0;
+}
+
+static void spill_put(SpillWriter *w, const void *p, size_t n) {
+    while (n > 0) {
+        if (w->len == sizeof(w->buf)) spill_flush(w);
+        size_t k = sizeof(w->buf) - w->len;
+        if (k > n) k = n;
+        memcpy(w->buf + w->len, p, k);
+        w->len += k;
+        p = (const char*)p + k;
+        n -= k;
+    }
+}
+
+/* Append the version's hunks against its base as u32 count, then per hunk
+   i32 a_pos, i32 a_len, u32 b_len and b_len lines of u32 length and
+   bytes (the layout of a checkpoint's versions). A version is written
+   once: its content never changes, so a later eviction reuses the
+   record. */
+static int spill_write(VersionTree *vt, VersionNode *n) {
+    if (spill_open(vt) < 0) return -1;
+    SpillWriter *w = (SpillWriter*)malloc(sizeof(SpillWriter));
+    if (!w) {
+        fprintf(stderr, "Memory allocation failed for version spill\n");
+        exit(1);
+    }
+    w->fd = vt->spill_fd;
+    w->off = vt->spill_end;
+    w->len = 0;
+    w->failed = 0;
+    uint32_t count = (uint32_t)n->hunk_count;
+    spill_put(w, &count, 4);
+    for (int h = 0; h < n->hunk_count; h++) {
+        DiffHunk *hk = &n->hunks[h];
+        int32_t a_pos = hk->a_pos, a_len = hk->a_len;
+        uint32_t b_len = (uint32_t)hk->b_len;
+        spill_put(w, &a_pos, 4);
+        spill_put(w, &a_len, 4);
+        spill_put(w, &b_len, 4);
+        LineIter it;
+        line_iter_init_at(&it, n->root, hk->b_pos);
+        for (int i = 0; i < hk->b_len; i++) {
+            const char *line = line_iter_next(&it)->line;
+            uint32_t len = (uint32_t)line_length(line);
+            spill_put(w, &len, 4);
+            spill_put(w, line, len);
+        }
+    }
+    spill_flush(w);
+    int rc = w->failed ? -1 : 0;
+    if (rc == 0) {
+        n->spill_off = vt->spill_end;
+        n->spill_len = (size_t)(w->off - vt->spill_end);
+        vt->spill_end = w->off;
+        free(n->hunks);
+        n->hunks = NULL;
+    } else {
+        perror("version spill");
+    }
+    free(w);
+    return rc;
+}
+
+static int evict(VersionTree *vt, TextBuffer *tb, VersionNode *n) {
+    if (n->spill_off < 0 && spill_write(vt, n) < 0) return -1;
+    if (!n->first) n->first = line_retain(snapshot_line_at(n->root, 0));
+    buffer_release_snapshot(tb, n->root);
+    n->root = NULL;
+    n->hot = 0;
+    lru_unlink(vt, n);
+    vt->hot_bytes -= n->bytes;
+    vt->spilled++;
+    return 0;
+}
+
+/* evict least recently used versions, never keep itself, until the rest fit */
+static void enforce_budget(VersionTree *vt, TextBuffer *tb, VersionNode *keep) {
+    while (vt->budget && vt->hot_bytes > vt->budget && vt->lru_tail && vt->lru_tail != keep)
+        if (evict(vt, tb, vt->lru_tail) < 0) break;
+}
+
+static uint32_t read_u32(const char **p) {
+    uint32_t v;
+    memcpy(&v, *p, 4);
+    *p += 4;
+    return v;
+}
+
+/* one spilled version to bring back: its record, then the record read */
+typedef struct {
+    VersionNode *n;
+    int64_t off;
+    size_t len;
+    DiffHunk *hunks;    /* b_pos indexes lines */
+    int hunk_count;
+    char **lines;
+    int line_count;
+} LoadEntry;
+
+struct VersionLoad {
+    int fd;
+    LoadEntry *entries; /* bases before the versions built on them */
+    int count;
+    int read;           /* entries read so far; the rest stay spilled */
+};
+
+static int plan_has(VersionLoad *l, int upto, VersionNode *n) {
+    for (int k = 0; k < upto; k++)
+        if (l->entries[k].n == n) return 1;
+    return 0;
+}
+
+VersionLoad* vtree_load_plan(VersionTree *vt, VersionNode *a, VersionNode *b) {
+    int count = 0;
+    for (VersionNode *x = a; x && !x->hot; x = x->base) count++;
+    for (VersionNode *x = b; x && !x->hot; x = x->base) count++;
+    if (count == 0) return NULL;
+    VersionLoad *l = (VersionLoad*)malloc(sizeof(VersionLoad));
+    LoadEntry *e = (LoadEntry*)calloc(count, sizeof(LoadEntry));
+    if (!l || !e) {
+        fprintf(stderr, "Memory allocation failed for version load\n");
+        exit(1);
+    }
+    l->fd = vt->spill_fd;
+    l->entries = e;
+    l->count = 0;
+    l->read = 0;
+    for (int v = 0; v < 2; v++) {
+        /* each chain goes in base first; b's stops where it joins a's */
+        int from = l->count, len = 0;
+        for (VersionNode *x = v ? b : a; x && !x->hot && !plan_has(l, from, x); x = x->base) len++;
+        int k = from + len;
+        for (VersionNode *x = v ? b : a; k > from; x = x->base) {
+            LoadEntry *le = &e[--k];
+            le->n = x;
+            le->off = x->spill_off;
+            le->len = x->spill_len;
+        }
+        l->count = from + len;
+    }
+    return l;
+}
+
+int vtree_load_read(VersionLoad *l) {
+    if (!l) return 0;
+    int64_t page = sysconf(_SC_PAGESIZE);
+    for (int k = 0; k < l->count; k++) {
+        LoadEntry *e = &l->entries[k];
+        int64_t start = e->off & ~(page - 1);
+        size_t map_len = e->len + (size_t)(e->off - start);
+        void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, l->fd, start);
+        if (map == MAP_FAILED) {
+            /* the later entries may build on this one: leave them all */
+            perror("version spill mmap");
+            return -1;
+        }
+        madvise(map, map_len, MADV_SEQUENTIAL);
+        const char *p = (const char*)map + (e->off - start);
+        e->hunk_count = (int)read_u32(&p);
+        e->hunks = (DiffHunk*)malloc(sizeof(DiffHunk) * (e->hunk_count ? e->hunk_count : 1));
+        /* at most one line per 4 bytes of record */
+        e->lines = (char**)malloc(sizeof(char*) * (e->len / 4 + 1));
+        if (!e->hunks || !e->lines) {
+            fprintf(stderr, "Memory allocation failed for version load\n");
+            exit(1);
+        }
+        for (int h = 0; h < e->hunk_count; h++) {
+            DiffHunk *hk = &e->hunks[h];
+            hk->a_pos = (int)read_u32(&p);
+            hk->a_len = (int)read_u32(&p);
+            hk->b_len = (int)read_u32(&p);
+            hk->b_pos = e->line_count;
+            for (int i = 0; i < hk->b_len; i++) {
+                uint32_t len = read_u32(&p);
+                e->lines[e->line_count++] = line_new_len(p, len);
+                p += len;
+            }
+        }
+        munmap(map, map_len);
+        l->read = k + 1;
+    }
+    return 0;
+}
+
+static int load_root(VersionTree *vt, TextBuffer *tb, VersionNode *n);
+
+void vtree_load_finish(VersionTree *vt, TextBuffer *tb, VersionLoad *l) {
+    if (!l) return;
+    for (int k = 0; k < l->count; k++) {
+        LoadEntry *e = &l->entries[k];
+        VersionNode *n = e->n;
+        /* the base was loaded just before, or is in memory, unless it was
+           evicted again in between or could not be read */
+        if (k < l->read && !n->hot && (!n->base || load_root(vt, tb, n->base) == 0)) {
+            LineNode *root = n->base ? snapshot_retain(n->base->root) : NULL;
+            /* last hunk first, so earlier positions stay valid */
+            for (int h = e->hunk_count - 1; h >= 0; h--) {
+                DiffHunk *hk = &e->hunks[h];
+                root = snapshot_splice(tb, root, hk->a_pos, hk->a_len, e->lines + hk->b_pos, hk->b_len);
+            }
+            n->root = root;
+            n->hot = 1;
+            vt->hot_bytes += n->bytes;
+            vt->spilled--;
+            lru_push(vt, n);
+        }
+        for (int i = 0; i < e->line_count; i++) line_release(e->lines[i]);
+        free(e->lines);
+        free(e->hunks);
+    }
+    free(l->entries);
+    free(l);
+}
+
+/* bring n (and spilled bases) back now if it is not in memory; -1 if the
+   spill file could not be read. Leaves the budget to the caller. */
+static int load_root(VersionTree *vt, TextBuffer *tb, VersionNode *n) {
+    if (!n->hot) {
+        VersionLoad *l = vtree_load_plan(vt, n, NULL);
+        vtree_load_read(l);
+        vtree_load_finish(vt, tb, l);
+    }
+    return n->hot ? 0 : -1;
+}
+
+int vtree_root(VersionTree *vt, TextBuffer *tb, VersionNode *n, LineNode **root) {
+    if (load_root(vt, tb, n) < 0) return -1;
+    lru_unlink(vt, n);
+    lru_push(vt, n);
+    enforce_budget(vt, tb, n);
+    *root = n->root;
+    return 0;
+}
+
+/* ---- deltas for checkpoints ---- */
+
+struct VersionDelta {
+    LineNode *root;     /* retained while the hunks are held */
+    DiffHunk *hunks;    /* a copy, b_pos into root */
+    int hunk_count;
+    int spilled;        /* no hunks: the spill record instead */
+    int fd;
+    int64_t off;
+    size_t len;
+    int whole;          /* against an empty document: the first hunk's a_len */
+    int32_t parent_count; /* becomes the parent's line count */
+};
+
+static VersionDelta* delta_new(LineNode *root, const DiffHunk *hunks, int count, int whole, int parent_count) {
+    VersionDelta *d = (VersionDelta*)calloc(1, sizeof(VersionDelta));
+    if (d) d->hunks = (DiffHunk*)malloc(sizeof(DiffHunk) * (count ? count : 1));
+    if (!d || !d->hunks) {
+        fprintf(stderr, "Memory allocation failed for version delta\n");
+        exit(1);
+    }
+    d->root = root;
+    if (count) memcpy(d->hunks, hunks, sizeof(DiffHunk) * count);
+    d->hunk_count = count;
+    d->whole = whole;
+    d->parent_count = parent_count;
+    return d;
+}
+
+VersionDelta* vtree_delta(VersionTree *vt, VersionNode *n) {
+    int parent_count = n->parent ? n->parent->line_count : 0;
+    /* the hunks are held until the version is first spilled */
+    if (n->spill_off < 0)
+        return delta_new(snapshot_retain(n->root), n->hunks, n->hunk_count, !n->base, parent_count);
+    VersionDelta *d = delta_new(NULL, NULL, 0, !n->base, parent_count);
+    /* records are never rewritten, so they can be read without the lock */
+    d->spilled = 1;
+    d->fd = vt->spill_fd;
+    d->off = n->spill_off;
+    d->len = n->spill_len;
+    return d;
+}
+
+VersionDelta* vtree_document_delta(VersionTree *vt, TextBuffer *tb) {
+    int base_count = vt->current ? vt->current->line_count : 0;
+    DiffHunk *hunks = NULL, whole = { 0, 0, 0, tb->line_count };
+    int count = changed_hunks(vt, tb, base_count, &hunks);
+    VersionDelta *d = count >= 0 ? delta_new(buffer_snapshot(tb), hunks, count, 0, 0)
+                                 : delta_new(buffer_snapshot(tb), &whole, 1, 1, base_count);
+    free(hunks);
+    return d;
+}
+
+int vtree_delta_write(VersionDelta *d, DeltaPut put, void *ctx) {
+    if (d->spilled) {
+        char buf[65536];
+        for (size_t done = 0; done < d->len;) {
+            size_t want = d->len - done < sizeof(buf) ? d->len - done : sizeof(buf);
+            ssize_t got = pread(d->fd, buf, want, d->off + (int64_t)done);
+            if (got <= 0) {
+                perror("version spill read");
+                return -1;
+            }
+            /* count, a_pos, then the a_len of the one whole-document hunk */
+            if (d->whole && done == 0 && got >= 12) memcpy(buf + 8, &d->parent_count, 4);
+            put(ctx, buf, (size_t)got);
+            done += (size_t)got;
+        }
+        return 0;
+    }
+    uint32_t count = (uint32_t)d->hunk_count;
+    put(ctx, &count, 4);
+    for (int h = 0; h < d->hunk_count; h++) {
+        DiffHunk *hk = &d->hunks[h];
+        int32_t a_pos = hk->a_pos, a_len = d->whole ? d->parent_count : hk->a_len;
+        uint32_t b_len = (uint32_t)hk->b_len;
+        put(ctx, &a_pos, 4);
+        put(ctx, &a_len, 4);
+        put(ctx, &b_len, 4);
+        LineIter it;
+        line_iter_init_at(&it, d->root, hk->b_pos);
+        for (int i = 0; i < hk->b_len; i++) {
+            const char *line = line_iter_next(&it)->line;
+            uint32_t len = (uint32_t)line_length(line);
+            put(ctx, &len, 4);
+            put(ctx, line, len);
+        }
+    }
+    return 0;
+}
+
+void vtree_delta_free(TextBuffer *tb, VersionDelta *d) {
+    if (!d) return;
+    buffer_release_snapshot(tb, d->root);
+    free(d->hunks);
+    free(d);
+}
+
+/* ---- tree ---- */
+
 VersionNode* vtree_snapshot(VersionTree *vt, TextBuffer *tb, VersionNode *parent) {
-    VersionNode *n = (VersionNode*)malloc(sizeof(VersionNode));
+    VersionNode *n = (VersionNode*)calloc(1, sizeof(VersionNode));
+    if (!n) {
+        fprintf(stderr, "Memory allocation failed for VersionNode\n");
+        exit(1);
+    }
     n->id = vt->next_id++;
-    char *snap = buffer_to_string(tb); 
-    n->snapshot = snap ? snap : strdup("");
+    n->root = buffer_snapshot(tb);
+    n->line_count = tb->line_count;
+    n->hot = 1;
+    n->spill_off = -1;
     n->parent = parent;
-    n->first_child = NULL;
-    n->next_sibling = NULL;
+    /* hunks against the parent when the change log still covers the edits
+       since it; otherwise (a load, or too many edits) the whole document.
+       They are charged and spilled under a budget, and checkpoints write
+       them with or without one. */
+    n->hunk_count = -1;
+    if (parent == vt->current)
+        n->hunk_count = changed_hunks(vt, tb, parent ? parent->line_count : 0, &n->hunks);
+    if (n->hunk_count >= 0) {
+        n->base = parent;
+    } else {
+        n->hunks = (DiffHunk*)malloc(sizeof(DiffHunk));
+        if (!n->hunks) {
+            fprintf(stderr, "Memory allocation failed for version hunks\n");
+            exit(1);
+        }
+        n->hunks[0].a_pos = n->hunks[0].a_len = n->hunks[0].b_pos = 0;
+        n->hunks[0].b_len = n->line_count;
+        n->hunk_count = 1;
+    }
+    if (vt->budget) n->bytes = delta_bytes(n);
+    vt->current = n;
+    vt->current_revision = tb->revision;
+    index_add(vt, n);
+    vt->hot_bytes += n->bytes;
+    lru_push(vt, n);
 
-    if (!vt->root) vt->root = n;
-    else if (parent) {
+    if (parent) {
         if (!parent->first_child) parent->first_child = n;
-        else {
-            VersionNode *s = parent->first_child;
-            while (s->next_sibling) s = s->next_sibling;
-            s->next_sibling = n;
-        }
+        else parent->last_child->next_sibling = n;
+        parent->last_child = n;
     } else {
-        VersionNode *s = vt->root;
-        while (s->next_sibling) s = s->next_sibling;
-        s->next_sibling = n;
+        if (!vt->root) vt->root = n;
+        else vt->last_root->next_sibling = n;
+        vt->last_root = n;
     }
+    enforce_budget(vt, tb, n);
     return n;
 }
 
-void vtree_free(VersionNode *node) {
-    if (!node) return;
-    vtree_free(node->first_child);
-    vtree_free(node->next_sibling);
-    if (node->snapshot) free(node->snapshot);
-    free(node);
+void vtree_destroy(VersionTree *vt, TextBuffer *tb) {
+    for (int i = 0; i < vt->index_cap; i++) {
+        VersionNode *n = vt->index[i];
+        if (!n) continue;
+        if (n->hot) buffer_release_snapshot(tb, n->root);
+        line_release(n->first);
+        free(n->hunks);
+        free(n);
+    }
+    free(vt->index);
+    if (vt->spill_fd >= 0) close(vt->spill_fd);
+    size_t budget = vt->budget;
+    const char *dir = vt->spill_dir;
+    vtree_init(vt);
+    vtree_set_budget(vt, budget, dir);
 }
 
+/* Pre-order walk of node, its descendants and its later siblings. Iterative
+   (parent links lead back up), so deep histories cannot overflow the stack. */
 void print_versions(VersionNode *node, int depth) {
-    if (!node) return;
-    for (int i=0;i<depth;i++) printf("  ");
-    printf("v%d: %.40s%s\n", node->id, node->snapshot, strlen(node->snapshot) > 40 ? "..." : "");
-    print_versions(node->first_child, depth+1);
-    print_versions(node->next_sibling, depth);
+    VersionNode *top = node ? node->parent : NULL;
+    while (node) {
+        for (int i=0;i<depth;i++) printf("  ");
+        const char *first = node->hot ? snapshot_line_at(node->root, 0) : node->first;
+        size_t len = first ? line_length(first) : 0;
+        printf("v%d: %.*s%s (%d lines)\n", node->id, (int)(len > 40 ? 40 : len), first ? first : "",
+               len > 40 ? "..." : "", node->line_count);
+        if (node->first_child) {
+            node = node->first_child;
+            depth++;
+            continue;
+        }
+        while (!node->next_sibling) {
+            node = node->parent;
+            depth--;
+            if (node == top) return;
+        }
+        node = node->next_sibling;
+    }
 }
 
-VersionNode* vtree_find(VersionNode *node, int id) {
-    if (!node) return NULL;
-    if (node->id == id) return node;
-    VersionNode *r = vtree_find(node->first_child, id);
-    if (r) return r;
-    return vtree_find(node->next_sibling, id);
+VersionNode* vtree_find(VersionTree *vt, int id) {
+    if (!vt->index) return NULL;
+    unsigned int i = id_slot(id, vt->index_cap);
+    while (vt->index[i]) {
+        if (vt->index[i]->id == id) return vt->index[i];
+        i = (i + 1) & (unsigned int)(vt->index_cap - 1);
+    }
+    return NULL;
+}
+
+int vtree_checkout(VersionTree *vt, TextBuffer *tb, VersionNode *n) {
+    LineNode *root = NULL;
+    if (n && vtree_root(vt, tb, n, &root) < 0) return -1;
+    buffer_restore_snapshot(tb, root);
+    vt->current = n;
+    vt->current_revision = tb->revision;
+    return 0;
 }
 
 int vtree_restore(VersionTree *vt, TextBuffer *tb, int id) {
-    VersionNode *n = vtree_find(vt->root, id);
+    VersionNode *n = vtree_find(vt, id);
     if (!n) return -1;
-    tb_free(tb);
-    tb_init(tb);
-    if (n->snapshot && n->snapshot[0] != '\0') {
-        tb_insert(tb, 0, n->snapshot);
+    return vtree_checkout(vt, tb, n) < 0 ? -2 : 0;
+}
+
+/* ---- diff ---- */
+
+static char** flatten(LineNode *root, int *count) {
+    *count = snapshot_line_count(root);
+    char **lines = (char**)malloc(sizeof(char*) * (*count ? *count : 1));
+    if (!lines) {
+        fprintf(stderr, "Memory allocation failed for diff lines\n");
+        exit(1);
     }
-    return 0;
+    LineIter it;
+    LineNode *n;
+    int i = 0;
+    line_iter_init(&it, root);
+    while ((n = line_iter_next(&it))) lines[i++] = n->line;
+    return lines;
+}
+
+/* Lines shared between versions are the same object, so most equal lines
+   compare by pointer; otherwise the stored hash and length reject almost
+   every mismatch before the text is looked at. */
+static int same_line(const char *x, const char *y) {
+    if (x == y) return 1;
+    return line_hash(x) == line_hash(y) && line_length(x) == line_length(y) &&
+           memcmp(x, y, line_length(x)) == 0;
+}
+
+/* Give every distinct text in a and b a small integer key, so the diff
+   compares keys only. */
+static void line_keys(char **a, int n, char **b, int m, uint64_t *ka, uint64_t *kb) {
+    int cap = 16;
+    while (cap < 2 * (n + m)) cap *= 2;
+    char **slots = (char**)calloc(cap, sizeof(char*));
+    uint64_t *ids = (uint64_t*)malloc(sizeof(uint64_t) * cap);
+    if (!slots || !ids) {
+        fprintf(stderr, "Memory allocation failed for diff keys\n");
+        exit(1);
+    }
+    uint64_t next = 0;
+    for (int i = 0; i < n + m; i++) {
+        char *line = i < n ? a[i] : b[i - n];
+        unsigned int s = line_hash(line) & (unsigned int)(cap - 1);
+        while (slots[s] && !same_line(slots[s], line)) s = (s + 1) & (unsigned int)(cap - 1);
+        if (!slots[s]) {
+            slots[s] = line;
+            ids[s] = next++;
+        }
+        if (i < n) ka[i] = ids[s];
+        else kb[i - n] = ids[s];
+    }
+    free(slots);
+    free(ids);
+}
+
+void vtree_diff(LineNode *a, LineNode *b, VersionDiff *d) {
+    d->a_lines = flatten(a, &d->a_count);
+    d->b_lines = flatten(b, &d->b_count);
+    d->hunks = NULL;
+    d->hunk_count = 0;
+
+    /* skip the common head and tail before keying anything */
+    int n = d->a_count, m = d->b_count, pre = 0;
+    while (pre < n && pre < m && same_line(d->a_lines[pre], d->b_lines[pre])) pre++;
+    while (n > pre && m > pre && same_line(d->a_lines[n - 1], d->b_lines[m - 1])) { n--; m--; }
+    n -= pre;
+    m -= pre;
+    if (n == 0 && m == 0) return;
+
+    uint64_t *ka = (uint64_t*)malloc(sizeof(uint64_t) * (n ? n : 1));
+    uint64_t *kb = (uint64_t*)malloc(sizeof(uint64_t) * (m ? m : 1));
+    if (!ka || !kb) {
+        fprintf(stderr, "Memory allocation failed for diff keys\n");
+        exit(1);
+    }
+    line_keys(d->a_lines + pre, n, d->b_lines + pre, m, ka, kb);
+    int nh = diff_keys(ka, n, kb, m, VT_DIFF_MAX_EDITS, &d->hunks);
+    free(ka);
+    free(kb);
+    if (nh < 0) {
+        /* too different for a minimal diff to be cheap: one replaced range */
+        d->hunks = (DiffHunk*)malloc(sizeof(DiffHunk));
+        if (!d->hunks) {
+            fprintf(stderr, "Memory allocation failed for diff hunks\n");
+            exit(1);
+        }
+        d->hunks[0].a_pos = d->hunks[0].b_pos = 0;
+        d->hunks[0].a_len = n;
+        d->hunks[0].b_len = m;
+        nh = 1;
+    }
+    for (int h = 0; h < nh; h++) {
+        d->hunks[h].a_pos += pre;
+        d->hunks[h].b_pos += pre;
+    }
+    d->hunk_count = nh;
+}
+
+void vtree_diff_free(VersionDiff *d) {
+    free(d->a_lines);
+    free(d->b_lines);
+    free(d->hunks);
 }
\ No newline at end of file
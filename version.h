@@ -2,25 +2,129 @@
 #define VERSION_H
 
 #include "text_buffer.h"
+#include "diff.h"
 
+/* A version is a snapshot of the buffer's persistent line tree (see
+   buffer_snapshot): taking and restoring one is O(1), and versions share
+   every node and line that did not change between them. Snapshots belong
+   to the buffer they came from, so all version tree calls must hold that
+   buffer's lock.
+
+   With a memory budget (vtree_set_budget), versions not used recently are
+   evicted: a version's hunks against its base (the parent it was taken
+   after, found from the buffer's change log) are appended once to a spill
+   file, its snapshot is released, and vtree_root rebuilds it from the base
+   when the version is needed again. A version is charged only the lines
+   those hunks add, since it shares the rest with its base and the live
+   document, and the least recently used ones are evicted until the total
+   fits. Only a version the log does not lead to from its parent (the first
+   after a LOAD, or after more than TB_CHANGE_LOG edits) is charged and
+   spilled whole. */
 typedef struct VersionNode {
-    char *snapshot; 
     int id;
+    LineNode *root;         /* retained snapshot, never modified; only while hot */
+    int line_count;
+    int hot;                /* root is in memory */
+    size_t bytes;           /* charged against the budget while hot */
+    struct VersionNode *base; /* the hunks are against this version; NULL: an empty document */
+    DiffHunk *hunks;        /* b_pos into this version; until the first eviction */
+    int hunk_count;
+    char *first;            /* first line, retained once evicted, for listings */
+    int64_t spill_off;      /* record in the spill file, or -1 if never evicted */
+    size_t spill_len;
+    struct VersionNode *lru_prev; /* hot versions, most recently used first */
+    struct VersionNode *lru_next;
     struct VersionNode *parent;
     struct VersionNode *first_child;
+    struct VersionNode *last_child;
     struct VersionNode *next_sibling;
 } VersionNode;
 
 typedef struct {
     VersionNode *root;
+    VersionNode *last_root;
     int next_id;
+    VersionNode *current;   /* version last snapshotted or restored */
+    uint64_t current_revision; /* buffer revision that showed current */
+    VersionNode **index;    /* open-addressed hash of id -> version */
+    int index_cap;          /* power of two, kept at most half full */
+    int count;
+    size_t budget;          /* bytes of hot versions; 0 = unlimited, nothing is spilled */
+    size_t hot_bytes;
+    int spilled;            /* versions only in the spill file */
+    VersionNode *lru_head;
+    VersionNode *lru_tail;
+    const char *spill_dir;  /* NULL: $TMPDIR or /tmp */
+    int spill_fd;           /* opened on the first eviction; -1 before, -2 if unusable */
+    int64_t spill_end;
 } VersionTree;
 
+/* Changed hunks between two snapshots. The line arrays are the two
+   documents in order; they are not retained, so they stay valid only while
+   both snapshots are held. */
+typedef struct {
+    char **a_lines;
+    int a_count;
+    char **b_lines;
+    int b_count;
+    DiffHunk *hunks;
+    int hunk_count;
+} VersionDiff;
+
+#define VT_DIFF_MAX_EDITS 2048 /* beyond this, a diff is reported as one replaced range */
+
 void vtree_init(VersionTree *vt);
+/* Keep at most bytes of versions in memory (0 = unlimited, the default),
+   spilling the rest to an unlinked file in dir. The directory string must
+   outlive the tree. */
+void vtree_set_budget(VersionTree *vt, size_t bytes, const char *dir);
 VersionNode* vtree_snapshot(VersionTree *vt, TextBuffer *tb, VersionNode *parent);
-void vtree_free(VersionNode *node);
+void vtree_destroy(VersionTree *vt, TextBuffer *tb); /* frees every version */
 void print_versions(VersionNode *node, int depth);
-VersionNode* vtree_find(VersionNode *node, int id);
+VersionNode* vtree_find(VersionTree *vt, int id); /* O(1); NULL if there is no such version */
+/* The version's snapshot, reloaded if it was spilled, as a borrowed
+   reference in *root: retain it to keep it past the next vtree call. Marks
+   the version recently used. -1 if the spill file could not be read back. */
+int vtree_root(VersionTree *vt, TextBuffer *tb, VersionNode *n, LineNode **root);
+/* Make n (NULL: an empty document) the buffer's document and the current
+   version; -1, leaving the buffer as it was, if n could not be reloaded */
+int vtree_checkout(VersionTree *vt, TextBuffer *tb, VersionNode *n);
+/* -1: no version id, -2: it could not be reloaded */
 int vtree_restore(VersionTree *vt, TextBuffer *tb, int id);
 
+/* Reloading a spilled version reads the spill file, which need not hold
+   the buffer lock: plan with the lock (for versions a and b, either may be
+   NULL; NULL if both are in memory), read without it, then finish with it
+   again, which puts them and the spilled bases they need back in memory
+   and frees the plan. A read that fails (-1) leaves the versions it did
+   not get to spilled; finish still frees the plan. The next vtree_root
+   marks a version used and enforces the budget. vtree_root on a spilled
+   version does all three under the lock. */
+typedef struct VersionLoad VersionLoad;
+VersionLoad* vtree_load_plan(VersionTree *vt, VersionNode *a, VersionNode *b);
+int vtree_load_read(VersionLoad *l);
+void vtree_load_finish(VersionTree *vt, TextBuffer *tb, VersionLoad *l);
+
+/* A version as hunks against its parent, for checkpoints: the hunks it
+   holds, or else its spill record, in the spill record's layout (u32 hunk
+   count; per hunk i32 a_pos, i32 a_len, u32 b_len, then the new lines as a
+   u32 length and the bytes). vtree_document_delta is the buffer against
+   the current version, from the change log (O(changes)) unless it no
+   longer covers them. Take them with the lock; writing one only reads a
+   retained snapshot or the spill file, so it needs no lock (-1 if the
+   spill file could not be read). Free them with the lock. None of these
+   touch the LRU order or the budget. */
+typedef struct VersionDelta VersionDelta;
+typedef void (*DeltaPut)(void *ctx, const void *p, size_t n);
+VersionDelta* vtree_delta(VersionTree *vt, VersionNode *n);
+VersionDelta* vtree_document_delta(VersionTree *vt, TextBuffer *tb);
+int vtree_delta_write(VersionDelta *d, DeltaPut put, void *ctx);
+void vtree_delta_free(TextBuffer *tb, VersionDelta *d);
+
+/* Line diff of two snapshots (e.g. two versions' roots). Only reads the
+   immutable snapshots, so it may run without the buffer lock as long as the
+   caller holds a reference to both. Free with vtree_diff_free. */
+void vtree_diff(LineNode *a, LineNode *b, VersionDiff *d);
+void vtree_diff_free(VersionDiff *d);
+
 #endif
\ No newline at end of file
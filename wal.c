@@ -0,0 +1,665 @@
+#include "wal.h"
+#include "editoperation.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Log segment dir/wal.<seq>: a sequence of records
+       u32 body length, u32 checksum of the body,
+       body = u8 type, i32 argument (line number or version id), text;
+       character edits put i32 column (and for a delete i32 length) first;
+       a load ('L', argument = line count) holds the whole document as text.
+   A torn or corrupt record ends the segment; it was never acknowledged.
+
+   Checkpoint dir/checkpoint.<seq>: the state just before wal.<seq>
+       "CWCKPT2\0",
+       i32 next version id, i32 current version id (0 = none), u32 versions,
+       per version in id order: i32 id, i32 parent id (0 = none), u32 hunks,
+           per hunk against the parent: i32 a_pos, i32 a_len, u32 b_len, lines,
+       the document as u32 hunks against the current version (or an empty
+           document), in the same form,
+       u32 checksum of everything before it.
+   A line is a u32 length followed by its bytes. */
+
+#define REC_HEADER 8
+#define REC_INSERT 'I'
+#define REC_DELETE 'D'
+#define REC_UPDATE 'U'
+#define REC_INSERT_CHARS 'i'
+#define REC_DELETE_CHARS 'd'
+#define REC_LOAD 'L'
+#define REC_SNAPSHOT 'S'
+#define REC_RESTORE 'R'
+
+#define CKPT_MAGIC "CWCKPT2"
+#define CKPT_MAGIC_LEN 8
+#define FNV_INIT 2166136261u
+
+struct Wal {
+    char *dir;
+    TextBuffer *tb;
+    VersionTree *vt;
+    pthread_mutex_t *buf_lock;
+
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    int fd;                 /* current segment */
+    uint64_t seq;
+    char *buf;              /* appended, not yet written */
+    size_t len;
+    size_t cap;
+    char *wbuf;             /* spare, written by the flush leader */
+    size_t wcap;
+    uint64_t appended;      /* log position: bytes appended since open */
+    uint64_t durable;       /* ... of which are on disk */
+    int flushing;           /* a leader is writing outside the lock */
+
+    size_t checkpoint_bytes;
+    size_t since_checkpoint;
+    int checkpoint_wanted;
+    int stop;
+    pthread_cond_t checkpoint_cond;
+    pthread_t checkpointer;
+    int has_checkpointer;
+
+    char *scratch;          /* NUL-terminated copy of a record's text */
+    size_t scratch_cap;
+};
+
+static uint32_t fnv1a(const void *data, size_t len, uint32_t h) {
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static void file_path(Wal *w, char *out, size_t n, const char *kind, uint64_t seq) {
+    snprintf(out, n, "%s/%s.%llu", w->dir, kind, (unsigned long long)seq);
+}
+
+static void write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            perror("wal write");
+            exit(1);
+        }
+        p += k;
+        n -= (size_t)k;
+    }
+}
+
+/* make a created/renamed file's directory entry durable */
+static void sync_dir(Wal *w) {
+    int fd = open(w->dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static int open_segment(Wal *w, uint64_t seq) {
+    char path[4096];
+    file_path(w, path, sizeof(path), "wal", seq);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("wal open");
+        exit(1);
+    }
+    sync_dir(w);
+    return fd;
+}
+
+static const char* scratch_str(Wal *w, const char *p, size_t n) {
+    if (n + 1 > w->scratch_cap) {
+        size_t cap = w->scratch_cap ? w->scratch_cap : 256;
+        while (cap < n + 1) cap *= 2;
+        char *s = (char*)realloc(w->scratch, cap);
+        if (!s) {
+            fprintf(stderr, "Memory allocation failed for wal scratch\n");
+            exit(1);
+        }
+        w->scratch = s;
+        w->scratch_cap = cap;
+    }
+    memcpy(w->scratch, p, n);
+    w->scratch[n] = '\0';
+    return w->scratch;
+}
+
+/* ---- appending and group commit ---- */
+
+/* head (hlen bytes, at most 8) goes between the argument and the text */
+static void wal_append(Wal *w, int type, int arg, const int32_t *head, size_t hlen, const char *text, size_t len) {
+    uint32_t body = (uint32_t)(5 + hlen + len);
+    pthread_mutex_lock(&w->lock);
+    if (w->len + REC_HEADER + body > w->cap) {
+        size_t cap = w->cap ? w->cap : 4096;
+        while (cap < w->len + REC_HEADER + body) cap *= 2;
+        char *b = (char*)realloc(w->buf, cap);
+        if (!b) {
+            fprintf(stderr, "Memory allocation failed for wal buffer\n");
+            exit(1);
+        }
+        w->buf = b;
+        w->cap = cap;
+    }
+    char *p = w->buf + w->len;
+    int32_t a = arg;
+    p[REC_HEADER] = (char)type;
+    memcpy(p + REC_HEADER + 1, &a, 4);
+    if (hlen) memcpy(p + REC_HEADER + 5, head, hlen);
+    if (len) memcpy(p + REC_HEADER + 5 + hlen, text, len);
+    uint32_t sum = fnv1a(p + REC_HEADER, body, FNV_INIT);
+    memcpy(p, &body, 4);
+    memcpy(p + 4, &sum, 4);
+    w->len += REC_HEADER + body;
+    w->appended += REC_HEADER + body;
+    w->since_checkpoint += REC_HEADER + body;
+    if (w->checkpoint_bytes && w->since_checkpoint >= w->checkpoint_bytes && !w->checkpoint_wanted) {
+        w->checkpoint_wanted = 1;
+        pthread_cond_signal(&w->checkpoint_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void wal_edit_hook(void *ctx, int type, int position, int column, const char *text) {
+    int32_t head[2] = { column, (int32_t)line_length(text) };
+    if (type == INSERT_CHARS_OP) {
+        wal_append((Wal*)ctx, REC_INSERT_CHARS, position, head, 4, text, line_length(text));
+    } else if (type == DELETE_CHARS_OP) {
+        wal_append((Wal*)ctx, REC_DELETE_CHARS, position, head, 8, NULL, 0);
+    } else if (type == REPLACE_OP) {
+        /* LOAD and its undo/redo: nothing but the whole document describes the result */
+        Wal *w = (Wal*)ctx;
+        char *doc = buffer_to_string(w->tb);
+        if (!doc) {
+            fprintf(stderr, "Memory allocation failed for load record\n");
+            exit(1);
+        }
+        wal_append(w, REC_LOAD, position, NULL, 0, doc, strlen(doc));
+        free(doc);
+    } else {
+        int rec = type == INSERT_OP ? REC_INSERT : type == DELETE_OP ? REC_DELETE : REC_UPDATE;
+        wal_append((Wal*)ctx, rec, position, NULL, 0, text, line_length(text));
+    }
+}
+
+void wal_log_snapshot(Wal *w) {
+    if (w) wal_append(w, REC_SNAPSHOT, 0, NULL, 0, NULL, 0);
+}
+
+void wal_log_restore(Wal *w, int id) {
+    if (w) wal_append(w, REC_RESTORE, id, NULL, 0, NULL, 0);
+}
+
+uint64_t wal_position(Wal *w) {
+    if (!w) return 0;
+    pthread_mutex_lock(&w->lock);
+    uint64_t pos = w->appended;
+    pthread_mutex_unlock(&w->lock);
+    return pos;
+}
+
+void wal_commit(Wal *w, uint64_t position) {
+    if (!w) return;
+    pthread_mutex_lock(&w->lock);
+    while (w->durable < position) {
+        if (w->flushing) {
+            /* a leader's flush may cover us too */
+            pthread_cond_wait(&w->flushed, &w->lock);
+            continue;
+        }
+        /* lead: take everything appended so far, appenders switch to the spare */
+        w->flushing = 1;
+        char *data = w->buf;
+        size_t n = w->len, cap = w->cap;
+        uint64_t upto = w->appended;
+        int fd = w->fd;
+        w->buf = w->wbuf;
+        w->cap = w->wcap;
+        w->len = 0;
+        w->wbuf = data;
+        w->wcap = cap;
+        pthread_mutex_unlock(&w->lock);
+        write_all(fd, data, n);
+        if (fdatasync(fd) < 0) {
+            perror("wal fdatasync");
+            exit(1);
+        }
+        pthread_mutex_lock(&w->lock);
+        w->durable = upto;
+        w->flushing = 0;
+        pthread_cond_broadcast(&w->flushed);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Finish the current segment and start the next one. Called with the
+   buffer lock held, so nothing is appended meanwhile. */
+static void wal_rotate(Wal *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->flushing) pthread_cond_wait(&w->flushed, &w->lock);
+    write_all(w->fd, w->buf, w->len);
+    if (fdatasync(w->fd) < 0) {
+        perror("wal fdatasync");
+        exit(1);
+    }
+    close(w->fd);
+    w->len = 0;
+    w->durable = w->appended;
+    w->seq++;
+    w->fd = open_segment(w, w->seq);
+    w->since_checkpoint = 0;
+    pthread_cond_broadcast(&w->flushed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* ---- checkpoints ---- */
+
+typedef struct {
+    FILE *f;
+    uint32_t sum;
+} CkptWriter;
+
+static void put(CkptWriter *cw, const void *p, size_t n) {
+    fwrite(p, 1, n, cw->f);
+    cw->sum = fnv1a(p, n, cw->sum);
+}
+
+static void put_u32(CkptWriter *cw, uint32_t v) { put(cw, &v, 4); }
+static void put_i32(CkptWriter *cw, int32_t v) { put(cw, &v, 4); }
+
+static void remove_older(Wal *w, uint64_t seq);
+
+static void put_delta(void *ctx, const void *p, size_t n) {
+    put((CkptWriter*)ctx, p, n);
+}
+
+static void wal_checkpoint(Wal *w) {
+    pthread_mutex_lock(w->buf_lock);
+    VersionDelta *doc = vtree_document_delta(w->vt, w->tb);
+    int next_id = w->vt->next_id;
+    int current = w->vt->current ? w->vt->current->id : 0;
+    int *ids = (int*)malloc(sizeof(int) * (next_id + 1));
+    int *parents = (int*)malloc(sizeof(int) * (next_id + 1));
+    VersionDelta **deltas = (VersionDelta**)malloc(sizeof(VersionDelta*) * (next_id + 1));
+    if (!ids || !parents || !deltas) {
+        fprintf(stderr, "Memory allocation failed for checkpoint\n");
+        exit(1);
+    }
+    int k = 0;
+    for (int id = 1; id < next_id; id++) {
+        VersionNode *v = vtree_find(w->vt, id);
+        if (!v) continue;
+        ids[k] = id;
+        parents[k] = v->parent ? v->parent->id : 0;
+        deltas[k] = vtree_delta(w->vt, v);
+        k++;
+    }
+    wal_rotate(w);
+    uint64_t seq = w->seq;
+    pthread_mutex_unlock(w->buf_lock);
+
+    /* everything below reads immutable snapshots and spill records only:
+       each version is written as the hunks against its parent it already
+       holds, or as its spill record, and the document as the hunks the
+       change log gives against the current version, so nothing is diffed
+       or reloaded */
+    char path[4096], tmp[4096 + 8];
+    file_path(w, path, sizeof(path), "checkpoint", seq);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        perror("checkpoint open");
+    } else {
+        CkptWriter cw = { f, FNV_INIT };
+        int failed = 0;
+        put(&cw, CKPT_MAGIC, CKPT_MAGIC_LEN);
+        put_i32(&cw, next_id);
+        put_i32(&cw, current);
+        put_u32(&cw, (uint32_t)k);
+        for (int i = 0; i < k && !failed; i++) {
+            put_i32(&cw, ids[i]);
+            put_i32(&cw, parents[i]);
+            if (vtree_delta_write(deltas[i], put_delta, &cw) < 0) failed = 1;
+        }
+        if (!failed) vtree_delta_write(doc, put_delta, &cw);
+        uint32_t sum = cw.sum;
+        fwrite(&sum, 4, 1, f);
+        int bad = fflush(f) != 0 || ferror(f) || fsync(fileno(f)) < 0;
+        if (fclose(f) != 0) bad = 1;
+        if (failed) {
+            /* a version lost to the spill file: keep the older checkpoint */
+            fprintf(stderr, "checkpoint: a spilled version could not be read\n");
+            unlink(tmp);
+        } else if (bad || rename(tmp, path) < 0) {
+            perror("checkpoint write");
+            unlink(tmp);
+        } else {
+            sync_dir(w);
+            remove_older(w, seq);
+        }
+    }
+
+    pthread_mutex_lock(w->buf_lock);
+    vtree_delta_free(w->tb, doc);
+    for (int i = 0; i < k; i++) vtree_delta_free(w->tb, deltas[i]);
+    pthread_mutex_unlock(w->buf_lock);
+    free(ids);
+    free(parents);
+    free(deltas);
+}
+
+static void* checkpoint_main(void *arg) {
+    Wal *w = (Wal*)arg;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        if (!w->checkpoint_wanted) {
+            pthread_cond_wait(&w->checkpoint_cond, &w->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+        wal_checkpoint(w);
+        pthread_mutex_lock(&w->lock);
+        w->checkpoint_wanted = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* ---- recovery ---- */
+
+static int parse_name(const char *name, const char *kind, uint64_t *seq) {
+    size_t k = strlen(kind);
+    if (strncmp(name, kind, k) != 0 || name[k] != '.') return 0;
+    char *end;
+    unsigned long long v = strtoull(name + k + 1, &end, 10);
+    if (end == name + k + 1 || *end) return 0;
+    *seq = v;
+    return 1;
+}
+
+/* delete segments and checkpoints older than seq */
+static void remove_older(Wal *w, uint64_t seq) {
+    DIR *d = opendir(w->dir);
+    if (!d) return;
+    struct dirent *e;
+    char path[4096];
+    while ((e = readdir(d))) {
+        uint64_t s;
+        if ((parse_name(e->d_name, "wal", &s) || parse_name(e->d_name, "checkpoint", &s)) && s < seq) {
+            snprintf(path, sizeof(path), "%s/%s", w->dir, e->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+static const char* map_file(const char *path, size_t *len) {
+    *len = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *p = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) p = NULL;
+        else *len = (size_t)st.st_size;
+    }
+    close(fd);
+    return (const char*)p;
+}
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int ok;
+} Reader;
+
+static uint32_t get_u32(Reader *r) {
+    uint32_t v = 0;
+    if (r->end - r->p < 4) { r->ok = 0; return 0; }
+    memcpy(&v, r->p, 4);
+    r->p += 4;
+    return v;
+}
+
+static const char* get_bytes(Reader *r, size_t n) {
+    if ((size_t)(r->end - r->p) < n) { r->ok = 0; return NULL; }
+    const char *p = r->p;
+    r->p += n;
+    return p;
+}
+
+typedef struct {
+    int a_pos;
+    int a_len;
+    int b_len;
+    const char *lines;  /* first of b_len encoded lines */
+} LoadHunk;
+
+/* a u32 count of hunks and the hunks; -1 if they run past the end */
+static int read_hunks(Reader *r, LoadHunk **hunks) {
+    uint32_t nh = get_u32(r);
+    if (!r->ok || nh > (size_t)(r->end - r->p) / 12) return -1;
+    free(*hunks);
+    *hunks = (LoadHunk*)malloc(sizeof(LoadHunk) * (nh ? nh : 1));
+    if (!*hunks) return -1;
+    for (uint32_t h = 0; h < nh && r->ok; h++) {
+        (*hunks)[h].a_pos = (int)get_u32(r);
+        (*hunks)[h].a_len = (int)get_u32(r);
+        (*hunks)[h].b_len = (int)get_u32(r);
+        (*hunks)[h].lines = r->p;
+        for (int j = 0; j < (*hunks)[h].b_len && r->ok; j++) get_bytes(r, get_u32(r));
+    }
+    return r->ok ? (int)nh : -1;
+}
+
+/* Apply read hunks to the buffer as edits, which the change log keeps */
+static void apply_hunks(Wal *w, LoadHunk *hunks, int nh, const char *end) {
+    /* last hunk first, so earlier positions stay valid */
+    for (int h = nh - 1; h >= 0; h--) {
+        for (int j = 0; j < hunks[h].a_len; j++) deleteLine_no_record(w->tb, hunks[h].a_pos);
+        Reader lr = { hunks[h].lines, end, 1 };
+        for (int j = 0; j < hunks[h].b_len; j++) {
+            uint32_t n = get_u32(&lr);
+            const char *p = get_bytes(&lr, n);
+            insertLine_no_record(w->tb, hunks[h].a_pos + j, scratch_str(w, p, n));
+        }
+    }
+}
+
+/* Rebuild the document and version tree from a checkpoint. Each version is
+   its parent restored (O(1)) plus its hunks, so versions share nodes just
+   like the ones they were saved from. The document is the current version
+   plus its hunks in the same way, which leaves the change log leading from
+   the current version to the document: the next SNAP is still charged
+   only what changed. */
+static int load_checkpoint(Wal *w, const char *path) {
+    size_t len;
+    const char *map = map_file(path, &len);
+    if (!map) return -1;
+    int rc = -1;
+    uint32_t sum;
+    LoadHunk *hunks = NULL;
+    if (len < CKPT_MAGIC_LEN + 4 || memcmp(map, CKPT_MAGIC, CKPT_MAGIC_LEN) != 0) goto out;
+    memcpy(&sum, map + len - 4, 4);
+    if (fnv1a(map, len - 4, FNV_INIT) != sum) goto out;
+
+    Reader r = { map + CKPT_MAGIC_LEN, map + len - 4, 1 };
+    int next_id = (int)get_u32(&r);
+    int current = (int)get_u32(&r);
+    uint32_t nversions = get_u32(&r);
+    for (uint32_t v = 0; v < nversions && r.ok; v++) {
+        int id = (int)get_u32(&r);
+        int parent = (int)get_u32(&r);
+        VersionNode *pv = parent ? vtree_find(w->vt, parent) : NULL;
+        int nh = r.ok && (!parent || pv) ? read_hunks(&r, &hunks) : -1;
+        if (nh < 0 || vtree_checkout(w->vt, w->tb, pv) < 0) { r.ok = 0; break; }
+        apply_hunks(w, hunks, nh, r.end);
+        w->vt->next_id = id;
+        vtree_snapshot(w->vt, w->tb, pv);
+    }
+    if (!r.ok) goto out;
+    VersionNode *cv = current ? vtree_find(w->vt, current) : NULL;
+    int nh = !current || cv ? read_hunks(&r, &hunks) : -1;
+    if (nh < 0 || r.p != r.end || vtree_checkout(w->vt, w->tb, cv) < 0) goto out;
+    apply_hunks(w, hunks, nh, r.end);
+    w->vt->next_id = next_id;
+    rc = 0;
+out:
+    free(hunks);
+    munmap((void*)map, len);
+    return rc;
+}
+
+/* apply the records of one segment; returns the bytes replayed */
+static size_t replay_segment(Wal *w, const char *path) {
+    size_t len;
+    const char *map = map_file(path, &len);
+    if (!map) return 0;
+    Reader r = { map, map + len, 1 };
+    while (r.end - r.p >= REC_HEADER) {
+        uint32_t body, sum;
+        memcpy(&body, r.p, 4);
+        memcpy(&sum, r.p + 4, 4);
+        if (body < 5 || body > (size_t)(r.end - r.p) - REC_HEADER) break;
+        const char *b = r.p + REC_HEADER;
+        if (fnv1a(b, body, FNV_INIT) != sum) break;
+        int32_t arg, head[2] = { 0, 0 };
+        memcpy(&arg, b + 1, 4);
+        memcpy(head, b + 5, body - 5 < 8 ? body - 5 : 8);
+        const char *text = b[0] == REC_LOAD ? NULL : scratch_str(w, b + 5, body - 5);
+        switch (b[0]) {
+        case REC_INSERT: insertLine_no_record(w->tb, arg, text); break;
+        case REC_DELETE: deleteLine_no_record(w->tb, arg); break;
+        case REC_UPDATE: updateLine_no_record(w->tb, arg, text); break;
+        case REC_INSERT_CHARS:
+            if (body >= 9) insertChars_no_record(w->tb, arg, head[0], b + 9, body - 9);
+            break;
+        case REC_DELETE_CHARS:
+            if (body >= 13) deleteChars_no_record(w->tb, arg, head[0], head[1]);
+            break;
+        case REC_LOAD: buffer_load_no_record(w->tb, b + 5, body - 5); break;
+        case REC_SNAPSHOT: vtree_snapshot(w->vt, w->tb, w->vt->current); break;
+        case REC_RESTORE: vtree_restore(w->vt, w->tb, arg); break;
+        }
+        r.p += REC_HEADER + body;
+    }
+    size_t done = (size_t)(r.p - map);
+    if (r.p != r.end) fprintf(stderr, "wal: %s: ignoring %zu bytes of torn tail\n", path, (size_t)(r.end - r.p));
+    munmap((void*)map, len);
+    return done;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+Wal* wal_open(const char *dir, TextBuffer *tb, VersionTree *vt, pthread_mutex_t *buf_lock,
+              size_t checkpoint_bytes) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("wal mkdir");
+        return NULL;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror("wal opendir");
+        return NULL;
+    }
+    Wal *w = (Wal*)calloc(1, sizeof(Wal));
+    if (!w) {
+        fprintf(stderr, "Memory allocation failed for Wal\n");
+        exit(1);
+    }
+    w->dir = strdup(dir);
+    w->tb = tb;
+    w->vt = vt;
+    w->buf_lock = buf_lock;
+    w->checkpoint_bytes = checkpoint_bytes;
+
+    uint64_t *segs = NULL, ckpt = 0;
+    int nsegs = 0, have_ckpt = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        uint64_t s;
+        if (parse_name(e->d_name, "checkpoint", &s)) {
+            if (!have_ckpt || s > ckpt) ckpt = s;
+            have_ckpt = 1;
+        } else if (parse_name(e->d_name, "wal", &s)) {
+            uint64_t *n = (uint64_t*)realloc(segs, sizeof(uint64_t) * (nsegs + 1));
+            if (!n) {
+                fprintf(stderr, "Memory allocation failed for wal segments\n");
+                exit(1);
+            }
+            segs = n;
+            segs[nsegs++] = s;
+        }
+    }
+    closedir(d);
+    if (nsegs) qsort(segs, nsegs, sizeof(uint64_t), cmp_seq);
+
+    char path[4096];
+    uint64_t last = ckpt;
+    if (have_ckpt) {
+        file_path(w, path, sizeof(path), "checkpoint", ckpt);
+        if (load_checkpoint(w, path) < 0) {
+            fprintf(stderr, "wal: cannot load %s\n", path);
+            free(segs);
+            free(w->dir);
+            free(w);
+            return NULL;
+        }
+    }
+    size_t replayed = 0;
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i] < ckpt) continue;
+        file_path(w, path, sizeof(path), "wal", segs[i]);
+        replayed += replay_segment(w, path);
+        if (segs[i] > last) last = segs[i];
+    }
+    free(segs);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->flushed, NULL);
+    pthread_cond_init(&w->checkpoint_cond, NULL);
+    w->seq = last + 1;
+    w->fd = open_segment(w, w->seq);
+    /* a long replay is folded into a checkpoint soon */
+    w->since_checkpoint = replayed;
+    setEditHook(tb, wal_edit_hook, w);
+    if (checkpoint_bytes) {
+        w->checkpoint_wanted = replayed >= checkpoint_bytes;
+        if (pthread_create(&w->checkpointer, NULL, checkpoint_main, w) == 0) w->has_checkpointer = 1;
+    }
+    return w;
+}
+
+void wal_close(Wal *w) {
+    if (!w) return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->checkpoint_cond);
+    pthread_mutex_unlock(&w->lock);
+    if (w->has_checkpointer) pthread_join(w->checkpointer, NULL);
+    wal_commit(w, wal_position(w));
+    close(w->fd);
+    pthread_mutex_lock(w->buf_lock);
+    setEditHook(w->tb, NULL, NULL);
+    pthread_mutex_unlock(w->buf_lock);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->flushed);
+    pthread_cond_destroy(&w->checkpoint_cond);
+    free(w->buf);
+    free(w->wbuf);
+    free(w->scratch);
+    free(w->dir);
+    free(w);
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "text_buffer.h"
+#include "version.h"
+
+/* Write-ahead log of a buffer and its version tree.
+
+   Every change to the line tree is appended as a record through the
+   buffer's edit hook (so undo/redo and batches are journaled as the line
+   edits they perform), together with SNAP and RESTORE. A writer reads the
+   log position under the buffer lock, drops the lock and waits in
+   wal_commit: the first waiter writes and fdatasyncs everything appended
+   so far, and every edit it covered is acknowledged by that one flush
+   (group commit).
+
+   After WAL_CHECKPOINT_BYTES of log, a background thread takes an O(1)
+   snapshot of the document and versions, starts a new log segment and
+   writes checkpoint.<seq> from the snapshot without holding the buffer
+   lock; older segments and checkpoints are then deleted. Recovery mmaps the
+   newest checkpoint and replays only the segments written after it. Undo
+   history is not journaled: it starts empty after a restart.
+
+   Lock order: buffer lock -> wal lock. */
+
+#define WAL_CHECKPOINT_BYTES ((size_t)64 << 20)
+
+typedef struct Wal Wal;
+
+/* Recover tb and vt (both empty) from dir, creating it if needed, then
+   journal every later change. buf_lock is the lock guarding tb and vt.
+   checkpoint_bytes of 0 disables checkpoints. Returns NULL on error. */
+Wal* wal_open(const char *dir, TextBuffer *tb, VersionTree *vt, pthread_mutex_t *buf_lock,
+              size_t checkpoint_bytes);
+void wal_close(Wal *w); /* flushes; tb and vt stay valid */
+
+/* Journal a SNAP / RESTORE <id> just performed; call under the buffer lock */
+void wal_log_snapshot(Wal *w);
+void wal_log_restore(Wal *w, int id);
+
+/* Log position after everything appended so far; call under the buffer
+   lock right after an edit. wal_commit then blocks, without the buffer
+   lock, until the log is durable up to that position. Both accept a NULL
+   log (persistence disabled) and do nothing. */
+uint64_t wal_position(Wal *w);
+void wal_commit(Wal *w, uint64_t position);
+
+#endif
\ No newline at end of file